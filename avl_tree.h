@@ -3,16 +3,335 @@
 
 #include <iostream>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <functional>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace avl {
 
-template <typename Key, typename T = Key, typename Cmp = std::less<Key>>
-class avl_tree final {
+// Counters of the work done by a tree with the "statistics" option, since it was created (or the counters were
+// reset).
+struct tree_statistics {
+    // Comparator calls made while looking for the keys and their insertion positions.
+    std::uint64_t comparisons{0};
+    // Rotations made to restore the balance after the insertions and erasures.
+    std::uint64_t single_rotations{0};
+    std::uint64_t double_rotations{0};
+    // Ancestors visited while updating the balance factors after the insertions and erasures.
+    std::uint64_t retrace_steps{0};
+};
+
+namespace detail {
+
+// Does the comparator return the three-way comparison result (negative, zero or positive int) instead of
+// the "less than" bool. Comparators opt in by defining the "is_three_way" member type.
+template <typename Cmp, typename = void>
+struct is_three_way : std::false_type {};
+template <typename Cmp>
+struct is_three_way<Cmp, std::void_t<typename Cmp::is_three_way>> : std::true_type {};
+
+// Does the key type provide a "compare" member function (like std::string does), which accepts the "Other" type.
+template <typename Key, typename Other = Key, typename = void>
+struct has_compare_member : std::false_type {};
+template <typename Key, typename Other>
+struct has_compare_member<Key, Other, std::void_t<decltype(std::declval<const Key &>().compare(std::declval<const Other &>()))>>
+    : std::true_type {};
+
+// Can the comparator compare the keys with the values of other types, without converting them to the key type.
+// Comparators opt in by defining the "is_transparent" member type, like std::less<> does.
+template <typename Cmp, typename = void>
+struct is_transparent : std::false_type {};
+template <typename Cmp>
+struct is_transparent<Cmp, std::void_t<typename Cmp::is_transparent>> : std::true_type {};
+
+// Three-way comparison of the two values, through the "compare" member function if there is one.
+template <typename Lhs, typename Rhs>
+int three_way_order(const Lhs &lhs, const Rhs &rhs) {
+    if constexpr (has_compare_member<Lhs, Rhs>::value) {
+        const auto order = lhs.compare(rhs);
+        return order < 0 ? -1 : (order > 0 ? 1 : 0);
+    } else
+        return lhs < rhs ? -1 : (rhs < lhs ? 1 : 0);
+}
+
+// Does the allocator place all the nodes into a single contiguous array. Allocators opt in by defining the
+// "contiguous_storage" member type.
+template <typename Alloc, typename = void>
+struct has_contiguous_storage : std::false_type {};
+template <typename Alloc>
+struct has_contiguous_storage<Alloc, std::void_t<typename Alloc::contiguous_storage>> : std::true_type {};
+
+// Does the allocator keep the nodes after the tree is gone, so that the next tree can take them over. Allocators
+// opt in by defining the "persistent_storage" member type, along with "stored_root", "stored_size" and
+// "store_root" members which hand over the root sentinel and the size of the tree.
+template <typename Alloc, typename = void>
+struct has_persistent_storage : std::false_type {};
+template <typename Alloc>
+struct has_persistent_storage<Alloc, std::void_t<typename Alloc::persistent_storage>> : std::true_type {};
+
+// Links of a tree node to its parent and children, stored as plain pointers. The balance factor of the node
+// determines which of its subtrees is taller ([-1,1] range allowed). It only needs two bits, so it is stored
+// (biased by one) in the low bits of the parent pointer, which are always zero due to the node alignment.
+template <typename NodeT>
+class pointer_links {
+public:
+    NodeT *parent() const noexcept { return reinterpret_cast<NodeT *>(_parent_balance & ~balance_mask); }
+    void set_parent(NodeT *parent) noexcept {
+        assert((reinterpret_cast<std::uintptr_t>(parent) & balance_mask) == 0 && "Misaligned node.");
+        _parent_balance = reinterpret_cast<std::uintptr_t>(parent) | (_parent_balance & balance_mask);
+    }
+
+    NodeT *left() const noexcept { return _left; }
+    void set_left(NodeT *left) noexcept { _left = left; }
+    NodeT *right() const noexcept { return _right; }
+    void set_right(NodeT *right) noexcept { _right = right; }
+
+    int balance() const noexcept { return static_cast<int>(_parent_balance & balance_mask) - balance_bias; }
+    void set_balance(int balance) noexcept {
+        assert(balance >= -1 && balance <= 1 && "Balance factor out of range.");
+        _parent_balance = (_parent_balance & ~balance_mask) | static_cast<std::uintptr_t>(balance + balance_bias);
+    }
+
+private:
+    static constexpr std::uintptr_t balance_mask = 3;
+    static constexpr int balance_bias = 1;
+
+    std::uintptr_t _parent_balance{balance_bias};
+    NodeT *_left{nullptr};
+    NodeT *_right{nullptr};
+};
+
+// Links of a tree node stored as 32-bit signed distances (counted in nodes) from the node itself to the
+// linked node, with zero standing for the null link. This halves the size of the links, and keeps them valid
+// if the whole array of nodes is copied or moved elsewhere, but only works if all the nodes of the tree are
+// elements of the same array. The balance factor is kept in the low bits of the parent link, which leaves
+// 30 bits for the distance to the parent.
+template <typename NodeT>
+class relative_links {
+    static constexpr int balance_bits = 2;
+    static constexpr std::int32_t balance_mask = 3;
+    static constexpr std::int32_t balance_bias = 1;
+
+public:
+    // Largest distance between two nodes which can be stored in a link.
+    static constexpr std::int32_t max_distance = std::numeric_limits<std::int32_t>::max() >> balance_bits;
+
+    NodeT *parent() const noexcept { return at((_parent_balance - (_parent_balance & balance_mask)) / (balance_mask + 1)); }
+    void set_parent(NodeT *parent) noexcept {
+        _parent_balance = distance_to(parent) * (balance_mask + 1) + (_parent_balance & balance_mask);
+    }
+
+    NodeT *left() const noexcept { return at(_left); }
+    void set_left(NodeT *left) noexcept { _left = distance_to(left); }
+    NodeT *right() const noexcept { return at(_right); }
+    void set_right(NodeT *right) noexcept { _right = distance_to(right); }
+
+    int balance() const noexcept { return (_parent_balance & balance_mask) - balance_bias; }
+    void set_balance(int balance) noexcept {
+        assert(balance >= -1 && balance <= 1 && "Balance factor out of range.");
+        _parent_balance = (_parent_balance - (_parent_balance & balance_mask)) + balance + balance_bias;
+    }
+
+private:
+    std::int32_t _parent_balance{balance_bias};
+    std::int32_t _left{0};
+    std::int32_t _right{0};
+
+    std::intptr_t address() const noexcept { return reinterpret_cast<std::intptr_t>(static_cast<const NodeT *>(this)); }
+
+    NodeT *at(std::int32_t distance) const noexcept {
+        if (distance == 0)
+            return nullptr;
+        return reinterpret_cast<NodeT *>(address() + static_cast<std::intptr_t>(distance) * static_cast<std::intptr_t>(sizeof(NodeT)));
+    }
+
+    std::int32_t distance_to(const NodeT *node) const noexcept {
+        if (!node)
+            return 0;
+        const auto bytes = reinterpret_cast<std::intptr_t>(node) - address();
+        assert(bytes % static_cast<std::intptr_t>(sizeof(NodeT)) == 0 && "Nodes are not elements of the same array.");
+        const auto distance = bytes / static_cast<std::intptr_t>(sizeof(NodeT));
+        assert(distance >= -max_distance && distance <= max_distance && "Nodes are too far apart.");
+        return static_cast<std::int32_t>(distance);
+    }
+};
+
+// Number of the nodes in the subtree rooted at a tree node. Only kept by the trees with the order statistics,
+// and empty otherwise.
+template <typename SizeT, bool Enabled>
+struct subtree_size {};
+template <typename SizeT>
+struct subtree_size<SizeT, true> {
+    SizeT _subtree_size{1};
+};
+
+// Links of a tree node to its in-order successor and predecessor. Only kept by the threaded trees, and empty
+// otherwise. The threads are never null - the ends of the order are linked to the root sentinel.
+template <typename NodeT, bool Relative, bool Enabled>
+struct thread_links {};
+template <typename NodeT>
+class thread_links<NodeT, false, true> {
+public:
+    NodeT *successor() const noexcept { return _successor; }
+    void set_successor(NodeT *successor) noexcept { _successor = successor; }
+    NodeT *predecessor() const noexcept { return _predecessor; }
+    void set_predecessor(NodeT *predecessor) noexcept { _predecessor = predecessor; }
+
+private:
+    NodeT *_successor{nullptr};
+    NodeT *_predecessor{nullptr};
+};
+// The threads stored as 32-bit signed distances, like the "relative_links". As the threads are never null, the
+// zero distance links the node to itself (the sentinel of an empty tree).
+template <typename NodeT>
+class thread_links<NodeT, true, true> {
+public:
+    NodeT *successor() const noexcept { return at(_successor); }
+    void set_successor(NodeT *successor) noexcept { _successor = distance_to(successor); }
+    NodeT *predecessor() const noexcept { return at(_predecessor); }
+    void set_predecessor(NodeT *predecessor) noexcept { _predecessor = distance_to(predecessor); }
+
+private:
+    std::int32_t _successor{0};
+    std::int32_t _predecessor{0};
+
+    std::intptr_t address() const noexcept { return reinterpret_cast<std::intptr_t>(static_cast<const NodeT *>(this)); }
+
+    NodeT *at(std::int32_t distance) const noexcept {
+        return reinterpret_cast<NodeT *>(address() + static_cast<std::intptr_t>(distance) * static_cast<std::intptr_t>(sizeof(NodeT)));
+    }
+
+    std::int32_t distance_to(const NodeT *node) const noexcept {
+        const auto bytes = reinterpret_cast<std::intptr_t>(node) - address();
+        assert(bytes % static_cast<std::intptr_t>(sizeof(NodeT)) == 0 && "Nodes are not elements of the same array.");
+        return static_cast<std::int32_t>(bytes / static_cast<std::intptr_t>(sizeof(NodeT)));
+    }
+};
+
+// The statistics counters of a tree. The tree derives from this class, which is empty (and its counting
+// functions do nothing) unless the statistics are enabled.
+template <bool Enabled>
+struct statistics_counters {
+    void count_comparison() const noexcept {}
+    void count_rotation(bool) const noexcept {}
+    void count_retrace_step() const noexcept {}
+};
+template <>
+struct statistics_counters<true> {
+    // Lookups on a const tree count too, so the counters are atomic: the concurrent lookups (and the workers of
+    // the set operations) add to them without the races.
+    mutable std::atomic<std::uint64_t> _comparisons{0};
+    mutable std::atomic<std::uint64_t> _single_rotations{0};
+    mutable std::atomic<std::uint64_t> _double_rotations{0};
+    mutable std::atomic<std::uint64_t> _retrace_steps{0};
+
+    void count_comparison() const noexcept { _comparisons.fetch_add(1, std::memory_order_relaxed); }
+    void count_rotation(bool double_rotation) const noexcept {
+        (double_rotation ? _double_rotations : _single_rotations).fetch_add(1, std::memory_order_relaxed);
+    }
+    void count_retrace_step() const noexcept { _retrace_steps.fetch_add(1, std::memory_order_relaxed); }
+
+    // The values of the counters. Each of them is read separately, so the counts of the concurrent operations may
+    // be partly included.
+    tree_statistics snapshot() const noexcept {
+        tree_statistics statistics;
+        statistics.comparisons = _comparisons.load(std::memory_order_relaxed);
+        statistics.single_rotations = _single_rotations.load(std::memory_order_relaxed);
+        statistics.double_rotations = _double_rotations.load(std::memory_order_relaxed);
+        statistics.retrace_steps = _retrace_steps.load(std::memory_order_relaxed);
+        return statistics;
+    }
+    void reset() noexcept {
+        for (auto *counter : {&_comparisons, &_single_rotations, &_double_rotations, &_retrace_steps})
+            counter->store(0, std::memory_order_relaxed);
+    }
+};
+
+} // end namespace detail
+
+// Three-way comparator for the keys. Uses the key's "compare" member function if there is one, so that each
+// comparison of the string keys takes a single pass over the strings. Otherwise, falls back to "operator<".
+template <typename Key>
+struct three_way_compare {
+    using is_three_way = void;
+
+    int operator()(const Key &lhs, const Key &rhs) const { return detail::three_way_order(lhs, rhs); }
+};
+
+// Transparent three-way comparator, which compares the values of different types (e.g. std::string keys with
+// std::string_view) without converting them.
+template <>
+struct three_way_compare<void> {
+    using is_three_way = void;
+    using is_transparent = void;
+
+    template <typename Lhs, typename Rhs>
+    int operator()(const Lhs &lhs, const Rhs &rhs) const { return detail::three_way_order(lhs, rhs); }
+};
+
+// Tags for constructing the tree from a sorted range. "sorted_unique" promises that the keys in the range are
+// sorted and unique, while "sorted_equivalent" allows runs of equal keys, out of which only the first element
+// is kept.
+struct sorted_unique_t {
+    explicit sorted_unique_t() = default;
+};
+inline constexpr sorted_unique_t sorted_unique{};
+
+struct sorted_equivalent_t {
+    explicit sorted_equivalent_t() = default;
+};
+inline constexpr sorted_equivalent_t sorted_equivalent{};
+
+// Optional features of the tree, selected at compile time. The "Options" parameter of the tree is a class with
+// the same members as "default_options" - the simplest way to get one is to derive from it and override some of
+// the members. The disabled features cost nothing.
+struct default_options {
+    // Keep the number of nodes in every subtree, which gives the order statistic queries ("nth", "rank" and
+    // "count_range") in logarithmic time. Costs a counter per node, and a walk up to the root on every
+    // insertion and erasure.
+    static constexpr bool order_statistics = false;
+    // Count the comparisons, rotations and retrace steps (see "tree_statistics"). Costs an atomic increment per
+    // counted event, and makes even the lookups write to the counters, which the concurrent lookups contend on.
+    static constexpr bool statistics = false;
+    // Link every node to its in-order successor and predecessor, so that stepping an iterator is a single link
+    // chase instead of a walk over the tree, and the range scans run at the speed of a linked list. Costs two
+    // links per node and a constant amount of work per insertion and erasure; the bulk operations (copying,
+    // building from a sorted range, loading and the set operations) relink the whole tree in linear time.
+    static constexpr bool threaded_links = false;
+};
+
+// Options of the tree with the order statistics.
+struct order_statistics_options : default_options {
+    static constexpr bool order_statistics = true;
+};
+
+// Options of the tree with the statistics counters.
+struct statistics_options : default_options {
+    static constexpr bool statistics = true;
+};
+
+// Options of the tree with the threaded links.
+struct threaded_options : default_options {
+    static constexpr bool threaded_links = true;
+};
+
+template <typename Key, typename T = Key, typename Cmp = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, T>>, typename Options = default_options>
+class avl_tree final : private detail::statistics_counters<Options::statistics> {
 public:
     using size_type = std::size_t;
     using balance_type = int8_t;
@@ -20,373 +339,1538 @@ public:
     using val_type = T;
     using node_val_type = std::pair<const key_type, val_type>;
     using cmp_type = Cmp;
+    using allocator_type = Alloc;
+    using options_type = Options;
 
 private:
-    // Data structure representing a node in the tree. Holds the payload, balance factor, and pointers to
-    // descendants and ancestor.
-    struct Node final {
+    // The nodes allocated through an allocator with contiguous storage are linked by 32-bit offsets, and
+    // through the plain pointers otherwise.
+    static constexpr bool relative_links = detail::has_contiguous_storage<allocator_type>::value;
+    template <typename NodeT>
+    using links_type = std::conditional_t<relative_links, detail::relative_links<NodeT>, detail::pointer_links<NodeT>>;
+
+    // The trees with the contiguous storage cannot have more nodes than the 32-bit links can address, so
+    // a 32-bit counter is enough for the subtree sizes.
+    static constexpr bool order_statistics = options_type::order_statistics;
+    using subtree_size_type = std::conditional_t<relative_links, std::uint32_t, size_type>;
+
+    // The threaded trees link the nodes in the key order into a ring through the root sentinel: its successor
+    // is the first node, and its predecessor the last one.
+    static constexpr bool threaded = options_type::threaded_links;
+
+    // Data structure representing a node in the tree. Holds the payload, balance factor, and links to
+    // descendants and ancestor. The children are owned by the tree, which allocates and frees the nodes
+    // through its allocator.
+    struct Node final : links_type<Node>, detail::subtree_size<subtree_size_type, order_statistics>,
+                        detail::thread_links<Node, relative_links, threaded> {
         // Payload is a <key, value> pair.
         node_val_type _value{};
 
-        // Balance factor of the node determines which of its subtrees is taller ([-1,1] range allowed).
-        balance_type _balance_factor{0};
-
-        // Pointers to descendants and the ancestor. Parent pointer need not be unique_ptr as we don't
-        // expect the children to outlive the parent (dark).
-        Node *_parent{nullptr};
-        std::unique_ptr<Node> _left{nullptr};
-        std::unique_ptr<Node> _right{nullptr};
-
         Node() = default;
-        explicit Node(const node_val_type &value, Node *parent) : _value(value), _parent(parent) {}
-        Node(const Node &) = default;
-        Node(Node &&) = default;
-        Node &operator=(const Node &) = default;
-        Node &operator=(Node &&) = default;
+        explicit Node(const node_val_type &value, Node *parent) : _value(value) { this->set_parent(parent); }
+        explicit Node(node_val_type &&value, Node *parent) : _value(std::move(value)) { this->set_parent(parent); }
+        Node(const Node &) = delete;
+        Node(Node &&) = delete;
+        Node &operator=(const Node &) = delete;
+        Node &operator=(Node &&) = delete;
 
         friend bool operator==(const Node &lhs, const Node &rhs) noexcept { return lhs._value == rhs._value; }
         friend bool operator!=(const Node &lhs, const Node &rhs) noexcept { return lhs._value != rhs._value; }
     };
+    static_assert(relative_links || alignof(Node) >= 4, "Node alignment leaves no room for the balance factor.");
 
     using node_type = Node;
-
+    using node_allocator_type = typename std::allocator_traits<allocator_type>::template rebind_alloc<node_type>;
+    using node_alloc_traits = std::allocator_traits<node_allocator_type>;
+
+    // With the persistent storage, the nodes outlive the tree, and the next tree constructed with the same
+    // storage takes them over (e.g. a memory-mapped file, reopened after a restart). The nodes are reused as
+    // they are, so they must not own any other memory, and must be linked by the offsets, which do not depend
+    // on where the storage is mapped.
+    static constexpr bool persistent_storage = detail::has_persistent_storage<node_allocator_type>::value;
+    static_assert(!persistent_storage || (relative_links && std::is_trivially_copyable_v<key_type> &&
+                                          std::is_trivially_copyable_v<val_type>),
+                  "The persistent storage needs the contiguous storage and the trivially copyable elements.");
+
+    // Can the move assignment always take over the nodes of the other tree, i.e. free them later.
+    static constexpr bool takes_over_nodes = node_alloc_traits::propagate_on_container_move_assignment::value ||
+                                             node_alloc_traits::is_always_equal::value;
+
+    // Allocator used for all the nodes of the tree, including the sentinel root.
+    node_allocator_type _node_allocator{};
     // A "false" root used as the end() iterator. Its "_left" pointer points to the "real" root of the tree
     // (if the tree is not empty). Its position in the tree allows us to implement bidirectonal iterator
     // without a special case for the end() iterator.
-    std::unique_ptr<node_type> _root_sentinel{nullptr};
+    node_type *_root_sentinel{nullptr};
     // Cached pointer to the first (bottom-left-most) node in the tree. Updated during the insertion and
     // deletion, if needed. Used for faster construction of the begin() iterator.
     node_type *_begin{nullptr};
+    // Cached pointer to the last (bottom-right-most) node in the tree, or the sentinel root if the tree is
+    // empty. Lets the hinted insertion append after the greatest element without walking the right spine.
+    node_type *_last{nullptr};
 
     // Cached size of the tree (excluding the sentinel root).
     size_type _size{0};
     // Instance of the comparator class, used for key comparison.
-    const cmp_type _comparator{};
+    cmp_type _comparator{};
+
+    // A three-way comparator tells us in a single call whether the key is less than, equal to or greater than
+    // the node's key. With the "less than" comparator, the equality is checked only once, after the descent.
+    static constexpr bool three_way = detail::is_three_way<cmp_type>::value;
 
     // Returns the "real" root of the tree.
-    node_type *root() noexcept { return _root_sentinel->_left.get(); }
-    const node_type *root() const noexcept { return _root_sentinel->_left.get(); }
+    node_type *root() noexcept { return _root_sentinel->left(); }
+    const node_type *root() const noexcept { return _root_sentinel->left(); }
+
+    // Allocate a node and construct it in place. The memory is released if the construction throws.
+    template <class... Args>
+    node_type *create_node(Args&&... args) {
+        auto *node = node_alloc_traits::allocate(_node_allocator, 1);
+        try {
+            node_alloc_traits::construct(_node_allocator, node, std::forward<Args>(args)...);
+        } catch (...) {
+            node_alloc_traits::deallocate(_node_allocator, node, 1);
+            throw;
+        }
+        return node;
+    }
+
+    // Destroy the node and give its memory back to the allocator.
+    void destroy_node(node_type *node) noexcept {
+        node_alloc_traits::destroy(_node_allocator, node);
+        node_alloc_traits::deallocate(_node_allocator, node, 1);
+    }
+
+    // Destroy all the nodes in a subtree rooted at "node". Returns the number of the destroyed nodes.
+    size_type destroy_subtree(node_type *node) noexcept {
+        if (!node)
+            return 0;
+        const auto destroyed = destroy_subtree(node->left()) + destroy_subtree(node->right());
+        destroy_node(node);
+        return destroyed + 1;
+    }
+
+    // Make this (empty) tree a copy of the "other" tree. With "Move", the elements of the other tree are moved from
+    // (only the keys, which are const, are copied).
+    template <bool Move = false>
+    void copy_from(std::conditional_t<Move, avl_tree, const avl_tree> &other) {
+        _root_sentinel->set_left(copy_subtree<Move>(other.root(), _root_sentinel));
+        _begin = root() ? smallest_subtree_elt(root()) : _root_sentinel;
+        _last = root() ? greatest_subtree_elt(root()) : _root_sentinel;
+        _size = other._size;
+        thread_all();
+    }
+
+    // The node with the next greater (smaller) key, found by walking the tree. The root sentinel follows the
+    // last node, and precedes the first one.
+    static node_type *tree_successor(node_type *node) noexcept {
+        if (node->right())
+            return smallest_subtree_elt(node->right());
+        while (node != node->parent()->left())
+            node = node->parent();
+        return node->parent();
+    }
+    static node_type *tree_predecessor(node_type *node) noexcept {
+        if (node->left())
+            return greatest_subtree_elt(node->left());
+        while (node != node->parent()->right())
+            node = node->parent();
+        return node->parent();
+    }
+
+    // Make "next" the successor of "prev" in the threaded tree.
+    static void link_threads(node_type *prev, node_type *next) noexcept {
+        if constexpr (threaded) {
+            prev->set_successor(next);
+            next->set_predecessor(prev);
+        }
+    }
+
+    // Link the ends of the order to the root sentinel, after the first or the last node has changed.
+    void link_thread_ends() noexcept {
+        if constexpr (threaded) {
+            if (root()) {
+                link_threads(_root_sentinel, _begin);
+                link_threads(_last, _root_sentinel);
+            } else
+                link_threads(_root_sentinel, _root_sentinel);
+        }
+    }
+
+    // Relink all the nodes of the threaded tree in the key order, by walking the tree. Takes linear time.
+    void thread_all() noexcept {
+        if constexpr (threaded) {
+            auto *prev = _root_sentinel;
+            for (auto *node = _begin; node != _root_sentinel; node = tree_successor(node)) {
+                link_threads(prev, node);
+                prev = node;
+            }
+            link_threads(prev, _root_sentinel);
+        }
+    }
+
+    // The root sentinel left in the persistent storage by the previous tree, or a new one. The new one is
+    // stored right away, so that the storage always knows where the nodes of the tree are.
+    node_type *open_root_sentinel() {
+        if constexpr (persistent_storage) {
+            if (auto *sentinel = _node_allocator.stored_root())
+                return sentinel;
+            auto *sentinel = create_node();
+            _node_allocator.store_root(sentinel, 0);
+            return sentinel;
+        } else
+            return create_node();
+    }
+
+    // Pick up the state of the nodes taken over from the persistent storage.
+    void open_stored_nodes() noexcept {
+        if constexpr (persistent_storage) {
+            _begin = root() ? smallest_subtree_elt(root()) : _root_sentinel;
+            _last = root() ? greatest_subtree_elt(root()) : _root_sentinel;
+            _size = _node_allocator.stored_size();
+        }
+    }
+
+    // Is this tree the one kept in the persistent storage. The trees split off it (or made for the set operations)
+    // have sentinels of their own, which are never stored, and their nodes are destroyed with them.
+    bool stored() const noexcept {
+        if constexpr (persistent_storage) {
+            // The storage only throws if it holds the nodes of a different size, which no tree could have opened.
+            try {
+                return _node_allocator.stored_root() == _root_sentinel;
+            } catch (...) {
+                return false;
+            }
+        } else
+            return false;
+    }
+
+    // Destroy all the nodes, including the sentinel root, which leaves the tree fit only for the destruction. With
+    // the persistent storage, the nodes of the stored tree are left in the storage instead, for the next tree.
+    void release() noexcept {
+        if (!_root_sentinel)
+            return;
+        if (stored()) {
+            if constexpr (persistent_storage)
+                _node_allocator.store_root(_root_sentinel, _size);
+        } else {
+            destroy_subtree(root());
+            destroy_node(_root_sentinel);
+        }
+        _root_sentinel = nullptr;
+        _begin = nullptr;
+        _last = nullptr;
+        _size = 0;
+    }
+
+    // Make a copy of the subtree rooted at "node", preserving its shape and balance factors. The copy is
+    // attached to the "parent" node. With "Move", the elements are moved into the copy.
+    template <bool Move = false>
+    node_type *copy_subtree(std::conditional_t<Move, node_type, const node_type> *node, node_type *parent) {
+        if (!node)
+            return nullptr;
+
+        node_type *copy;
+        if constexpr (Move)
+            copy = create_node(std::move(node->_value), parent);
+        else
+            copy = create_node(node->_value, parent);
+        copy->set_balance(node->balance());
+        if constexpr (order_statistics)
+            copy->_subtree_size = node->_subtree_size;
+        try {
+            copy->set_left(copy_subtree<Move>(node->left(), copy));
+            copy->set_right(copy_subtree<Move>(node->right(), copy));
+        } catch (...) {
+            destroy_subtree(copy);
+            throw;
+        }
+        return copy;
+    }
 
     // Find the element with the smallest key in a subtree rooted at "node".
     static node_type *smallest_subtree_elt(node_type *node) noexcept {
-        if (node->_left == nullptr)
-            return node;
-        return smallest_subtree_elt(node->_left.get());
+        while (node->left())
+            node = node->left();
+        return node;
     }
 
     // Find the element with the greatest key in a subtree rooted at "node".
     static node_type *greatest_subtree_elt(node_type *node) noexcept {
-        if (node->_right == nullptr)
-            return node;
-        return largest_subtree_elt(node->_right.get());
+        while (node->right())
+            node = node->right();
+        return node;
     }
 
     // Creates a new node with the "value" payload and inserts it at the appropriate position in the tree.
-    // The first call of this function should pass root node as "insert", while the subsequent recursive
-    // calls will descend down the tree until the appropriate empty position is found.
+    // The search starts at the "insert" node (usually the root) and descends down the tree until the
+    // appropriate empty position is found. Returns the new node and "true", or the node which already holds
+    // the given key and "false". Each visited node costs a single key comparison.
     template <class ValT>
-    node_type *insert_internal(node_type *insert, ValT &&value) {
+    std::pair<node_type *, bool> insert_internal(node_type *insert, ValT &&value) {
+        const auto position = find_insert_position(insert, value.first);
+        // If the element with the given key already exists, return it without inserting the new element.
+        if (position.found)
+            return std::make_pair(position.node, false);
+        return std::make_pair(attach_node(position.node, position.left, std::forward<ValT>(value)), true);
+    }
+
+    // Where the node with the given key belongs in the subtree: the node it becomes the left (or the right)
+    // child of. If the key already exists, the node which holds it, with "found" set.
+    struct insert_position {
+        node_type *node;
+        bool left;
+        bool found;
+    };
+
+    template <class K>
+    insert_position find_insert_position(node_type *insert, const K &key) const {
         assert(insert && "Inserting at nullptr.");
 
-        // If the element with the given key already exists, return it without inserting the new element.
-        if (!_comparator(value.first, insert->_value.first) && !_comparator(insert->_value.first, value.first))
-            return insert;
-        // If the given key is less than the "insert" node's key, we will be inserting in the left subtree.
-        else if (_comparator(value.first, insert->_value.first)) {
-            if (insert->_left == nullptr) {
-                insert->_left = std::make_unique<node_type>(std::forward<ValT>(value), insert);
-                if (insert == _begin)
-                    _begin = insert->_left.get();
-                ++_size;
-                return insert->_left.get();
-            } else
-                return insert_internal(insert->_left.get(), std::forward<ValT>(value));
-        // Conversely, insert in the right subtree.
-        } else {
-            if (insert->_right == nullptr) {
-                insert->_right = std::make_unique<node_type>(std::forward<ValT>(value), insert);
-                ++_size;
-                return insert->_right.get();
+        // The last node we descended right from - the greatest visited key not greater than the given key.
+        // If the given key already exists, this is the node which holds it.
+        node_type *not_greater = nullptr;
+        bool insert_left;
+        for (;;) {
+            this->count_comparison();
+            if constexpr (three_way) {
+                const auto order = _comparator(key, insert->_value.first);
+                if (order == 0)
+                    return {insert, false, true};
+                insert_left = order < 0;
             } else {
-                return insert_internal(insert->_right.get(), std::forward<ValT>(value));
+                insert_left = _comparator(key, insert->_value.first);
+                if (!insert_left)
+                    not_greater = insert;
             }
+
+            auto *next = insert_left ? insert->left() : insert->right();
+            if (!next)
+                break;
+            insert = next;
         }
+
+        if constexpr (!three_way) {
+            if (not_greater) {
+                this->count_comparison();
+                if (!_comparator(not_greater->_value.first, key))
+                    return {not_greater, false, true};
+            }
+        }
+
+        // If the given key is less than the "insert" node's key, the new node is its left child. Conversely,
+        // it is the right child.
+        return {insert, insert_left, false};
     }
 
-    // Erase the node at the given position.
+    // Like "insert_internal", but the position is first looked for next to the "hint" node. If the key belongs
+    // right before or right after the hint (or after the greatest element, if the hint is the sentinel root),
+    // the new node is attached there after at most two walks to the neighbouring node, which is constant time
+    // on average. Otherwise, the search falls back to the descent from the root. Expects a non-empty tree.
+    template <class ValT>
+    std::pair<node_type *, bool> insert_hint_internal(node_type *hint, ValT &&value) {
+        const auto &key = value.first;
+        if (hint == _root_sentinel) {
+            if (key_less(_last->_value.first, key))
+                return std::make_pair(attach_node(_last, false, std::forward<ValT>(value)), true);
+        } else if (key_less(key, hint->_value.first)) {
+            if (hint == _begin)
+                return std::make_pair(attach_node(hint, true, std::forward<ValT>(value)), true);
+
+            // The key belongs between the predecessor and the hint. Either the hint has no left subtree,
+            // or the predecessor is the greatest node in it, and has no right child.
+            auto *before = (--iterator(hint))._ptr;
+            if (key_less(before->_value.first, key)) {
+                if (!hint->left())
+                    return std::make_pair(attach_node(hint, true, std::forward<ValT>(value)), true);
+                return std::make_pair(attach_node(before, false, std::forward<ValT>(value)), true);
+            }
+        } else if (key_less(hint->_value.first, key)) {
+            if (hint == _last)
+                return std::make_pair(attach_node(hint, false, std::forward<ValT>(value)), true);
+
+            // The key belongs between the hint and the successor. Mirror image of the case above.
+            auto *after = (++iterator(hint))._ptr;
+            if (key_less(key, after->_value.first)) {
+                if (!hint->right())
+                    return std::make_pair(attach_node(hint, false, std::forward<ValT>(value)), true);
+                return std::make_pair(attach_node(after, true, std::forward<ValT>(value)), true);
+            }
+        } else
+            return std::make_pair(hint, false);
+
+        return insert_internal(root(), std::forward<ValT>(value));
+    }
+
+    // Creates a new node with the "value" payload and attaches it as the left (or the right) child of the
+    // "parent" node. The child position must be empty, and the key must belong there.
+    template <class ValT>
+    node_type *attach_node(node_type *parent, bool left, ValT &&value) {
+        return attach_node(parent, left, create_node(std::forward<ValT>(value), parent));
+    }
+
+    // Same, but attaches the detached "new_node" (see "detach_node").
+    node_type *attach_node(node_type *parent, bool left, node_type *new_node) noexcept {
+        new_node->set_parent(parent);
+        if constexpr (threaded) {
+            // The left child comes right before its parent, and the right child right after it.
+            auto *prev = left ? parent->predecessor() : parent;
+            auto *next = prev->successor();
+            link_threads(prev, new_node);
+            link_threads(new_node, next);
+        }
+        if (left) {
+            parent->set_left(new_node);
+            if (parent == _begin)
+                _begin = new_node;
+        } else {
+            parent->set_right(new_node);
+            if (parent == _last)
+                _last = new_node;
+        }
+        if constexpr (order_statistics) {
+            for (auto *node = parent; node != _root_sentinel; node = node->parent())
+                ++node->_subtree_size;
+        }
+        ++_size;
+        return new_node;
+    }
+
+    // Remove the node at the given position from the tree without destroying it, and clear its links, so that
+    // it can be attached to this or another tree again.
+    node_type *detach_node(node_type *pos) noexcept {
+        unlink_node(pos);
+        --_size;
+        pos->set_left(nullptr);
+        pos->set_right(nullptr);
+        pos->set_balance(0);
+        if constexpr (order_statistics)
+            pos->_subtree_size = 1;
+        return pos;
+    }
+
+    // Erase the node at the given position, and rebalance the tree.
     void erase_internal(node_type *pos) noexcept {
-        auto single_child = [pos, this]() -> std::unique_ptr<node_type>& {
-            if (pos->_left && !pos->_right)
-                return pos->_left;
-            else if (pos->_right && !pos->_left)
-                return pos->_right;
-            else
+        unlink_node(pos);
+        destroy_node(pos);
+    }
+
+    // Remove the node at the given position from the tree without destroying it, and rebalance the tree.
+    void unlink_node(node_type *pos) noexcept {
+        if constexpr (threaded)
+            link_threads(pos->predecessor(), pos->successor());
+        // If the node has two children, swap it with its successor (element with the smallest key from
+        // the right subtree). The node we want to erase then has at most one child.
+        if (pos->left() && pos->right())
+            swap_with_successor(pos);
+
+        // We actually need the node not to be erased before the retrace call. Luckily, we can just
+        // call retrace before the actual deletion, and act as if the node had already been deleted.
+        retrace_erase(pos);
+        // The rotations have counted the node in the sizes of the subtrees, so its ancestors are one too large.
+        if constexpr (order_statistics) {
+            for (auto *node = pos->parent(); node != _root_sentinel; node = node->parent())
+                --node->_subtree_size;
+        }
+
+        auto *parent = pos->parent();
+        auto *child = pos->left() ? pos->left() : pos->right();
+        // Replace the node with its only child (or nothing, if the node is a leaf).
+        if (pos == parent->left()) {
+            parent->set_left(child);
+            if (pos == _begin)
+                _begin = child ? smallest_subtree_elt(child) : parent;
+        } else
+            parent->set_right(child);
+        if (pos == _last)
+            _last = child ? greatest_subtree_elt(child) : parent;
+        if (child)
+            child->set_parent(parent);
+    }
+
+    // Swap the positions of the node and its successor in the tree. The nodes themselves (and their
+    // payloads) stay in place, so the iterators pointing to them remain valid.
+    void swap_with_successor(node_type *pos) noexcept {
+        auto *swap_node = smallest_subtree_elt(pos->right());
+        auto *swap_node_right = swap_node->right();
+        auto *pos_parent = pos->parent();
+        replace_child(pos_parent, pos, swap_node);
+        const auto pos_balance = pos->balance();
+        pos->set_balance(swap_node->balance());
+        swap_node->set_balance(pos_balance);
+        if constexpr (order_statistics)
+            std::swap(pos->_subtree_size, swap_node->_subtree_size);
+
+        // The successor has no left child, so it simply takes over the node's left subtree.
+        swap_node->set_left(pos->left());
+        swap_node->left()->set_parent(swap_node);
+        pos->set_left(nullptr);
+
+        // If the successor is the node's right child, the node becomes successor's right child.
+        // Otherwise, the node takes successor's place as the left child of successor's parent.
+        if (swap_node == pos->right()) {
+            swap_node->set_right(pos);
+            pos->set_parent(swap_node);
+        } else {
+            pos->set_parent(swap_node->parent());
+            pos->parent()->set_left(pos);
+            swap_node->set_right(pos->right());
+            swap_node->right()->set_parent(swap_node);
+        }
+        swap_node->set_parent(pos_parent);
+
+        pos->set_right(swap_node_right);
+        if (swap_node_right)
+            swap_node_right->set_parent(pos);
+    }
+
+    // Search the tree until we find the node with given key. If the key does not exist in the
+    // tree, return the sentinel root - the end() iterator. The lookup functions take the key of any type
+    // the comparator accepts, which only differs from "key_type" if the comparator is transparent.
+    template <class K>
+    node_type *find_internal(node_type *root, const K &key) const noexcept {
+        if constexpr (three_way) {
+            while (root) {
+                this->count_comparison();
+                const auto order = _comparator(key, root->_value.first);
+                if (order == 0)
+                    return root;
+                root = order < 0 ? root->left() : root->right();
+            }
+            return _root_sentinel;
+        } else {
+            // Find the node with the smallest key not less than the given key, and check for equality once
+            // we reach the bottom of the tree.
+            auto *not_less = lower_bound_internal(root, key);
+            if (not_less == _root_sentinel)
                 return _root_sentinel;
-        };
+            this->count_comparison();
+            return !_comparator(key, not_less->_value.first) ? not_less : _root_sentinel;
+        }
+    }
+
+    // Find the node with the smallest key not less than the given key. If there is no such node, return the
+    // sentinel root - the end() iterator.
+    template <class K>
+    node_type *lower_bound_internal(node_type *root, const K &key) const {
+        node_type *not_less = _root_sentinel;
+        while (root) {
+            this->count_comparison();
+            if constexpr (three_way) {
+                const auto order = _comparator(key, root->_value.first);
+                // No smaller key in the tree can be greater than or equal to the given key.
+                if (order == 0)
+                    return root;
+                if (order > 0) {
+                    root = root->right();
+                    continue;
+                }
+            } else if (_comparator(root->_value.first, key)) {
+                root = root->right();
+                continue;
+            }
+            not_less = root;
+            root = root->left();
+        }
+        return not_less;
+    }
 
-        // If the node at the given position is a leaf node, just reset the parent's
-        // pointer.
-        if (!pos->_left && !pos->_right) {
-            auto *parent = pos->_parent;
-            if (pos == parent->_left.get()) {
-                parent->_left.reset(nullptr);
-                if (pos == _begin)
-                    _begin = parent;
+    // Find the node with the smallest key greater than the given key. If there is no such node, return the
+    // sentinel root - the end() iterator.
+    template <class K>
+    node_type *upper_bound_internal(node_type *root, const K &key) const {
+        node_type *greater = _root_sentinel;
+        while (root) {
+            if (key_less(key, root->_value.first)) {
+                greater = root;
+                root = root->left();
             } else
-                parent->_right.reset(nullptr);
-        // If the node has a single child, swap it with the child and delete it.
-        } else if (auto &child = single_child(); child.get() != _root_sentinel.get()) {
-            auto *pos_parent = pos->_parent;
-            if (pos == pos->_parent->_left.get()) {
-                std::swap(pos_parent->_left, child);
-                pos_parent->_left->_parent = pos_parent;
-                if (pos == _begin)
-                    _begin = pos_parent->_left.get();
-                // The "child" pointer now points to the node we want to erase, but the
-                // pointer itself is a member of that node. In order to delete the node,
-                // we need to reset the pointer.
-                child.reset(nullptr);
-            } else {
-                std::swap(pos_parent->_right, child);
-                pos_parent->_right->_parent = pos_parent;
-                // Same as above.
-                child.reset(nullptr);
+                root = root->right();
+        }
+        return greater;
+    }
+
+    // Find the range of the nodes with the given key - the node holding the key and the node after it, or
+    // the lower bound twice if the key does not exist in the tree.
+    template <class K>
+    std::pair<node_type *, node_type *> equal_range_internal(node_type *root, const K &key) const {
+        auto *lower = lower_bound_internal(root, key);
+        if (lower == _root_sentinel || key_less(key, lower->_value.first))
+            return std::make_pair(lower, lower);
+        return std::make_pair(lower, (++iterator(lower))._ptr);
+    }
+
+    // Is the "lhs" key less than the "rhs" key.
+    template <class L, class R>
+    bool key_less(const L &lhs, const R &rhs) const {
+        if constexpr (three_way)
+            return _comparator(lhs, rhs) < 0;
+        else
+            return _comparator(lhs, rhs);
+    }
+
+    // Height of the subtree with "size" nodes built by "build_sorted_subtree".
+    static int sorted_subtree_height(size_type size) noexcept {
+        int height = 0;
+        for (; size; size >>= 1)
+            ++height;
+        return height;
+    }
+
+    // Build a perfectly balanced subtree out of the next "size" elements of the sorted range, starting at "it".
+    // Every subtree gets the middle element as its root, and the elements before and after it as its left and
+    // right subtrees. The right subtree gets the extra element if there is one, so the balance factors are
+    // always 0 or 1. Unless the elements are "unique", the elements with the same key as the previously built
+    // node ("last") are skipped.
+    template <class ItT>
+    node_type *build_sorted_subtree(ItT &it, size_type size, bool unique, node_type *&last) {
+        if (size == 0)
+            return nullptr;
+
+        const size_type left_size = (size - 1) / 2;
+        const size_type right_size = size - 1 - left_size;
+        auto *left = build_sorted_subtree(it, left_size, unique, last);
+
+        node_type *node = nullptr;
+        try {
+            if (!unique) {
+                while (last && !key_less(last->_value.first, (*it).first))
+                    ++it;
             }
-        // If the node has two children, swap it with its successor (element with the smallest
-        // key from the right subtree) and delete it.
+            assert((!last || key_less(last->_value.first, (*it).first)) && "The range is not sorted.");
+            node = create_node(*it, nullptr);
+            ++it;
+        } catch (...) {
+            destroy_subtree(left);
+            throw;
+        }
+        last = node;
+
+        node_type *right = nullptr;
+        try {
+            right = build_sorted_subtree(it, right_size, unique, last);
+        } catch (...) {
+            destroy_subtree(left);
+            destroy_node(node);
+            throw;
+        }
+
+        node->set_left(left);
+        if (left)
+            left->set_parent(node);
+        node->set_right(right);
+        if (right)
+            right->set_parent(node);
+        node->set_balance(sorted_subtree_height(right_size) - sorted_subtree_height(left_size));
+        if constexpr (order_statistics)
+            node->_subtree_size = static_cast<subtree_size_type>(size);
+        return node;
+    }
+
+    // Replace the contents of the tree with the elements of the sorted range in linear time. The number of
+    // tree nodes must be known up front, so the single-pass ranges are buffered first.
+    template <class ItT>
+    void assign_sorted(ItT first, ItT last, bool unique) {
+        using category = typename std::iterator_traits<ItT>::iterator_category;
+        if constexpr (!std::is_base_of_v<std::forward_iterator_tag, category>) {
+            std::vector<node_val_type> buffer(first, last);
+            assign_sorted(std::make_move_iterator(buffer.begin()), std::make_move_iterator(buffer.end()), unique);
         } else {
-            // Swap the node with its successor, and fixup the parent pointers.
-            auto *swap_node = smallest_subtree_elt(pos->_right.get());
-            auto *swap_node_parent = swap_node->_parent;
-            auto *pos_parent = pos->_parent;
-            std::swap(get_unique_ptr(pos), get_unique_ptr(swap_node));
-            std::swap(swap_node->_left, pos->_left);
-            std::swap(swap_node->_right, pos->_right);
-            swap_node->_parent = pos_parent;
-            pos->_parent = swap_node_parent;
-            if (pos->_right)
-                pos->_right->_parent = pos;
-            swap_node->_left->_parent = swap_node;
-            swap_node->_right->_parent = swap_node;
-            // The node we want to erase now falls into one of the first two cases, so we
-            // can erase it with a recursive call.
-            return erase_internal(pos);
-        }
-    }
-
-    // Recursively search the tree until we find the node with given key. If the key does
-    // not exist in the tree, return the sentinel root - the end() iterator.
-    node_type *find_internal(node_type *root, const key_type& key) const noexcept {
-        if (!root)
-            return _root_sentinel.get();
-        else if (!_comparator(root->_value.first, key) && !_comparator(key, root->_value.first))
-            return root;
-        else if (_comparator(key, root->_value.first))
-            return find_internal(root->_left.get(), key);
-        else
-            return find_internal(root->_right.get(), key);
+            size_type size = 0;
+            if (unique)
+                size = static_cast<size_type>(std::distance(first, last));
+            else if (first != last) {
+                // Count the distinct keys.
+                size = 1;
+                for (auto prev = first, it = std::next(first); it != last; ++it) {
+                    if (key_less((*prev).first, (*it).first)) {
+                        ++size;
+                        prev = it;
+                    }
+                }
+            }
+
+            clear();
+            node_type *last_node = nullptr;
+            _root_sentinel->set_left(build_sorted_subtree(first, size, unique, last_node));
+            if (root()) {
+                root()->set_parent(_root_sentinel);
+                _begin = smallest_subtree_elt(root());
+                _last = last_node;
+            }
+            _size = size;
+            thread_all();
+        }
+    }
+
+    // Binary format of "save" and "load". Every record holds the key, the value and the height of the node.
+    static constexpr char file_magic[4] = {'A', 'V', 'L', '1'};
+    static constexpr std::size_t file_record_size = sizeof(key_type) + sizeof(val_type) + 1;
+    static constexpr std::size_t file_buffer_records = 4096;
+
+    // Write the records of the subtree in the key order, through the buffer. Returns the height of the subtree.
+    // The height of a node follows from the height of its left subtree and its balance factor, so the node's
+    // record is ready before its right subtree is visited.
+    int save_subtree(std::ostream &out, const node_type *node, std::vector<char> &buffer) const {
+        if (!node)
+            return 0;
+
+        const int height = save_subtree(out, node->left(), buffer) + 1 + std::max(node->balance(), 0);
+        if (buffer.size() == file_buffer_records * file_record_size) {
+            out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+        }
+        const auto *key = reinterpret_cast<const char *>(&node->_value.first);
+        const auto *val = reinterpret_cast<const char *>(&node->_value.second);
+        buffer.insert(buffer.end(), key, key + sizeof(key_type));
+        buffer.insert(buffer.end(), val, val + sizeof(val_type));
+        buffer.push_back(static_cast<char>(height));
+
+        save_subtree(out, node->right(), buffer);
+        return height;
+    }
+
+    // Node of the right spine of the tree being loaded. Its left subtree is complete, while the right one can
+    // still be replaced by a taller subtree.
+    struct spine_node {
+        node_type *node;
+        int height;
+        int left_height;
+        int right_height;
+        size_type left_size;
+        size_type right_size;
+    };
+
+    // Rebuild the tree from the "size" records written by "save". The node with the greatest height in any range
+    // of the records is the root of that range, so the tree is the Cartesian tree of the heights, built with the
+    // stack of its right spine. A new node takes the nodes of the spine lower than itself as its left subtree,
+    // and becomes the right child of the rest of the spine. Once a node leaves the spine, its subtrees are final,
+    // and it is checked to be balanced.
+    void load_nodes(std::istream &in, size_type size) {
+        // The heights on the spine are decreasing, and fit in a byte.
+        std::vector<spine_node> spine;
+        spine.reserve(std::numeric_limits<unsigned char>::max() + 1);
+        std::vector<char> buffer(file_buffer_records * file_record_size);
+        node_type *first = nullptr, *prev = nullptr;
+        bool valid = true;
+
+        // Take the node off the spine. Returns the size of its subtree.
+        auto finish = [&](const spine_node &entry) {
+            const int balance = entry.right_height - entry.left_height;
+            valid = valid && entry.height == 1 + std::max(entry.left_height, entry.right_height) && std::abs(balance) <= 1;
+            entry.node->set_balance(valid ? balance : 0);
+            if constexpr (order_statistics)
+                entry.node->_subtree_size = static_cast<subtree_size_type>(1 + entry.left_size + entry.right_size);
+            return 1 + entry.left_size + entry.right_size;
+        };
+
+        try {
+            for (size_type loaded = 0; loaded < size;) {
+                const auto records = static_cast<size_type>(std::min<size_type>(size - loaded, file_buffer_records));
+                in.read(buffer.data(), static_cast<std::streamsize>(records * file_record_size));
+                if (!in)
+                    throw std::runtime_error("Invalid tree data.\n");
+
+                for (const char *record = buffer.data(); record != buffer.data() + records * file_record_size;
+                     record += file_record_size) {
+                    key_type key;
+                    val_type val;
+                    std::memcpy(&key, record, sizeof(key_type));
+                    std::memcpy(&val, record + sizeof(key_type), sizeof(val_type));
+                    const int height = static_cast<unsigned char>(record[sizeof(key_type) + sizeof(val_type)]);
+                    if (height == 0 || (prev && !key_less(prev->_value.first, key)))
+                        throw std::runtime_error("Invalid tree data.\n");
+
+                    auto *node = create_node(node_val_type(key, val), nullptr);
+                    int left_height = 0;
+                    size_type left_size = 0;
+                    node_type *left = nullptr;
+                    while (!spine.empty() && spine.back().height < height) {
+                        left_size = finish(spine.back());
+                        left_height = spine.back().height;
+                        left = spine.back().node;
+                        spine.pop_back();
+                        if (!spine.empty()) {
+                            spine.back().right_height = left_height;
+                            spine.back().right_size = left_size;
+                        }
+                    }
+                    valid = valid && (spine.empty() || spine.back().height > height);
+
+                    node->set_left(left);
+                    if (left)
+                        left->set_parent(node);
+                    if (!spine.empty()) {
+                        spine.back().node->set_right(node);
+                        node->set_parent(spine.back().node);
+                        spine.back().right_height = height;
+                    }
+                    // Cannot throw, as the room for the whole spine is reserved.
+                    spine.push_back({node, height, left_height, 0, left_size, 0});
+                    if (!valid)
+                        throw std::runtime_error("Invalid tree data.\n");
+
+                    if (!first)
+                        first = node;
+                    prev = node;
+                }
+                loaded += records;
+            }
+
+            for (; spine.size() > 1; spine.pop_back()) {
+                const auto right_size = finish(spine.back());
+                spine[spine.size() - 2].right_size = right_size;
+            }
+            if (!spine.empty())
+                finish(spine.back());
+            if (!valid)
+                throw std::runtime_error("Invalid tree data.\n");
+        } catch (...) {
+            if (!spine.empty())
+                destroy_subtree(spine.front().node);
+            throw;
+        }
+
+        if (!spine.empty()) {
+            _root_sentinel->set_left(spine.front().node);
+            spine.front().node->set_parent(_root_sentinel);
+            _begin = first;
+            _last = prev;
+        }
+        _size = size;
+        thread_all();
     }
 
     // Bounds checking find - if the given key exists in the tree, return the reference
     // to the value tied to that key. If the key doesn't exist, throw an exception.
-    val_type &at_internal(const key_type &key) {
-        if (auto *node = find_internal(root(), key); node != _root_sentinel.get())
+    template <class K>
+    val_type &at_internal(const K &key) const {
+        if (auto *node = find_internal(_root_sentinel->left(), key); node != _root_sentinel)
             return node->_value.second;
 
         throw std::out_of_range("Nonexistent key.\n");
     }
 
-    // Helper function which returns the parent's unique_ptr pointing to the given node.
-    std::unique_ptr<node_type> &get_unique_ptr(node_type *node) noexcept {
-        auto *parent = node->_parent;
-        assert(parent != nullptr);
-        return node == parent->_left.get() ? parent->_left : parent->_right;
+    // Number of the nodes in the subtree rooted at "node" (which can be nullptr).
+    static size_type subtree_size(const node_type *node) noexcept { return node ? node->_subtree_size : 0; }
+
+    // Recompute the size of the subtree rooted at "node" from the sizes of its children.
+    static void update_subtree_size(node_type *node) noexcept {
+        if constexpr (order_statistics)
+            node->_subtree_size = static_cast<subtree_size_type>(1 + subtree_size(node->left()) + subtree_size(node->right()));
+    }
+
+    // Find the node at the given position in the sorted order. If there is no such node, return the sentinel
+    // root - the end() iterator.
+    node_type *nth_internal(size_type index) const noexcept {
+        auto *node = _root_sentinel->left();
+        while (node) {
+            const auto left_size = subtree_size(node->left());
+            if (index == left_size)
+                return node;
+            if (index < left_size)
+                node = node->left();
+            else {
+                index -= left_size + 1;
+                node = node->right();
+            }
+        }
+        return _root_sentinel;
+    }
+
+    // Number of the nodes with the keys less than the given key.
+    template <class K>
+    size_type rank_internal(const K &key) const {
+        size_type rank = 0;
+        for (const auto *node = _root_sentinel->left(); node;) {
+            if (key_less(node->_value.first, key)) {
+                rank += subtree_size(node->left()) + 1;
+                node = node->right();
+            } else
+                node = node->left();
+        }
+        return rank;
+    }
+
+    // Helper function which makes the parent of "old_child" point to "new_child" instead. The root of
+    // a detached subtree (see "join_subtrees") has no parent to update.
+    static void replace_child(node_type *parent, node_type *old_child, node_type *new_child) noexcept {
+        if (!parent)
+            return;
+        if (old_child == parent->left())
+            parent->set_left(new_child);
+        else
+            parent->set_right(new_child);
     }
 
     // "Retrace" and "rotate" functions are helper functions which make sure that the AVL
     // tree invariant (balance factor at each node is in range [-1, 1]) is satisfied after
-    // each insertion/erasure.
+    // each insertion/erasure. The rotate functions return the new root of the rotated subtree.
     //
     // https://en.wikipedia.org/wiki/AVL_tree#Operations
-    void rotate_subtree_left(std::unique_ptr<node_type> &old_root) noexcept {
-        auto *old_root_parent = old_root->_parent;
-        auto *new_root = old_root->_right.get();
-        std::swap(old_root->_right, new_root->_left);
-        std::swap(old_root, new_root->_left);
-        new_root->_parent = old_root_parent;
-        new_root->_left->_parent = new_root;
-        if (new_root->_left->_right)
-            new_root->_left->_right->_parent = new_root->_left.get();
-        if (new_root->_balance_factor == 0) {
-            new_root->_balance_factor = -1;
-            new_root->_left->_balance_factor = 1;
+    node_type *rotate_subtree_left(node_type *old_root) noexcept {
+        this->count_rotation(false);
+        auto *new_root = old_root->right();
+        auto *moved = new_root->left();
+        replace_child(old_root->parent(), old_root, new_root);
+        new_root->set_parent(old_root->parent());
+        old_root->set_right(moved);
+        if (moved)
+            moved->set_parent(old_root);
+        new_root->set_left(old_root);
+        old_root->set_parent(new_root);
+        update_subtree_size(old_root);
+        update_subtree_size(new_root);
+
+        if (new_root->balance() == 0) {
+            new_root->set_balance(-1);
+            old_root->set_balance(1);
         } else {
-            new_root->_balance_factor = 0;
-            new_root->_left->_balance_factor = 0;
-        }
-    }
-
-    void rotate_subtree_right(std::unique_ptr<node_type> &old_root) noexcept {
-        auto *old_root_parent = old_root->_parent;
-        auto *new_root = old_root->_left.get();
-        std::swap(old_root->_left, new_root->_right);
-        std::swap(old_root, new_root->_right);
-        new_root->_parent = old_root_parent;
-        new_root->_right->_parent = new_root;
-        if (new_root->_right->_left)
-            new_root->_right->_left->_parent = new_root->_right.get();
-        if (new_root->_balance_factor == 0) {
-            new_root->_balance_factor = 1;
-            new_root->_right->_balance_factor = -1;
+            new_root->set_balance(0);
+            old_root->set_balance(0);
+        }
+        return new_root;
+    }
+
+    node_type *rotate_subtree_right(node_type *old_root) noexcept {
+        this->count_rotation(false);
+        auto *new_root = old_root->left();
+        auto *moved = new_root->right();
+        replace_child(old_root->parent(), old_root, new_root);
+        new_root->set_parent(old_root->parent());
+        old_root->set_left(moved);
+        if (moved)
+            moved->set_parent(old_root);
+        new_root->set_right(old_root);
+        old_root->set_parent(new_root);
+        update_subtree_size(old_root);
+        update_subtree_size(new_root);
+
+        if (new_root->balance() == 0) {
+            new_root->set_balance(1);
+            old_root->set_balance(-1);
         } else {
-            new_root->_balance_factor = 0;
-            new_root->_right->_balance_factor = 0;
-        }
-    }
-
-    void rotate_subtree_right_left(std::unique_ptr<node_type> &old_root) noexcept {
-        auto *old_root_parent = old_root->_parent;
-        auto *child = old_root->_right.get();
-        auto *new_root = old_root->_right->_left.get();
-        std::swap(new_root->_right, child->_left);
-        std::swap(old_root->_right, new_root->_right);
-        new_root->_parent = old_root.get();
-        new_root->_right->_parent = new_root;
-        if (new_root->_right->_left)
-            new_root->_right->_left->_parent = new_root->_right.get();
-
-        std::swap(new_root->_left, old_root->_right);
-        std::swap(old_root, new_root->_left);
-        new_root->_parent = old_root_parent;
-        new_root->_left->_parent = new_root;
-        if (new_root->_left->_right)
-            new_root->_left->_right->_parent = new_root->_left.get();
-
-        if (new_root->_balance_factor == 0) {
-            new_root->_left->_balance_factor = 0;
-            new_root->_right->_balance_factor = 0;
-        } else if (new_root->_balance_factor > 0) {
-            new_root->_left->_balance_factor = -1;
-            new_root->_right->_balance_factor = 0;
+            new_root->set_balance(0);
+            old_root->set_balance(0);
+        }
+        return new_root;
+    }
+
+    node_type *rotate_subtree_right_left(node_type *old_root) noexcept {
+        this->count_rotation(true);
+        auto *child = old_root->right();
+        auto *new_root = child->left();
+        // The subtrees of the new root are split between the old root and its child.
+        auto *moved_left = new_root->left();
+        auto *moved_right = new_root->right();
+        old_root->set_right(moved_left);
+        if (moved_left)
+            moved_left->set_parent(old_root);
+        child->set_left(moved_right);
+        if (moved_right)
+            moved_right->set_parent(child);
+
+        replace_child(old_root->parent(), old_root, new_root);
+        new_root->set_parent(old_root->parent());
+        new_root->set_left(old_root);
+        old_root->set_parent(new_root);
+        new_root->set_right(child);
+        child->set_parent(new_root);
+        update_subtree_size(old_root);
+        update_subtree_size(child);
+        update_subtree_size(new_root);
+
+        if (new_root->balance() == 0) {
+            old_root->set_balance(0);
+            child->set_balance(0);
+        } else if (new_root->balance() > 0) {
+            old_root->set_balance(-1);
+            child->set_balance(0);
         } else {
-            assert(new_root->_balance_factor == -1);
-            new_root->_left->_balance_factor = 0;
-            new_root->_right->_balance_factor = 1;
-        }
-        new_root->_balance_factor = 0;
-    }
-
-    void rotate_subtree_left_right(std::unique_ptr<node_type> &old_root) noexcept {
-        auto *old_root_parent = old_root->_parent;
-        auto *child = old_root->_left.get();
-        auto *new_root = old_root->_left->_right.get();
-        std::swap(new_root->_left, child->_right);
-        std::swap(old_root->_left, new_root->_left);
-        new_root->_parent = old_root.get();
-        new_root->_left->_parent = new_root;
-        if (new_root->_left->_right)
-            new_root->_left->_right->_parent = new_root->_left.get();
-
-        std::swap(new_root->_right, old_root->_left);
-        std::swap(old_root, new_root->_right);
-        new_root->_parent = old_root_parent;
-        new_root->_right->_parent = new_root;
-        if (new_root->_right->_left)
-            new_root->_right->_left->_parent = new_root->_right.get();
-
-        if (new_root->_balance_factor == 0) {
-            new_root->_left->_balance_factor = 0;
-            new_root->_right->_balance_factor = 0;
-        } else if (new_root->_balance_factor < 0) {
-            new_root->_right->_balance_factor = 1;
-            new_root->_left->_balance_factor = 0;
+            assert(new_root->balance() == -1);
+            old_root->set_balance(0);
+            child->set_balance(1);
+        }
+        new_root->set_balance(0);
+        return new_root;
+    }
+
+    node_type *rotate_subtree_left_right(node_type *old_root) noexcept {
+        this->count_rotation(true);
+        auto *child = old_root->left();
+        auto *new_root = child->right();
+        // The subtrees of the new root are split between its parent and the old root.
+        auto *moved_left = new_root->left();
+        auto *moved_right = new_root->right();
+        child->set_right(moved_left);
+        if (moved_left)
+            moved_left->set_parent(child);
+        old_root->set_left(moved_right);
+        if (moved_right)
+            moved_right->set_parent(old_root);
+
+        replace_child(old_root->parent(), old_root, new_root);
+        new_root->set_parent(old_root->parent());
+        new_root->set_left(child);
+        child->set_parent(new_root);
+        new_root->set_right(old_root);
+        old_root->set_parent(new_root);
+        update_subtree_size(child);
+        update_subtree_size(old_root);
+        update_subtree_size(new_root);
+
+        if (new_root->balance() == 0) {
+            child->set_balance(0);
+            old_root->set_balance(0);
+        } else if (new_root->balance() < 0) {
+            old_root->set_balance(1);
+            child->set_balance(0);
         } else {
-            assert(new_root->_balance_factor == 1);
-            new_root->_right->_balance_factor = 0;
-            new_root->_left->_balance_factor = -1;
+            assert(new_root->balance() == 1);
+            old_root->set_balance(0);
+            child->set_balance(-1);
         }
-        new_root->_balance_factor = 0;
+        new_root->set_balance(0);
+        return new_root;
     }
 
     // Go up the tree after insertion and fixup the subtrees which have invalidated
-    // the AVL tree invariant.
-    void retrace_insert(std::unique_ptr<node_type> &node) {
-        auto *parent = node->_parent;
-        if (parent == _root_sentinel.get())
-            return;
-
-        [[maybe_unused]] const auto *left_child = parent->_left.get();
-        const auto *right_child = parent->_right.get();
-        if (node.get() == right_child) {
-            if (parent->_balance_factor > 0) {
-                if (node->_balance_factor >= 0)
-                    rotate_subtree_left(get_unique_ptr(parent));
-                else
-                    rotate_subtree_right_left(get_unique_ptr(parent));
-            } else if (parent->_balance_factor < 0) {
-                parent->_balance_factor = 0;
+    // the AVL tree invariant. "node" is the root of the subtree whose height has grown.
+    // Returns true if the height of the whole tree (or the detached subtree) has grown.
+    bool retrace_insert(node_type *node) noexcept {
+        for (auto *parent = node->parent(); parent && parent != _root_sentinel; node = parent, parent = node->parent()) {
+            this->count_retrace_step();
+            if (node == parent->right()) {
+                if (parent->balance() > 0) {
+                    if (node->balance() >= 0)
+                        rotate_subtree_left(parent);
+                    else
+                        rotate_subtree_right_left(parent);
+                    return false;
+                } else if (parent->balance() < 0) {
+                    parent->set_balance(0);
+                    return false;
+                }
+                parent->set_balance(parent->balance() + 1);
             } else {
-                ++parent->_balance_factor;
-                return retrace_insert(get_unique_ptr(parent));
+                assert(node == parent->left());
+                if (parent->balance() < 0) {
+                    if (node->balance() <= 0)
+                        rotate_subtree_right(parent);
+                    else
+                        rotate_subtree_left_right(parent);
+                    return false;
+                } else if (parent->balance() > 0) {
+                    parent->set_balance(0);
+                    return false;
+                }
+                parent->set_balance(parent->balance() - 1);
             }
-        } else {
-            assert(node.get() == left_child);
-            if (parent->_balance_factor < 0) {
-                if (node->_balance_factor <= 0)
-                    rotate_subtree_right(get_unique_ptr(parent));
-                else
-                    rotate_subtree_left_right(get_unique_ptr(parent));
-            } else if (parent->_balance_factor > 0) {
-                parent->_balance_factor = 0;
+        }
+        return true;
+    }
+
+    // Go up the tree after erasure and fixup the subtrees which have invalidated
+    // the AVL tree invariant. "node" is the root of the subtree whose height has shrunk.
+    // A rotation keeps the height of the rotated subtree only if the taller child was
+    // balanced - otherwise the subtree has shrunk too, and we need to go further up.
+    void retrace_erase(node_type *node) noexcept {
+        for (auto *parent = node->parent(); parent != _root_sentinel; parent = node->parent()) {
+            this->count_retrace_step();
+            if (node == parent->left()) {
+                if (parent->balance() > 0) {
+                    const auto sibling_balance = parent->right()->balance();
+                    node = sibling_balance < 0 ? rotate_subtree_right_left(parent) : rotate_subtree_left(parent);
+                    if (sibling_balance == 0)
+                        return;
+                } else if (parent->balance() == 0) {
+                    parent->set_balance(1);
+                    return;
+                } else {
+                    parent->set_balance(0);
+                    node = parent;
+                }
             } else {
-                --parent->_balance_factor;
-                return retrace_insert(get_unique_ptr(parent));
+                assert(node == parent->right());
+                if (parent->balance() < 0) {
+                    const auto sibling_balance = parent->left()->balance();
+                    node = sibling_balance > 0 ? rotate_subtree_left_right(parent) : rotate_subtree_right(parent);
+                    if (sibling_balance == 0)
+                        return;
+                } else if (parent->balance() == 0) {
+                    parent->set_balance(-1);
+                    return;
+                } else {
+                    parent->set_balance(0);
+                    node = parent;
+                }
             }
         }
     }
 
-    // Go up the tree after erasure and fixup the subtrees which have invalidated
-    // the AVL tree invariant.
-    void retrace_erase(std::unique_ptr<node_type> &node) {
-        auto *parent = node->_parent;
-        if (parent == _root_sentinel.get())
-            return;
+    // Add the nodes of the subtree rooted at "node", at the given depth, to the histogram.
+    static void count_depths(const node_type *node, std::size_t depth, std::vector<size_type> &histogram) noexcept {
+        for (; node; node = node->right(), ++depth) {
+            ++histogram[depth];
+            count_depths(node->left(), depth + 1, histogram);
+        }
+    }
+
+    // Height of the subtree rooted at "node", found by following its taller children down.
+    static int subtree_height(const node_type *node) noexcept {
+        int height = 0;
+        for (; node; ++height)
+            node = node->balance() > 0 ? node->right() : node->left();
+        return height;
+    }
+
+    // Join the "left" and "right" subtrees of the given heights, with the "pivot" node in between. All the keys
+    // in the left subtree must be less than the pivot's key, and all the keys in the right subtree greater.
+    // The subtrees, the pivot and the result are detached - their roots have no parent. If the heights differ
+    // by more than one, the pivot takes the place of the node of about the shorter subtree's height on the spine
+    // of the taller one, which then grows by one level, just like after an insertion. The cost is proportional to
+    // the difference of the heights. Returns the root of the joined subtree, and stores its height in "height".
+    node_type *join_subtrees(node_type *left, int left_height, node_type *pivot, node_type *right, int right_height,
+                             int &height) noexcept {
+        if (left_height <= right_height + 1 && right_height <= left_height + 1) {
+            link_pivot(pivot, left, right, right_height - left_height);
+            pivot->set_parent(nullptr);
+            height = std::max(left_height, right_height) + 1;
+            return pivot;
+        }
 
-        const auto *left_child = parent->_left.get();
-        [[maybe_unused]] const auto *right_child = parent->_right.get();
-        if (node.get() == left_child) {
-            if (parent->_balance_factor > 0) {
-                if (right_child->_balance_factor < 0)
-                    rotate_subtree_right_left(get_unique_ptr(parent));
-                else
-                    rotate_subtree_left(get_unique_ptr(parent));
-            } else if (parent->_balance_factor == 0) {
-                parent->_balance_factor = 1;
+        // Descend the spine of the taller subtree, facing the shorter one, to the node which is at most one
+        // level taller than the shorter subtree. The pivot replaces it, with the shorter subtree as the sibling.
+        const bool left_taller = left_height > right_height;
+        const int short_height = left_taller ? right_height : left_height;
+        node_type *parent = nullptr;
+        auto *node = left_taller ? left : right;
+        int node_height = left_taller ? left_height : right_height;
+        while (node_height > short_height + 1) {
+            parent = node;
+            if (left_taller) {
+                node_height -= node->balance() < 0 ? 2 : 1;
+                node = node->right();
             } else {
-                parent->_balance_factor = 0;
-                return retrace_erase(get_unique_ptr(parent));
+                node_height -= node->balance() > 0 ? 2 : 1;
+                node = node->left();
             }
+        }
+
+        if (left_taller) {
+            link_pivot(pivot, node, right, right_height - node_height);
+            parent->set_right(pivot);
         } else {
-            assert(node.get() == right_child);
-            if (parent->_balance_factor < 0) {
-                if (left_child->_balance_factor > 0)
-                    rotate_subtree_left_right(get_unique_ptr(parent));
-                else
-                    rotate_subtree_right(get_unique_ptr(parent));
-            } else if (parent->_balance_factor == 0) {
-                parent->_balance_factor = -1;
+            link_pivot(pivot, left, node, node_height - left_height);
+            parent->set_left(pivot);
+        }
+        pivot->set_parent(parent);
+        if constexpr (order_statistics) {
+            for (auto *ancestor = parent; ancestor; ancestor = ancestor->parent())
+                update_subtree_size(ancestor);
+        }
+
+        // The retrace may rotate the root away, so the new root is found by going up from the pivot.
+        const bool grown = retrace_insert(pivot);
+        height = (left_taller ? left_height : right_height) + (grown ? 1 : 0);
+        auto *root = pivot;
+        while (root->parent())
+            root = root->parent();
+        return root;
+    }
+
+    // Make the "left" and "right" subtrees the children of the "pivot" node.
+    static void link_pivot(node_type *pivot, node_type *left, node_type *right, int balance) noexcept {
+        pivot->set_left(left);
+        if (left)
+            left->set_parent(pivot);
+        pivot->set_right(right);
+        if (right)
+            right->set_parent(pivot);
+        pivot->set_balance(balance);
+        update_subtree_size(pivot);
+    }
+
+    // Which way the split goes at a node of the search path (see "split_subtree").
+    enum class split_step : std::int8_t { left, right, equal };
+    // Longest search path of a tree - the height of an AVL tree is less than 1.45 log2(n + 2).
+    static constexpr int max_path_length = 128;
+
+    // Split the detached subtree rooted at "node" of the given height into the subtree of the nodes with the keys
+    // less than the given key ("left"), and the subtree of the rest of the nodes ("right"). Both of them are
+    // detached. Every node on the search path is joined with the subtree hanging off the path on its other side,
+    // and the costs of these joins add up to the height of the subtree. If "equal" is given, the node with the
+    // given key (if there is one) goes to neither of the subtrees, and is stored there instead. The search path is
+    // found before anything is moved, so the subtree is left intact if the comparator throws.
+    template <class K>
+    void split_subtree(node_type *node, int height, const K &key, node_type *&left, int &left_height,
+                       node_type *&right, int &right_height, node_type **equal = nullptr) {
+        split_step path[max_path_length];
+        int length = 0;
+        for (auto *step = node; step; ++length) {
+            assert(length < max_path_length && "The search path is too long.");
+            if (key_less(step->_value.first, key)) {
+                path[length] = split_step::right;
+                step = step->right();
+            } else if (equal && !key_less(key, step->_value.first)) {
+                path[length] = split_step::equal;
+                break;
             } else {
-                parent->_balance_factor = 0;
-                return retrace_erase(get_unique_ptr(parent));
+                path[length] = split_step::left;
+                step = step->left();
             }
         }
+        split_along_path(node, height, path, left, left_height, right, right_height, equal);
     }
 
+    // Split the subtree along the search path found by "split_subtree".
+    void split_along_path(node_type *node, int height, const split_step *path, node_type *&left, int &left_height,
+                          node_type *&right, int &right_height, node_type **equal) noexcept {
+        if (!node) {
+            left = right = nullptr;
+            left_height = right_height = 0;
+            return;
+        }
+
+        auto *node_left = node->left();
+        auto *node_right = node->right();
+        const int node_left_height = height - (node->balance() > 0 ? 2 : 1);
+        const int node_right_height = height - (node->balance() < 0 ? 2 : 1);
+        if (node_left)
+            node_left->set_parent(nullptr);
+        if (node_right)
+            node_right->set_parent(nullptr);
+
+        node_type *rest;
+        int rest_height;
+        if (*path == split_step::right) {
+            split_along_path(node_right, node_right_height, path + 1, rest, rest_height, right, right_height, equal);
+            left = join_subtrees(node_left, node_left_height, node, rest, rest_height, left_height);
+        } else if (*path == split_step::equal) {
+            left = node_left;
+            left_height = node_left_height;
+            right = node_right;
+            right_height = node_right_height;
+            *equal = node;
+        } else {
+            split_along_path(node_left, node_left_height, path + 1, left, left_height, rest, rest_height, equal);
+            right = join_subtrees(rest, rest_height, node, node_right, node_right_height, right_height);
+        }
+    }
+
+    // Remove the node with the greatest key from the detached subtree rooted at "node" of the given height, and
+    // return it. The rest of the subtree and its height are stored in "rest" and "rest_height".
+    node_type *remove_greatest(node_type *node, int height, node_type *&rest, int &rest_height) noexcept {
+        auto *node_left = node->left();
+        const int node_left_height = height - (node->balance() > 0 ? 2 : 1);
+        if (node_left)
+            node_left->set_parent(nullptr);
+        if (!node->right()) {
+            rest = node_left;
+            rest_height = node_left_height;
+            return node;
+        }
+
+        auto *node_right = node->right();
+        node_right->set_parent(nullptr);
+        node_type *right_rest;
+        int right_rest_height;
+        auto *greatest = remove_greatest(node_right, height - (node->balance() < 0 ? 2 : 1), right_rest, right_rest_height);
+        rest = join_subtrees(node_left, node_left_height, node, right_rest, right_rest_height, rest_height);
+        return greatest;
+    }
+
+    // Join the detached "left" and "right" subtrees of the given heights, without a pivot node in between.
+    node_type *join_subtrees(node_type *left, int left_height, node_type *right, int right_height, int &height) noexcept {
+        if (!left || !right) {
+            height = left ? left_height : right_height;
+            return left ? left : right;
+        }
+        node_type *rest;
+        int rest_height;
+        auto *pivot = remove_greatest(left, left_height, rest, rest_height);
+        return join_subtrees(rest, rest_height, pivot, right, right_height, height);
+    }
+
+    enum class set_operation { unite, intersect, subtract };
+
+    // Subtrees of at least this height are worth processing by a thread of their own.
+    static constexpr int parallel_height = 12;
+
+    // Apply the set operation to the detached subtrees "a" and "b" of the given heights. The subtree "b" is split
+    // by the key of the root of "a", the operation is applied to the two pairs of the smaller subtrees, and the
+    // results are joined, with or without the root of "a" in between. The left pair is handed to a new thread as
+    // long as there are "threads" to spare. The nodes left out of the result are not destroyed here - the
+    // allocator need not be thread-safe. They are prepended to the "discarded" list of subtrees instead, linked
+    // through their parent links. Returns the root of the result, and stores its height in "height". If the
+    // comparator throws, all the nodes of both subtrees end up on the "discarded" list, and the exception is
+    // rethrown once the worker thread is done.
+    node_type *combine_subtrees(set_operation operation, node_type *a, int a_height, node_type *b, int b_height,
+                                node_type *&discarded, unsigned threads, int &height) {
+        if (!a || !b) {
+            const bool keep_a = operation != set_operation::intersect;
+            const bool keep_b = operation == set_operation::unite;
+            auto *kept = a && keep_a ? a : (b && keep_b ? b : nullptr);
+            if (a && !keep_a)
+                discard_subtree(a, discarded);
+            if (b && !keep_b)
+                discard_subtree(b, discarded);
+            height = kept == a ? a_height : (kept == b ? b_height : 0);
+            return kept;
+        }
+
+        node_type *b_left, *b_right, *equal = nullptr;
+        int b_left_height, b_right_height;
+        try {
+            split_subtree(b, b_height, a->_value.first, b_left, b_left_height, b_right, b_right_height, &equal);
+        } catch (...) {
+            // Neither of the subtrees has changed yet.
+            discard_subtree(a, discarded);
+            discard_subtree(b, discarded);
+            throw;
+        }
+        auto *a_left = a->left();
+        auto *a_right = a->right();
+        const int a_left_height = a_height - (a->balance() > 0 ? 2 : 1);
+        const int a_right_height = a_height - (a->balance() < 0 ? 2 : 1);
+        if (a_left)
+            a_left->set_parent(nullptr);
+        if (a_right)
+            a_right->set_parent(nullptr);
+        // The pieces are linked back together by the joins below, or discarded on their own.
+        a->set_left(nullptr);
+        a->set_right(nullptr);
+        if (equal) {
+            equal->set_left(nullptr);
+            equal->set_right(nullptr);
+        }
+
+        // The worker thread collects the discarded nodes into a list of its own.
+        node_type *left = nullptr, *right = nullptr;
+        int left_height, right_height;
+        node_type *left_discarded = nullptr;
+        bool left_done = false, right_done = false;
+        std::exception_ptr error, left_error;
+        std::thread worker;
+        if (threads > 1 && std::max(a_height, b_height) >= parallel_height) {
+            try {
+                worker = std::thread([&] {
+                    try {
+                        left = combine_subtrees(operation, a_left, a_left_height, b_left, b_left_height, left_discarded,
+                                                threads / 2, left_height);
+                    } catch (...) {
+                        left_error = std::current_exception();
+                    }
+                });
+            } catch (const std::system_error &) {
+                // Fall back to processing the left pair on this thread.
+            }
+        }
+        const bool parallel = worker.joinable();
+        try {
+            if (!parallel) {
+                left = combine_subtrees(operation, a_left, a_left_height, b_left, b_left_height, discarded, threads,
+                                        left_height);
+                left_done = true;
+            }
+            right = combine_subtrees(operation, a_right, a_right_height, b_right, b_right_height, discarded,
+                                     parallel ? threads - threads / 2 : threads, right_height);
+            right_done = true;
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (parallel) {
+            worker.join();
+            while (left_discarded) {
+                auto *next = left_discarded->parent();
+                discard_subtree(left_discarded, discarded);
+                left_discarded = next;
+            }
+            left_done = !left_error;
+            if (!error)
+                error = left_error;
+        }
+
+        if (error) {
+            // The pair which failed has discarded its nodes already. The result of the other pair goes with the
+            // rest, or the right pair itself, if it was never processed.
+            if (left_done && left)
+                discard_subtree(left, discarded);
+            if (right_done && right)
+                discard_subtree(right, discarded);
+            if (!parallel && !left_done) {
+                if (a_right)
+                    discard_subtree(a_right, discarded);
+                if (b_right)
+                    discard_subtree(b_right, discarded);
+            }
+            discard_subtree(a, discarded);
+            if (equal)
+                discard_subtree(equal, discarded);
+            std::rethrow_exception(error);
+        }
+
+        // The element of "a" is kept by the union, by the intersection if "b" holds its key too, and by the
+        // difference if it does not. The element of "b" with the same key is never kept.
+        if (equal)
+            discard_subtree(equal, discarded);
+        if (operation == set_operation::unite || (operation == set_operation::intersect) == (equal != nullptr))
+            return join_subtrees(left, left_height, a, right, right_height, height);
+
+        discard_subtree(a, discarded);
+        return join_subtrees(left, left_height, right, right_height, height);
+    }
+
+    // Prepend the detached subtree to the list of the subtrees to be destroyed.
+    static void discard_subtree(node_type *root, node_type *&discarded) noexcept {
+        root->set_parent(discarded);
+        discarded = root;
+    }
+
+    // Apply the set operation to the two trees (see "combine_subtrees"). The result takes over the nodes of both
+    // trees and reuses the "lhs" tree's sentinel, comparator and allocator. Both trees are left empty, also if the
+    // comparator throws, and then all their nodes are destroyed. The nodes can only be moved between the trees with
+    // equal allocators, so otherwise the "rhs" tree is copied first.
+    static avl_tree combine(set_operation operation, avl_tree &lhs, avl_tree &rhs) {
+        if (lhs._node_allocator != rhs._node_allocator) {
+            avl_tree copy(unstored, rhs._comparator, lhs.get_allocator());
+            copy.copy_from(rhs);
+            return combine(operation, lhs, copy);
+        }
+
+        const auto size = lhs._size + rhs._size;
+        const auto lhs_height = subtree_height(lhs.root());
+        const auto rhs_height = subtree_height(rhs.root());
+        auto *a = lhs.detach_root();
+        auto *b = rhs.detach_root();
+
+        node_type *discarded = nullptr;
+        int height;
+        node_type *root;
+        try {
+            root = lhs.combine_subtrees(operation, a, lhs_height, b, rhs_height, discarded,
+                                        std::max(1u, std::thread::hardware_concurrency()), height);
+        } catch (...) {
+            lhs.destroy_discarded(discarded);
+            throw;
+        }
+        const auto destroyed = lhs.destroy_discarded(discarded);
+        lhs.attach_root(root, size - destroyed);
+        // The nodes of both trees are mixed, so their order is rebuilt.
+        lhs.thread_all();
+        return std::move(lhs);
+    }
+
+    // Destroy the list of the discarded subtrees (see "combine_subtrees"). Returns the number of the destroyed nodes.
+    size_type destroy_discarded(node_type *discarded) noexcept {
+        size_type destroyed = 0;
+        while (discarded) {
+            auto *next = discarded->parent();
+            destroyed += destroy_subtree(discarded);
+            discarded = next;
+        }
+        return destroyed;
+    }
+
+    // Make the detached subtree with "size" nodes the contents of this (empty) tree.
+    void attach_root(node_type *root, size_type size) noexcept {
+        _root_sentinel->set_left(root);
+        if (root) {
+            root->set_parent(_root_sentinel);
+            _begin = smallest_subtree_elt(root);
+            _last = greatest_subtree_elt(root);
+        } else
+            _begin = _last = _root_sentinel;
+        _size = size;
+        link_thread_ends();
+    }
+
+    // Detach the root of this tree, leaving the tree empty. Returns the root.
+    node_type *detach_root() noexcept {
+        auto *root = this->root();
+        if (root)
+            root->set_parent(nullptr);
+        attach_root(nullptr, 0);
+        return root;
+    }
+
+    // Join this tree, the "pivot" node and the "right" tree into this tree (see "join_subtrees").
+    void join_internal(node_type *pivot, avl_tree &right) {
+        assert(_node_allocator == right._node_allocator && "Moving the nodes between incompatible allocators.");
+        assert((empty() || key_less(_last->_value.first, pivot->_value.first)) && "Keys of the joined trees overlap.");
+        assert((right.empty() || key_less(pivot->_value.first, right._begin->_value.first)) && "Keys of the joined trees overlap.");
+
+        const auto size = _size + right._size + 1;
+        // Only the threads around the pivot are new. The ends are relinked when the joined root is attached.
+        link_threads(_last, pivot);
+        link_threads(pivot, right._begin);
+        auto *left_root = detach_root();
+        auto *right_root = right.detach_root();
+        int height;
+        attach_root(join_subtrees(left_root, subtree_height(left_root), pivot, right_root, subtree_height(right_root), height),
+                    size);
+    }
+
+    // Move the nodes with the keys not less than the given key to a new tree (see "split_subtree").
+    template <class K>
+    avl_tree split_internal(const K &key) {
+        avl_tree right(unstored, _comparator, get_allocator());
+        const auto size = _size;
+        auto *root = detach_root();
+        node_type *left_root, *right_root;
+        int left_height, right_height;
+        try {
+            split_subtree(root, subtree_height(root), key, left_root, left_height, right_root, right_height);
+        } catch (...) {
+            attach_root(root, size);
+            throw;
+        }
+        attach_root(left_root, 0);
+        right.attach_root(right_root, 0);
+
+        if constexpr (order_statistics)
+            _size = subtree_size(left_root);
+        else {
+            // Walk both of the trees at once, until the smaller one ends.
+            size_type smaller_size = 0;
+            auto it = begin();
+            for (auto right_it = right.begin(); it != end() && right_it != right.end(); ++it, ++right_it)
+                ++smaller_size;
+            _size = it == end() ? smaller_size : size - smaller_size;
+        }
+        right._size = size - _size;
+        return right;
+    }
+
+    // Exchange the nodes and the comparators of the trees, but not their allocators.
+    void swap_contents(avl_tree &other) noexcept {
+        std::swap(_root_sentinel, other._root_sentinel);
+        std::swap(_begin, other._begin);
+        std::swap(_last, other._last);
+        std::swap(_size, other._size);
+        std::swap(_comparator, other._comparator);
+    }
+
+    // Tag of the constructor of the trees which are not kept in the persistent storage, even if their allocator
+    // has one - the tree gets a new sentinel instead of the stored one.
+    struct unstored_t {};
+    static constexpr unstored_t unstored{};
+
+    avl_tree(unstored_t, const cmp_type &comparator, const allocator_type &alloc)
+        : _node_allocator(alloc), _root_sentinel{create_node()}, _begin{_root_sentinel}, _last{_root_sentinel},
+          _comparator(comparator) {
+        link_thread_ends();
+    }
+
+    // Enables the overloads of the lookup functions for the key type "K", if the comparator is transparent.
+    template <class K>
+    using transparent_key = std::enable_if_t<detail::is_transparent<cmp_type>::value, K>;
+
 public:
     // Bidirectional iterator to the elements of the AVL tree.
     template <typename ItT>
     struct Iterator final {
-        friend class avl_tree<Key, T, Cmp>;
+        friend class avl_tree;
 
         using iterator_category = std::bidirectional_iterator_tag;
         using difference_type = std::ptrdiff_t;
@@ -396,6 +1880,9 @@ public:
 
         // The iterator is essentialy just a wrapper around the node pointer...
         Iterator(node_type *ptr) : _ptr(ptr) {}
+        // A non-const iterator converts to the const one.
+        template <typename OtherT, typename = std::enable_if_t<std::is_same_v<const OtherT, ItT> && !std::is_const_v<OtherT>>>
+        Iterator(const Iterator<OtherT> &other) : _ptr(other._ptr) {}
 
         // ...but dereferencing the iterator gives us access to node's payload only.
         reference operator*() const { return _ptr->_value; }
@@ -419,28 +1906,25 @@ public:
         friend bool operator!=(const Iterator<ItT> &lhs, const Iterator<ItT> &rhs) noexcept { return lhs._ptr != rhs._ptr; }
 
     private:
+        template <typename>
+        friend struct Iterator;
+
         node_type *_ptr;
 
         // Find the node with the next greater key in the tree.
         void next() noexcept {
-            if (_ptr->_right)
-                _ptr = smallest_subtree_elt(_ptr->_right.get());
-            else {
-                while (_ptr != _ptr->_parent->_left.get())
-                    _ptr = _ptr->_parent;
-                _ptr = _ptr->_parent;
-            }
+            if constexpr (threaded)
+                _ptr = _ptr->successor();
+            else
+                _ptr = tree_successor(_ptr);
         }
 
         // Find the node with the next smaller key in the tree.
         void prev() noexcept {
-            if (_ptr->_left)
-                _ptr = greatest_subtree_elt(_ptr->_left.get());
-            else {
-                while (_ptr != _ptr->_parent->_right.get())
-                    _ptr = _ptr->_parent;
-                _ptr = _ptr->_parent;
-            }
+            if constexpr (threaded)
+                _ptr = _ptr->predecessor();
+            else
+                _ptr = tree_predecessor(_ptr);
         }
     };
 
@@ -448,27 +1932,208 @@ public:
     using iterator = Iterator<node_val_type>;
     using const_iterator = Iterator<const node_val_type>;
 
+    // Owner of a node extracted from the tree (see "extract"). The node keeps its element, and can be inserted
+    // into this or another tree with an equal allocator without reallocating or copying the element. The handle
+    // frees the node if it is destroyed while still owning it.
+    class node_handle {
+    public:
+        using key_type = avl_tree::key_type;
+        using mapped_type = avl_tree::val_type;
+        using value_type = avl_tree::node_val_type;
+        using allocator_type = avl_tree::allocator_type;
+
+        node_handle() noexcept = default;
+        node_handle(node_handle &&other) noexcept : _node(other._node), _allocator(std::move(other._allocator)) {
+            other._node = nullptr;
+            other._allocator.reset();
+        }
+        node_handle &operator=(node_handle &&other) noexcept {
+            if (this != &other) {
+                reset();
+                _node = other._node;
+                _allocator = std::move(other._allocator);
+                other._node = nullptr;
+                other._allocator.reset();
+            }
+            return *this;
+        }
+        node_handle(const node_handle &) = delete;
+        node_handle &operator=(const node_handle &) = delete;
+        ~node_handle() { reset(); }
+
+        bool empty() const noexcept { return !_node; }
+        explicit operator bool() const noexcept { return _node; }
+
+        // The element of a non-empty handle. The key cannot be changed, as the node holds a const key.
+        const key_type &key() const noexcept { return _node->_value.first; }
+        mapped_type &mapped() const noexcept { return _node->_value.second; }
+        value_type &value() const noexcept { return _node->_value; }
+        allocator_type get_allocator() const { return allocator_type(*_allocator); }
+
+    private:
+        friend class avl_tree;
+
+        node_type *_node{nullptr};
+        std::optional<node_allocator_type> _allocator;
+
+        node_handle(node_type *node, const node_allocator_type &allocator) : _node(node), _allocator(allocator) {}
+
+        // Take the node out of the handle, leaving it empty.
+        node_type *release() noexcept {
+            auto *node = _node;
+            _node = nullptr;
+            _allocator.reset();
+            return node;
+        }
+
+        void reset() noexcept {
+            if (_node) {
+                node_alloc_traits::destroy(*_allocator, _node);
+                node_alloc_traits::deallocate(*_allocator, _node, 1);
+            }
+            release();
+        }
+    };
+
+    // Result of inserting a node handle: the position of the element with its key, whether the node was
+    // inserted, and the node itself if it was not.
+    struct insert_return_type {
+        iterator position;
+        bool inserted;
+        node_handle node;
+    };
+
     // (Constant) begin and end iterators.
     iterator begin() noexcept { return iterator(_begin); }
     const_iterator cbegin() const noexcept { return const_iterator(_begin); }
-    iterator end() noexcept { return iterator(_root_sentinel.get()); }
-    const_iterator cend() const noexcept { return const_iterator(_root_sentinel.get()); }
+    iterator end() noexcept { return iterator(_root_sentinel); }
+    const_iterator cend() const noexcept { return const_iterator(_root_sentinel); }
 
     // An empty constructor sets up the root sentinel and the begin pointer. Begin pointer points to
     // the root sentinel when the tree is empty, so that begin() and end() iterators are equal in that
-    // case.
-    avl_tree() : _root_sentinel{std::make_unique<node_type>()}, _begin{_root_sentinel.get()} {}
+    // case. With the persistent storage, the tree starts with the nodes left in the storage, if there are any.
+    avl_tree() : avl_tree(allocator_type()) {}
+    explicit avl_tree(const allocator_type &alloc)
+        : _node_allocator(alloc), _root_sentinel{open_root_sentinel()}, _begin{_root_sentinel}, _last{_root_sentinel} {
+        open_stored_nodes();
+        link_thread_ends();
+    }
+    explicit avl_tree(const cmp_type &comparator, const allocator_type &alloc = allocator_type())
+        : _node_allocator(alloc), _root_sentinel{open_root_sentinel()}, _begin{_root_sentinel}, _last{_root_sentinel},
+          _comparator(comparator) {
+        open_stored_nodes();
+        link_thread_ends();
+    }
+
+    // Build the tree from a sorted range in linear time (see "assign").
+    template <class ItT>
+    avl_tree(sorted_unique_t tag, ItT first, ItT last, const cmp_type &comparator = cmp_type(),
+             const allocator_type &alloc = allocator_type())
+        : avl_tree(comparator, alloc) {
+        assign(tag, first, last);
+    }
+    template <class ItT>
+    avl_tree(sorted_equivalent_t tag, ItT first, ItT last, const cmp_type &comparator = cmp_type(),
+             const allocator_type &alloc = allocator_type())
+        : avl_tree(comparator, alloc) {
+        assign(tag, first, last);
+    }
+
+    // Copy constructor makes a deep copy of the other tree, preserving its shape.
+    avl_tree(const avl_tree &other)
+        : _node_allocator(node_alloc_traits::select_on_container_copy_construction(other._node_allocator)),
+          _root_sentinel{create_node()}, _begin{_root_sentinel}, _last{_root_sentinel}, _comparator(other._comparator) {
+        static_assert(!persistent_storage, "The trees in the persistent storage cannot be copied.");
+        try {
+            copy_from(other);
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    // Move constructor takes over the nodes of the other tree, which is left empty, with a new sentinel. If the
+    // other tree is the one kept in the persistent storage, this tree is kept there instead.
+    avl_tree(avl_tree &&other) : avl_tree(unstored, other._comparator, other.get_allocator()) {
+        swap_contents(other);
+    }
+
+    // Copy assignment keeps the allocator of this tree, unless the allocator propagates on the copy assignment.
+    // The copy is made before the old nodes are destroyed, so the tree is unchanged if the copying throws.
+    avl_tree &operator=(const avl_tree &other) {
+        static_assert(!persistent_storage, "The trees in the persistent storage cannot be copied.");
+        if (this == &other)
+            return *this;
+
+        constexpr bool propagate = node_alloc_traits::propagate_on_container_copy_assignment::value;
+        avl_tree copy(unstored, other._comparator, propagate ? other.get_allocator() : get_allocator());
+        copy.copy_from(other);
+        swap_contents(copy);
+        // The old nodes are destroyed with the copy, through the allocator which made them.
+        if constexpr (propagate)
+            std::swap(_node_allocator, copy._node_allocator);
+        return *this;
+    }
+
+    // Move assignment takes over the nodes of the other tree, which is left empty. With the persistent storage,
+    // the old nodes of the stored tree are left in the storage as if the tree were destroyed, and the other tree
+    // gets a new sentinel, which needs an allocation. If the allocator does not propagate, and the allocators
+    // differ, this tree cannot free the nodes of the other one - then, like in the std::map, the elements are
+    // moved one by one into the new nodes, and the tree is unchanged if that throws.
+    avl_tree &operator=(avl_tree &&other) noexcept(!persistent_storage && takes_over_nodes) {
+        if (this == &other)
+            return *this;
+
+        constexpr bool propagate = node_alloc_traits::propagate_on_container_move_assignment::value;
+        if constexpr (!takes_over_nodes) {
+            if (_node_allocator != other._node_allocator) {
+                avl_tree moved(unstored, other._comparator, get_allocator());
+                moved.copy_from<true>(other);
+                // The nodes are attached to the sentinel of this tree, which may be the one in the storage.
+                const auto size = moved._size;
+                clear();
+                attach_root(moved.detach_root(), size);
+                _comparator = std::move(moved._comparator);
+                other.clear();
+                return *this;
+            }
+        }
+        if constexpr (persistent_storage) {
+            avl_tree moved(std::move(other));
+            release();
+            if constexpr (propagate)
+                _node_allocator = moved._node_allocator;
+            swap_contents(moved);
+        } else {
+            // The emptied sentinel of this tree (and its allocator, if it propagates) goes to the other tree.
+            clear();
+            if constexpr (propagate)
+                std::swap(_node_allocator, other._node_allocator);
+            swap_contents(other);
+        }
+        return *this;
+    }
+
+    ~avl_tree() { release(); }
+
+    allocator_type get_allocator() const { return allocator_type(_node_allocator); }
 
     // Is the tree empty.
     bool empty() const noexcept { return root() == nullptr; }
     // Return the size of the tree.
-    bool size() const noexcept { return _size; }
+    size_type size() const noexcept { return _size; }
     // Maximum number of elements in the tree.
     constexpr size_type max_size() const noexcept { return std::numeric_limits<size_type>::max(); }
 
-    // Delete all the nodes in the tree. By resetting the root node, we set in motion the cascading erasure
-    // of all the nodes pointed to by unique_ptrs.
-    void clear() noexcept { _root_sentinel->_left.reset(nullptr); _size = 0; }
+    // Delete all the nodes in the tree, and return the nodes' memory to the allocator.
+    void clear() noexcept {
+        destroy_subtree(root());
+        _root_sentinel->set_left(nullptr);
+        _begin = _root_sentinel;
+        _last = _root_sentinel;
+        _size = 0;
+        link_thread_ends();
+    }
 
     // Move construct the node and insert it in the tree. Expects the argument to be a <key, value> pair reference.
     // Return the iterator to the newly inserted element.
@@ -476,8 +2141,10 @@ public:
     [[maybe_unused]] std::pair<iterator, bool> emplace(Args&&... args) {
         // Special case of empty tree insertion.
         if (!root()) {
-            _root_sentinel->_left = std::make_unique<node_type>(node_val_type(std::forward<Args>(args)...), _root_sentinel.get());
+            _root_sentinel->set_left(create_node(node_val_type(std::forward<Args>(args)...), _root_sentinel));
             _begin = root();
+            _last = root();
+            link_thread_ends();
             ++_size;
             return std::make_pair(iterator(root()), true);
         }
@@ -487,10 +2154,11 @@ public:
             return std::make_pair(end(), false);
 
         // Insert the node and fixup the tree to satisfy the AVL invariant.
-        auto *new_node = insert_internal(root(), std::forward<Args>(args)...);
-        retrace_insert(get_unique_ptr(new_node));
+        auto [new_node, inserted] = insert_internal(root(), std::forward<Args>(args)...);
+        if (inserted)
+            retrace_insert(new_node);
 
-        return std::make_pair(iterator(new_node), true);
+        return std::make_pair(iterator(new_node), inserted);
     }
 
     // Move construct the node and insert it in the tree. The first argument is the key, while consecutive arguments are used
@@ -499,14 +2167,16 @@ public:
     template <class... Args>
     [[maybe_unused]] std::pair<iterator, bool> try_emplace(const key_type &key, Args&&... args) {
         if (auto it = find(key); it != end())
-            return std::make_pair(it, true);
+            return std::make_pair(it, false);
 
         // Special case of empty tree insertion.
         if (!root()) {
-            _root_sentinel->_left = std::make_unique<node_type>(node_val_type(std::piecewise_construct, std::forward_as_tuple(key),
-                                                                              std::forward_as_tuple(std::forward<Args>(args)...)),
-                                                                _root_sentinel.get());
+            _root_sentinel->set_left(create_node(node_val_type(std::piecewise_construct, std::forward_as_tuple(key),
+                                                              std::forward_as_tuple(std::forward<Args>(args)...)),
+                                                _root_sentinel));
             _begin = root();
+            _last = root();
+            link_thread_ends();
             ++_size;
             return std::make_pair(iterator(root()), true);
         }
@@ -518,12 +2188,29 @@ public:
         // Insert the node and fixup the tree to satisfy the AVL invariant.
         auto new_node_val = node_val_type(std::piecewise_construct, std::forward_as_tuple(key),
                                           std::forward_as_tuple(std::forward<Args>(args)...));
-        auto *new_node = insert_internal(root(), std::move(new_node_val));
-        retrace_insert(get_unique_ptr(new_node));
+        auto *new_node = insert_internal(root(), std::move(new_node_val)).first;
+        retrace_insert(new_node);
 
         return std::make_pair(iterator(new_node), true);
     }
 
+    // Construct the element and insert it as close as possible to the position just before the "hint". If the
+    // hint is right - the key belongs right before or right after the hint - the element is placed in constant
+    // amortized time, without descending from the root. Passing end() as the hint is the fast way to append the
+    // ascending keys. Returns the iterator to the inserted element, or to the element which already holds the key.
+    template <class... Args>
+    iterator emplace_hint(const_iterator hint, Args&&... args) {
+        node_val_type value(std::forward<Args>(args)...);
+        if (!root() || _size == max_size())
+            return emplace(std::move(value)).first;
+
+        auto [new_node, inserted] = insert_hint_internal(hint._ptr, std::move(value));
+        if (inserted)
+            retrace_insert(new_node);
+
+        return iterator(new_node);
+    }
+
     // Various "insert" function overloads.
     [[maybe_unused]] std::pair<iterator, bool> insert(const node_val_type &value) { return emplace(value); }
     [[maybe_unused]] std::pair<iterator, bool> insert(node_val_type &&value) { return emplace(std::move(value)); }
@@ -532,6 +2219,9 @@ public:
     template <class InsT>
     [[maybe_unused]] std::pair<iterator, bool> insert(InsT &&value) { return emplace(std::forward<InsT>(value)); }
 
+    iterator insert(const_iterator hint, const node_val_type &value) { return emplace_hint(hint, value); }
+    iterator insert(const_iterator hint, node_val_type &&value) { return emplace_hint(hint, std::move(value)); }
+
     template <class ItT>
     void insert(ItT first, ItT last) {
         for (; first != last; ++first)
@@ -543,32 +2233,327 @@ public:
             insert(val);
     }
 
-    // Erase the node at "pos", and return the node that precedes it.
+    // Replace the contents of the tree with the elements of a sorted range. Instead of inserting the elements
+    // one by one, the perfectly balanced tree is built directly, in linear time and without any rotations.
+    // With the "sorted_equivalent" tag, only the first of the elements with equal keys is kept.
+    template <class ItT>
+    void assign(sorted_unique_t, ItT first, ItT last) { assign_sorted(first, last, true); }
+    template <class ItT>
+    void assign(sorted_equivalent_t, ItT first, ItT last) { assign_sorted(first, last, false); }
+
+    // Write the tree to a binary stream: a header, followed by the elements in the key order, each with the height
+    // of its node. The keys and values are written as they are in memory, so they must be trivially copyable, and
+    // the data can only be loaded on a platform with the same type layout. Check the stream state afterwards.
+    void save(std::ostream &out) const {
+        static_assert(std::is_trivially_copyable_v<key_type> && std::is_trivially_copyable_v<val_type>,
+                      "Only the trees of the trivially copyable keys and values can be saved.");
+        const std::uint32_t key_size = sizeof(key_type), val_size = sizeof(val_type);
+        const std::uint64_t size = _size;
+        out.write(file_magic, sizeof(file_magic));
+        out.write(reinterpret_cast<const char *>(&key_size), sizeof(key_size));
+        out.write(reinterpret_cast<const char *>(&val_size), sizeof(val_size));
+        out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+
+        std::vector<char> buffer;
+        buffer.reserve(file_buffer_records * file_record_size);
+        save_subtree(out, root(), buffer);
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    }
+
+    // Replace the contents of the tree with the tree written by "save". The node heights give the exact shape of
+    // the saved tree, so it is rebuilt in a single linear pass, without any comparisons beyond checking the order
+    // of the keys. Throws std::runtime_error if the stream does not hold a valid tree of the same types, and leaves
+    // the tree empty then.
+    void load(std::istream &in) {
+        static_assert(std::is_trivially_copyable_v<key_type> && std::is_trivially_copyable_v<val_type>,
+                      "Only the trees of the trivially copyable keys and values can be loaded.");
+        clear();
+        char magic[sizeof(file_magic)];
+        std::uint32_t key_size = 0, val_size = 0;
+        std::uint64_t size = 0;
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char *>(&key_size), sizeof(key_size));
+        in.read(reinterpret_cast<char *>(&val_size), sizeof(val_size));
+        in.read(reinterpret_cast<char *>(&size), sizeof(size));
+        if (!in || !std::equal(magic, magic + sizeof(magic), file_magic) || key_size != sizeof(key_type) ||
+            val_size != sizeof(val_type) || size > max_size())
+            throw std::runtime_error("Invalid tree data.\n");
+
+        load_nodes(in, static_cast<size_type>(size));
+    }
+
+    // Erase the node at "pos", and return the iterator to the node that follows it.
     iterator erase(iterator pos) {
         if (pos == end())
             throw std::out_of_range("Invalid iterator.\n");
         auto ret_it = pos;
         ++ret_it;
 
-        // This case is a little different from insertion because we actually need the node not to be erased
-        // before the retrace call. Luckily, we can just call retrace before the actual deletion, and act as
-        // if the node had already been deleted.
-        retrace_erase(get_unique_ptr(pos._ptr));
         erase_internal(pos._ptr);
         --_size;
 
         if (_size == 0)
-            _begin = _root_sentinel.get();
+            _begin = _root_sentinel;
 
         return ret_it;
     }
 
+    // Erase the nodes in the [first, last) range, and return the iterator to the node that follows them. The
+    // range spanning the whole tree is freed at once, without rebalancing.
+    iterator erase(const_iterator first, const_iterator last) {
+        if (first == last)
+            return iterator(last._ptr);
+        if (first._ptr == _begin && last._ptr == _root_sentinel) {
+            clear();
+            return end();
+        }
+
+        // Short ranges are erased node by node. Longer ones are cut out of the tree, and the parts before and
+        // after them are joined around their first node, which is then erased as usual. This rebalances the tree
+        // only along a few paths, instead of after every erased node, but costs a few descents of its own.
+        constexpr int short_range = 64;
+        auto it = first;
+        for (int i = 0; i < short_range && it != last; ++i)
+            ++it;
+        if (it == last) {
+            while (first != last)
+                first = erase(iterator(first._ptr));
+            return iterator(last._ptr);
+        }
+
+        auto *pivot = first._ptr;
+        const auto size = _size;
+        auto *root = detach_root();
+        node_type *before, *range, *after = nullptr;
+        int before_height, range_height, after_height = 0;
+        try {
+            split_subtree(root, subtree_height(root), pivot->_value.first, before, before_height, range, range_height);
+        } catch (...) {
+            attach_root(root, size);
+            throw;
+        }
+        if (last._ptr != _root_sentinel) {
+            auto *rest = range;
+            try {
+                split_subtree(rest, range_height, last._ptr->_value.first, range, range_height, after, after_height);
+            } catch (...) {
+                // Nothing has been erased yet, so the tree is put back together.
+                int height;
+                attach_root(join_subtrees(before, before_height, rest, range_height, height), size);
+                throw;
+            }
+        }
+
+        // The pivot has the smallest key in the range, so it has no left child.
+        if (auto *parent = pivot->parent())
+            parent->set_left(pivot->right());
+        else
+            range = pivot->right();
+        const auto erased = destroy_subtree(range);
+        // The pivot is followed by the first node after the range (or nothing), once the range is gone.
+        link_threads(pivot, last._ptr);
+
+        int height;
+        attach_root(join_subtrees(before, before_height, pivot, after, after_height, height), size - erased);
+        erase_internal(pivot);
+        --_size;
+        return iterator(last._ptr);
+    }
+
+    // Remove the element at "pos" from the tree like "erase", but hand its node over to the returned handle
+    // instead of freeing it.
+    node_handle extract(const_iterator pos) {
+        if (pos == cend())
+            throw std::out_of_range("Invalid iterator.\n");
+        return node_handle(detach_node(pos._ptr), _node_allocator);
+    }
+    // Same, for the element with the given key. The handle is empty if there is no such element.
+    node_handle extract(const key_type &key) {
+        auto *node = find_internal(root(), key);
+        if (node == _root_sentinel)
+            return node_handle();
+        return node_handle(detach_node(node), _node_allocator);
+    }
+
+    // Insert the node owned by the handle, unless the tree already holds its key - then the handle is returned
+    // in the result, still owning the node. The node is linked into the tree as it is, without allocating or
+    // copying anything. The handle must come from a tree with an equal allocator.
+    insert_return_type insert(node_handle &&handle) {
+        if (handle.empty())
+            return {end(), false, node_handle()};
+        assert(_node_allocator == *handle._allocator && "Moving the nodes between incompatible allocators.");
+
+        if (!root()) {
+            attach_root(handle.release(), 1);
+            return {begin(), true, node_handle()};
+        }
+        const auto position = find_insert_position(root(), handle.key());
+        if (position.found)
+            return {iterator(position.node), false, std::move(handle)};
+        auto *node = attach_node(position.node, position.left, handle.release());
+        retrace_insert(node);
+        return {iterator(node), true, node_handle()};
+    }
+
+    // Move the elements of the "source" tree whose keys are not in this tree over to this tree, relinking their
+    // nodes instead of reallocating them. The elements with the keys already in this tree stay in the source.
+    // Takes O(m log(n + m)) time for the source of size m. The trees must have equal allocators.
+    void merge(avl_tree &source) {
+        assert(_node_allocator == source._node_allocator && "Moving the nodes between incompatible allocators.");
+        if (&source == this)
+            return;
+
+        for (auto it = source.begin(); it != source.end();) {
+            auto *node = (it++)._ptr;
+            if (!root()) {
+                attach_root(source.detach_node(node), 1);
+                continue;
+            }
+            // The position is found before the node leaves the source, so a throwing comparator leaves both
+            // trees intact.
+            const auto position = find_insert_position(root(), node->_value.first);
+            if (position.found)
+                continue;
+            attach_node(position.node, position.left, source.detach_node(node));
+            retrace_insert(node);
+        }
+    }
+    void merge(avl_tree &&source) { merge(source); }
+
+    // Move the "pivot" element and all the elements of the "right" tree to the end of this tree, leaving the right
+    // tree empty. All the keys in this tree must be less than the pivot's key, which must be less than all the keys
+    // in the right tree. Instead of inserting the elements one by one, the shorter tree is hung on the spine of
+    // the taller one, which takes O(log n) time. The trees must have equal allocators.
+    void join(const node_val_type &pivot, avl_tree &&right) { join_internal(create_node(pivot, nullptr), right); }
+    void join(node_val_type &&pivot, avl_tree &&right) { join_internal(create_node(std::move(pivot), nullptr), right); }
+    // Same, but the first element of the right tree is used as the pivot.
+    void join(avl_tree &&right) {
+        if (right.empty())
+            return;
+        auto *pivot = right._begin;
+        right.unlink_node(pivot);
+        --right._size;
+        join_internal(pivot, right);
+    }
+
+    // Move the elements with the keys not less than the given key to a new tree, which is returned. The tree is cut
+    // along the search path for the key, and the pieces hanging off the path are joined together, which takes
+    // O(log n) time with the order statistics. Without them, the new sizes of the trees are found by counting the
+    // elements of the smaller one, so the split takes O(log n + min(k, n - k)) time, where k is the size of the
+    // new tree. If the comparator throws, the tree is left unchanged. The new tree gets a copy of this tree's
+    // allocator. With the persistent storage, only this tree stays in the storage - the new one is destroyed with
+    // its nodes.
+    avl_tree split(const key_type &key) { return split_internal(key); }
+    template <class K, class = transparent_key<K>>
+    avl_tree split(const K &key) { return split_internal(key); }
+
+    // Set algebra on the trees, built from joins and splits and running on multiple threads. The result is a new tree
+    // with the elements whose keys are in either of the trees (the element of "lhs" is kept if they both are), in both
+    // of them, or in "lhs" but not in "rhs". The trees are taken by value - pass them with std::move to reuse their
+    // nodes, instead of copying them. Takes O(m log(n/m + 1)) work, where m and n are the sizes of the smaller and
+    // the larger tree. If the comparator throws, the elements of both trees are destroyed.
+    friend avl_tree set_union(avl_tree lhs, avl_tree rhs) { return combine(set_operation::unite, lhs, rhs); }
+    friend avl_tree set_intersection(avl_tree lhs, avl_tree rhs) { return combine(set_operation::intersect, lhs, rhs); }
+    friend avl_tree set_difference(avl_tree lhs, avl_tree rhs) { return combine(set_operation::subtract, lhs, rhs); }
+
     // Return the iterator to the node with the given key if it exists, otherwise, return end().
     iterator find(const key_type &key) { return iterator(find_internal(root(), key)); }
-    const_iterator find(const key_type &key) const {return const_iterator(find_internal(root(), key));}
+    const_iterator find(const key_type &key) const {return const_iterator(find_internal(_root_sentinel->left(), key));}
+    template <class K, class = transparent_key<K>>
+    iterator find(const K &key) { return iterator(find_internal(root(), key)); }
+    template <class K, class = transparent_key<K>>
+    const_iterator find(const K &key) const { return const_iterator(find_internal(_root_sentinel->left(), key)); }
+
+    // Return the iterator to the first node with the key not less than the given key, or end() if there is none.
+    iterator lower_bound(const key_type &key) { return iterator(lower_bound_internal(root(), key)); }
+    const_iterator lower_bound(const key_type &key) const { return const_iterator(lower_bound_internal(_root_sentinel->left(), key)); }
+    template <class K, class = transparent_key<K>>
+    iterator lower_bound(const K &key) { return iterator(lower_bound_internal(root(), key)); }
+    template <class K, class = transparent_key<K>>
+    const_iterator lower_bound(const K &key) const { return const_iterator(lower_bound_internal(_root_sentinel->left(), key)); }
+    // Return the iterator to the first node with the key greater than the given key, or end() if there is none.
+    iterator upper_bound(const key_type &key) { return iterator(upper_bound_internal(root(), key)); }
+    const_iterator upper_bound(const key_type &key) const { return const_iterator(upper_bound_internal(_root_sentinel->left(), key)); }
+    template <class K, class = transparent_key<K>>
+    iterator upper_bound(const K &key) { return iterator(upper_bound_internal(root(), key)); }
+    template <class K, class = transparent_key<K>>
+    const_iterator upper_bound(const K &key) const { return const_iterator(upper_bound_internal(_root_sentinel->left(), key)); }
+    // Return the range of the nodes with the given key - a single node, or an empty range at the lower bound.
+    std::pair<iterator, iterator> equal_range(const key_type &key) {
+        auto [lower, upper] = equal_range_internal(root(), key);
+        return std::make_pair(iterator(lower), iterator(upper));
+    }
+    std::pair<const_iterator, const_iterator> equal_range(const key_type &key) const {
+        auto [lower, upper] = equal_range_internal(_root_sentinel->left(), key);
+        return std::make_pair(const_iterator(lower), const_iterator(upper));
+    }
+    template <class K, class = transparent_key<K>>
+    std::pair<iterator, iterator> equal_range(const K &key) {
+        auto [lower, upper] = equal_range_internal(root(), key);
+        return std::make_pair(iterator(lower), iterator(upper));
+    }
+    template <class K, class = transparent_key<K>>
+    std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+        auto [lower, upper] = equal_range_internal(_root_sentinel->left(), key);
+        return std::make_pair(const_iterator(lower), const_iterator(upper));
+    }
+
+    // Return the iterator to the element at the given position in the sorted order (counting from zero), or end()
+    // if the tree holds fewer elements. The order statistic queries require the "order_statistics" option.
+    iterator nth(size_type index) {
+        static_assert(order_statistics, "The tree does not keep the order statistics.");
+        return iterator(nth_internal(index));
+    }
+    const_iterator nth(size_type index) const {
+        static_assert(order_statistics, "The tree does not keep the order statistics.");
+        return const_iterator(nth_internal(index));
+    }
+    // Return the number of the elements with the keys less than the given key, i.e. the position of its lower bound.
+    size_type rank(const key_type &key) const {
+        static_assert(order_statistics, "The tree does not keep the order statistics.");
+        return rank_internal(key);
+    }
+    template <class K, class = transparent_key<K>>
+    size_type rank(const K &key) const {
+        static_assert(order_statistics, "The tree does not keep the order statistics.");
+        return rank_internal(key);
+    }
+    // Return the number of the elements with the keys in the [lower, upper) range.
+    size_type count_range(const key_type &lower, const key_type &upper) const {
+        static_assert(order_statistics, "The tree does not keep the order statistics.");
+        if (!key_less(lower, upper))
+            return 0;
+        return rank_internal(upper) - rank_internal(lower);
+    }
+    template <class K, class = transparent_key<K>>
+    size_type count_range(const K &lower, const K &upper) const {
+        static_assert(order_statistics, "The tree does not keep the order statistics.");
+        if (!key_less(lower, upper))
+            return 0;
+        return rank_internal(upper) - rank_internal(lower);
+    }
+
+    // Snapshot of the counters of the work done by the tree. Require the "statistics" option.
+    tree_statistics statistics() const noexcept {
+        static_assert(options_type::statistics, "The tree does not keep the statistics.");
+        return this->snapshot();
+    }
+    void reset_statistics() noexcept {
+        static_assert(options_type::statistics, "The tree does not keep the statistics.");
+        this->reset();
+    }
+
+    // Number of the levels of the tree (zero if the tree is empty). Takes O(log n) time.
+    int height() const noexcept { return subtree_height(root()); }
+    // Number of the nodes at each depth, starting with the root at depth zero. Walks the whole tree.
+    std::vector<size_type> depth_histogram() const {
+        std::vector<size_type> histogram(static_cast<std::size_t>(height()));
+        count_depths(root(), 0, histogram);
+        return histogram;
+    }
 
     // Comparison operators.
-    bool friend operator==(const avl_tree<T, Key, Cmp> &lhs, const avl_tree<T, Key, Cmp> &rhs) noexcept {
+    bool friend operator==(const avl_tree &lhs, const avl_tree &rhs) noexcept {
         if (lhs.size() != rhs.size())
             return false;
 
@@ -579,8 +2564,8 @@ public:
 
         return true;
     }
-    bool friend operator!=(const avl_tree<T, Key, Cmp> &lhs, const avl_tree<T, Key, Cmp> &rhs) noexcept { return !(lhs == rhs); }
-    bool friend operator<(const avl_tree<T, Key, Cmp> &lhs, const avl_tree<T, Key, Cmp> &rhs) noexcept {
+    bool friend operator!=(const avl_tree &lhs, const avl_tree &rhs) noexcept { return !(lhs == rhs); }
+    bool friend operator<(const avl_tree &lhs, const avl_tree &rhs) noexcept {
         auto it_lhs = lhs.cbegin();
         auto it_rhs = rhs.cbegin();
         for (; it_lhs != lhs.cend() || it_rhs != rhs.cend(); ++it_lhs, ++it_rhs) {
@@ -593,23 +2578,35 @@ public:
 
         return false;
     }
-    bool friend operator<=(const avl_tree<T, Key, Cmp> &lhs, const avl_tree<T, Key, Cmp> &rhs) noexcept { return (lhs < rhs) || (lhs == rhs); }
-    bool friend operator>(const avl_tree<T, Key, Cmp> &lhs, const avl_tree<T, Key, Cmp> &rhs) noexcept { return !(lhs <= rhs); }
-    bool friend operator>=(const avl_tree<T, Key, Cmp> &lhs, const avl_tree<T, Key, Cmp> &rhs) noexcept { return !(lhs < rhs); }
+    bool friend operator<=(const avl_tree &lhs, const avl_tree &rhs) noexcept { return (lhs < rhs) || (lhs == rhs); }
+    bool friend operator>(const avl_tree &lhs, const avl_tree &rhs) noexcept { return !(lhs <= rhs); }
+    bool friend operator>=(const avl_tree &lhs, const avl_tree &rhs) noexcept { return !(lhs < rhs); }
 
     // Find the node with the given key. If such node exists, return a reference to its payload value. If it doesn't exist,
     // create a new node, and return the reference to its payload value.
     val_type &operator[](const key_type &key) noexcept {
-        if (auto *node = find_internal(root(), key); node != _root_sentinel.get()) {
+        if (auto *node = find_internal(root(), key); node != _root_sentinel) {
             return node->_value.second;
         }
 
         return emplace(std::make_pair(key, val_type())).first->second;
     }
+    // With the transparent comparator, the key is only converted to "key_type" if a new node is created.
+    template <class K, class = transparent_key<K>>
+    val_type &operator[](const K &key) {
+        if (auto *node = find_internal(root(), key); node != _root_sentinel)
+            return node->_value.second;
+
+        return emplace(node_val_type(key_type(key), val_type())).first->second;
+    }
 
     // Like "operator[]", but throws an exception if the node with the given key does not exist.
     val_type &at(const key_type &key) { return at_internal(key); }
     const val_type &at(const key_type &key) const { return at_internal(key); }
+    template <class K, class = transparent_key<K>>
+    val_type &at(const K &key) { return at_internal(key); }
+    template <class K, class = transparent_key<K>>
+    const val_type &at(const K &key) const { return at_internal(key); }
 };
 
 } // end namespace avl
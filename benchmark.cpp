@@ -0,0 +1,1033 @@
+// Benchmark suite of the "avl_tree" and the "btree" against std::map and std::set. Every workload runs with the int
+// and the string keys, in the random, ascending, descending and Zipfian key orders, and reports the mean time per
+// operation, the latency percentiles and the heap allocations per operation. The suite is followed by the workloads
+// of the tree variants: the allocators, the options, and the concurrent, durable, persistent and sharded trees. Build
+// with the optimizations (-DCMAKE_BUILD_TYPE=Release) for meaningful numbers. The optional argument is the number of
+// keys.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "avl_tree.h"
+#include "btree.h"
+#include "concurrent_avl_tree.h"
+#include "durable_avl_tree.h"
+#include "instrumented_avl_tree.h"
+#include "node_arena.h"
+#include "node_file_arena.h"
+#include "node_pool_allocator.h"
+#include "optimistic_avl_tree.h"
+#include "persistent_avl_tree.h"
+#include "sharded_avl_tree.h"
+
+// Number of the heap allocations so far, counted by the global operator new.
+static std::size_t allocation_count = 0;
+
+// The replacements are not inlined, so that the compiler does not see them pair the malloc with the operator
+// delete (and warn about the mismatch).
+#if defined(__GNUC__)
+#define BENCHMARK_NOINLINE __attribute__((noinline))
+#else
+#define BENCHMARK_NOINLINE
+#endif
+
+BENCHMARK_NOINLINE void *operator new(std::size_t size)
+{
+    ++allocation_count;
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+BENCHMARK_NOINLINE void operator delete(void *ptr) noexcept { std::free(ptr); }
+BENCHMARK_NOINLINE void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+using clock_type = std::chrono::steady_clock;
+
+// Collects the latencies of the individual operations, and the allocations made by them.
+class latency_recorder {
+public:
+    explicit latency_recorder(std::size_t ops) { _samples.reserve(ops); }
+
+    // Time a single operation.
+    template <typename Fn>
+    void measure(Fn &&fn)
+    {
+        const auto start = clock_type::now();
+        fn();
+        const auto end = clock_type::now();
+        _samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() - clock_overhead);
+    }
+
+    void start() { _allocations = allocation_count; }
+    void stop() { _allocations = allocation_count - _allocations; }
+
+    // Print the mean, the percentiles and the allocations per operation.
+    void print(const std::string &label)
+    {
+        std::sort(_samples.begin(), _samples.end());
+        const double mean = std::accumulate(_samples.begin(), _samples.end(), 0.0) / _samples.size();
+        std::cout << std::left << std::setw(56) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << std::max(mean, 0.0) << std::setw(9) << percentile(0.5) << std::setw(9)
+                  << percentile(0.99) << std::setw(10) << percentile(0.999) << std::setprecision(2) << std::setw(11)
+                  << static_cast<double>(_allocations) / _samples.size() << "\n";
+    }
+
+    // Cost of reading the clock, which the samples are corrected for.
+    static inline double clock_overhead = 0;
+
+    static void calibrate()
+    {
+        std::vector<double> samples(100000);
+        for (auto &sample : samples) {
+            const auto start = clock_type::now();
+            const auto end = clock_type::now();
+            sample = std::chrono::duration<double, std::nano>(end - start).count();
+        }
+        std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+        clock_overhead = samples[samples.size() / 2];
+    }
+
+private:
+    std::vector<double> _samples;
+    std::size_t _allocations{0};
+
+    double percentile(double fraction) const
+    {
+        const auto index = static_cast<std::size_t>(fraction * (_samples.size() - 1));
+        return std::max(_samples[index], 0.0);
+    }
+};
+
+// Keep the results of the lookups from being optimized away.
+static long sink = 0;
+
+template <typename Container>
+constexpr bool is_set_v = false;
+template <typename Key>
+constexpr bool is_set_v<std::set<Key>> = true;
+
+template <typename Container, typename Key>
+void insert_key(Container &container, const Key &key)
+{
+    if constexpr (is_set_v<Container>)
+        container.insert(key);
+    else
+        container.insert({key, 1});
+}
+
+template <typename Container, typename It>
+long element_value(const Container &, It it)
+{
+    if constexpr (is_set_v<Container>)
+        return static_cast<long>(sizeof(*it));
+    else
+        return it->second;
+}
+
+template <typename Container, typename Key>
+void erase_key(Container &container, const Key &key)
+{
+    if (auto it = container.find(key); it != container.end())
+        container.erase(it);
+}
+
+template <typename Container, typename Key>
+Container build(const std::vector<Key> &keys)
+{
+    Container container;
+    for (const auto &key : keys)
+        insert_key(container, key);
+    return container;
+}
+
+// Keys of a benchmark run. The container for the lookups holds the "stored" keys, the insertions and erasures go in
+// the "ordered" sequence (which has the repeated keys with the Zipfian order), and the lookups use the "queries".
+// The "absent" keys are not stored, and the mixed workload inserts and erases them.
+template <typename Key>
+struct key_set {
+    std::vector<Key> stored;
+    std::vector<Key> ordered;
+    std::vector<Key> queries;
+    std::vector<Key> absent;
+};
+
+template <typename Container, typename Key>
+void run_workloads(const std::string &label, const key_set<Key> &keys)
+{
+    const auto size = keys.stored.size();
+    {
+        Container container;
+        latency_recorder recorder(keys.ordered.size());
+        recorder.start();
+        for (const auto &key : keys.ordered)
+            recorder.measure([&] { insert_key(container, key); });
+        recorder.stop();
+        recorder.print("insert " + label);
+    }
+
+    auto container = build<Container>(keys.stored);
+    {
+        latency_recorder recorder(keys.queries.size());
+        recorder.start();
+        for (const auto &key : keys.queries)
+            recorder.measure([&] {
+                if (auto it = container.find(key); it != container.end())
+                    sink += element_value(container, it);
+            });
+        recorder.stop();
+        recorder.print("find " + label);
+    }
+    {
+        // The scans start at every tenth query, and visit 16 elements.
+        latency_recorder recorder(keys.queries.size() / 10 + 1);
+        recorder.start();
+        for (std::size_t i = 0; i < keys.queries.size(); i += 10)
+            recorder.measure([&] {
+                auto it = container.lower_bound(keys.queries[i]);
+                for (int j = 0; j < 16 && it != container.end(); ++j, ++it)
+                    sink += element_value(container, it);
+            });
+        recorder.stop();
+        recorder.print("range scan (16) " + label);
+    }
+    {
+        // Every tenth operation inserts an absent key, or erases the one inserted before.
+        latency_recorder recorder(keys.queries.size());
+        recorder.start();
+        for (std::size_t i = 0; i < keys.queries.size(); ++i) {
+            if (i % 10 != 0)
+                recorder.measure([&] {
+                    if (auto it = container.find(keys.queries[i]); it != container.end())
+                        sink += element_value(container, it);
+                });
+            else if (i % 20 == 0)
+                recorder.measure([&] { insert_key(container, keys.absent[i / 20 % keys.absent.size()]); });
+            else
+                recorder.measure([&] { erase_key(container, keys.absent[i / 20 % keys.absent.size()]); });
+        }
+        recorder.stop();
+        recorder.print("mixed 90/10 " + label);
+    }
+    {
+        // The iteration is timed as a whole, and reported per element.
+        const auto allocations = allocation_count;
+        const auto start = clock_type::now();
+        for (auto it = container.begin(); it != container.end(); ++it)
+            sink += element_value(container, it);
+        const auto elapsed = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+        std::cout << std::left << std::setw(56) << "iterate " + label << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << elapsed / size << std::setw(9) << "-" << std::setw(9)
+                  << "-" << std::setw(10) << "-" << std::setprecision(2) << std::setw(11)
+                  << static_cast<double>(allocation_count - allocations) / size << "\n";
+    }
+    {
+        latency_recorder recorder(keys.ordered.size());
+        recorder.start();
+        for (const auto &key : keys.ordered)
+            recorder.measure([&] { erase_key(container, key); });
+        recorder.stop();
+        recorder.print("erase " + label);
+    }
+}
+
+// Indices of "count" keys drawn from the Zipfian distribution (with the exponent close to one) over "size" keys.
+// The popular keys are scattered over the key space.
+std::vector<std::size_t> zipfian_indices(std::size_t size, std::size_t count, std::mt19937 &rng)
+{
+    std::vector<double> cumulative(size);
+    double sum = 0;
+    for (std::size_t rank = 0; rank < size; ++rank)
+        cumulative[rank] = sum += 1.0 / std::pow(static_cast<double>(rank + 1), 0.99);
+    std::vector<std::size_t> scatter(size);
+    std::iota(scatter.begin(), scatter.end(), std::size_t(0));
+    std::shuffle(scatter.begin(), scatter.end(), rng);
+
+    std::uniform_real_distribution<double> uniform(0, sum);
+    std::vector<std::size_t> indices(count);
+    for (auto &index : indices) {
+        const auto rank = std::lower_bound(cumulative.begin(), cumulative.end(), uniform(rng)) - cumulative.begin();
+        index = scatter[std::min(static_cast<std::size_t>(rank), size - 1)];
+    }
+    return indices;
+}
+
+// Run all the workloads on all the containers, with the keys made of the indices by "make_key". The stored keys
+// are made of the even indices, and the absent ones of the odd indices.
+template <typename Key, typename MakeKey>
+void run_key_type(const std::string &key_label, std::size_t size, MakeKey &&make_key)
+{
+    std::mt19937 rng(42);
+    std::vector<std::size_t> ascending(size);
+    std::iota(ascending.begin(), ascending.end(), std::size_t(0));
+    std::vector<std::size_t> random = ascending;
+    std::shuffle(random.begin(), random.end(), rng);
+    std::vector<std::size_t> descending(ascending.rbegin(), ascending.rend());
+    const auto zipfian = zipfian_indices(size, size, rng);
+
+    auto keys_of = [&](const std::vector<std::size_t> &indices, std::size_t offset) {
+        std::vector<Key> keys;
+        keys.reserve(indices.size());
+        for (auto index : indices)
+            keys.push_back(make_key(2 * index + offset));
+        return keys;
+    };
+
+    key_set<Key> keys;
+    keys.stored = keys_of(random, 0);
+    keys.absent = keys_of(random, 1);
+    // Warm the heap up, so that the first container measured does not pay for the memory the later ones reuse.
+    build<std::map<Key, int>>(keys.absent);
+    const std::pair<const char *, const std::vector<std::size_t> *> orders[] = {
+        {"random", &random}, {"ascending", &ascending}, {"descending", &descending}, {"zipfian", &zipfian}};
+    for (const auto &[order_label, order] : orders) {
+        keys.ordered = keys.queries = keys_of(*order, 0);
+        const std::string label = std::string(key_label) + " " + order_label;
+        run_workloads<avl::avl_tree<Key, int>>(label + ", avl_tree", keys);
+        run_workloads<avl::btree<Key, int>>(label + ", btree", keys);
+        run_workloads<std::map<Key, int>>(label + ", std::map", keys);
+        run_workloads<std::set<Key>>(label + ", std::set", keys);
+    }
+}
+
+using pool_tree = avl::avl_tree<int, int, std::less<int>, avl::node_pool_allocator<std::pair<const int, int>>>;
+using arena_tree = avl::avl_tree<int, int, std::less<int>, avl::arena_allocator<std::pair<const int, int>>>;
+using order_statistics_tree = avl::avl_tree<int, int, std::less<int>, std::allocator<std::pair<const int, int>>,
+                                            avl::order_statistics_options>;
+
+// Total number of bytes currently allocated through the "counting_allocator". Its allocations are counted by the
+// operator new too.
+static std::size_t allocated_bytes = 0;
+
+// Allocator which keeps track of the memory allocated by a container.
+template <typename T>
+struct counting_allocator {
+    using value_type = T;
+
+    counting_allocator() = default;
+    template <typename U>
+    counting_allocator(const counting_allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n)
+    {
+        allocated_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        allocated_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    friend bool operator==(const counting_allocator &, const counting_allocator &) noexcept { return true; }
+    friend bool operator!=(const counting_allocator &, const counting_allocator &) noexcept { return false; }
+};
+
+// String which counts its heap allocations.
+using counted_string = std::basic_string<char, std::char_traits<char>, counting_allocator<char>>;
+
+// Run "fn" once and return the elapsed time in nanoseconds.
+template <typename Fn>
+double time_ns(Fn &&fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// Insert "size" ascending keys into the container, then erase them all from the front.
+template <typename Container>
+double insert_erase_loop(Container container, int size)
+{
+    return time_ns([&] {
+        for (int i = 0; i < size; ++i)
+            container.insert({i, i});
+
+        for (int i = 0; i < size; ++i)
+            container.erase(container.begin());
+    });
+}
+
+// Insert the keys in the given order into an empty container.
+template <typename Container>
+double insert_keys(Container container, const std::vector<int> &keys)
+{
+    return time_ns([&] {
+        for (int key : keys)
+            container.insert({key, key});
+    });
+}
+
+// Insert the keys in the given order into an empty container, with end() as the insertion hint.
+template <typename Container>
+double append_keys(Container container, const std::vector<int> &keys)
+{
+    return time_ns([&] {
+        for (int key : keys)
+            container.emplace_hint(container.end(), key, key);
+    });
+}
+
+// Look up every key in a container holding all the keys.
+template <typename Container>
+double find_keys(Container container, const std::vector<int> &keys)
+{
+    for (int key : keys)
+        container.insert({key, key});
+
+    long sum = 0;
+    auto elapsed = time_ns([&] {
+        for (int key : keys)
+            sum += container.find(key)->second;
+    });
+    // Keep the lookups from being optimized away.
+    if (sum == 42)
+        std::cout << "";
+    return elapsed;
+}
+
+// Sum the values of the "width" elements following each key, in a container holding all the keys.
+template <typename Container>
+double range_scan(Container container, const std::vector<int> &keys, int width)
+{
+    for (int key : keys)
+        container.insert({key, key});
+
+    long sum = 0;
+    auto elapsed = time_ns([&] {
+        for (int key : keys) {
+            auto it = container.lower_bound(key);
+            for (int i = 0; i < width && it != container.end(); ++i, ++it)
+                sum += it->second;
+        }
+    });
+    if (sum == 42)
+        std::cout << "";
+    return elapsed;
+}
+
+// Look up every key in a string keyed tree holding all the keys.
+template <typename Tree>
+double find_strings(const std::vector<std::string> &keys)
+{
+    Tree tree;
+    for (const auto &key : keys)
+        tree.insert({key, 1});
+
+    long sum = 0;
+    auto elapsed = time_ns([&] {
+        for (const auto &key : keys)
+            sum += tree.find(key)->second;
+    });
+    if (sum == 42)
+        std::cout << "";
+    return elapsed;
+}
+
+// Look up every key in a "counted_string" keyed tree holding all the keys, starting from the string_view of the
+// key. "make_key" turns the view into the argument of find(). Stores the number of allocations per lookup.
+template <typename Tree, typename MakeKey>
+double find_views(const std::vector<std::string> &keys, MakeKey &&make_key, double &allocations)
+{
+    Tree tree;
+    for (const auto &key : keys)
+        tree.insert({counted_string(key.begin(), key.end()), 1});
+    const std::vector<std::string_view> views(keys.begin(), keys.end());
+
+    long sum = 0;
+    const auto before = allocation_count;
+    auto elapsed = time_ns([&] {
+        for (auto view : views)
+            sum += tree.find(make_key(view))->second;
+    });
+    allocations = static_cast<double>(allocation_count - before) / keys.size();
+    if (sum == 42)
+        std::cout << "";
+    return elapsed;
+}
+
+// Run "threads" threads, each doing "ops" operations on a shared container. Every "write_period"-th operation is a
+// "modify" (which alternates between inserting and erasing a key), and the rest are "lookup"s.
+template <typename Lookup, typename Modify>
+double read_write_mix(int threads, int ops, int write_period, const std::vector<int> &keys, Lookup &&lookup,
+                      Modify &&modify)
+{
+    std::atomic<long> sum{0};
+    auto elapsed = time_ns([&] {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                long thread_sum = 0;
+                for (int i = 0; i < ops; ++i) {
+                    const int key = keys[(static_cast<std::size_t>(t) * ops + i) % keys.size()];
+                    if (i % write_period == 0)
+                        modify(key, i / write_period % 2 == 0);
+                    else
+                        thread_sum += lookup(key);
+                }
+                sum += thread_sum;
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+    });
+    if (sum == 42)
+        std::cout << "";
+    return elapsed;
+}
+
+// Memory allocated by the container per element, measured for "size" elements.
+template <typename Container, typename MakeKey>
+double bytes_per_node(int size, MakeKey &&make_key)
+{
+    Container container;
+    const auto before = allocated_bytes;
+    for (int i = 0; i < size; ++i)
+        container.insert({make_key(i), i});
+    return static_cast<double>(allocated_bytes - before) / size;
+}
+
+// Run the benchmark on each of the containers. The benchmark gets an empty container to work on. The arena has
+// room for the sentinels of the moved-from trees too.
+template <typename Fn>
+void report(const char *name, int ops, Fn &&fn)
+{
+    std::cout << name << ": tree " << fn(avl::avl_tree<int>()) / ops << " ns/op, pool tree "
+              << fn(pool_tree()) / ops << " ns/op, arena tree "
+              << fn(arena_tree(avl::arena_allocator<std::pair<const int, int>>(ops + 2))) / ops << " ns/op, map "
+              << fn(std::map<int, int>()) / ops << " ns/op\n";
+}
+
+// Workloads of the tree variants (the allocators, the options and the other containers of the library), with "size"
+// keys.
+void run_variant_workloads(int size)
+{
+    std::vector<int> ascending(size);
+    std::iota(ascending.begin(), ascending.end(), 0);
+    std::vector<int> random = ascending;
+    std::shuffle(random.begin(), random.end(), std::mt19937(42));
+
+    report("ascending insert + erase(begin())", 2 * size,
+           [&](auto container) { return insert_erase_loop(std::move(container), size); });
+    report("ascending insert", size, [&](auto container) { return insert_keys(std::move(container), ascending); });
+    report("ascending insert (end() hint)", size, [&](auto container) { return append_keys(std::move(container), ascending); });
+    report("random insert", size, [&](auto container) { return insert_keys(std::move(container), random); });
+    report("random find", size, [&](auto container) { return find_keys(std::move(container), random); });
+    report("random range scan (16 elements)", size,
+           [&](auto container) { return range_scan(std::move(container), random, 16); });
+
+    // Percentiles and range counts over the samples, with the order statistics and by walking the map.
+    {
+        order_statistics_tree samples;
+        std::map<int, int> map_samples;
+        for (int key : random) {
+            samples.insert({key, key});
+            map_samples.insert({key, key});
+        }
+        const int queries = std::min(1000, size);
+        long sum = 0;
+        const auto nth_ns = time_ns([&] {
+            for (int i = 0; i < queries; ++i)
+                sum += samples.nth(static_cast<std::size_t>(random[i]))->first;
+        });
+        const auto count_ns = time_ns([&] {
+            for (int i = 0; i < queries; ++i)
+                sum += static_cast<long>(samples.count_range(random[i] / 2, random[i]));
+        });
+        const auto map_count_ns = time_ns([&] {
+            for (int i = 0; i < queries; ++i)
+                sum += std::distance(map_samples.lower_bound(random[i] / 2), map_samples.lower_bound(random[i]));
+        });
+        if (sum == 42)
+            std::cout << "";
+        std::cout << "order statistics: nth " << nth_ns / queries << " ns/op, count_range " << count_ns / queries
+                  << " ns/op (map walk " << map_count_ns / queries << " ns/op), random insert "
+                  << insert_keys(order_statistics_tree(), random) / size << " ns/op\n";
+    }
+
+    // The tail latencies of the random insertions and lookups.
+    {
+        avl::instrumented_avl_tree<int, int> tree;
+        for (int key : random)
+            tree.emplace(std::make_pair(key, key));
+        long sum = 0;
+        for (int key : random)
+            sum += tree.find(key)->second;
+        if (sum == 42)
+            std::cout << "";
+        std::cout << "latencies (random keys, including two clock reads):\n";
+        tree.print_latencies(std::cout);
+    }
+
+    // What the insertions cost in comparisons, rotations and retrace steps, for the random and the ascending keys.
+    {
+        using statistics_tree = avl::avl_tree<int, int, std::less<int>, std::allocator<std::pair<const int, int>>,
+                                              avl::statistics_options>;
+        for (const auto *keys : {&random, &ascending}) {
+            statistics_tree tree;
+            const auto elapsed = time_ns([&] {
+                for (int key : *keys)
+                    tree.insert({key, key});
+            });
+            const auto stats = tree.statistics();
+            const auto depths = tree.depth_histogram();
+            std::size_t depth_sum = 0;
+            for (std::size_t depth = 0; depth < depths.size(); ++depth)
+                depth_sum += depth * depths[depth];
+            std::cout << (keys == &random ? "statistics, random" : "statistics, ascending") << " insert: "
+                      << static_cast<double>(stats.comparisons) / size << " comparisons/op, "
+                      << static_cast<double>(stats.single_rotations) / size << " single + "
+                      << static_cast<double>(stats.double_rotations) / size << " double rotations/op, "
+                      << static_cast<double>(stats.retrace_steps) / size << " retrace steps/op, height "
+                      << tree.height() << ", mean depth " << static_cast<double>(depth_sum) / tree.size() << ", "
+                      << elapsed / size << " ns/op (without statistics " << insert_keys(avl::avl_tree<int>(), *keys) / size
+                      << " ns/op)\n";
+        }
+    }
+
+    // Iteration and range scans with the threaded links, against the walk over the tree.
+    {
+        using threaded_tree = avl::avl_tree<int, int, std::less<int>, std::allocator<std::pair<const int, int>>,
+                                            avl::threaded_options>;
+        auto iterate = [&](auto container) {
+            for (int key : random)
+                container.insert({key, key});
+            long sum = 0;
+            const auto elapsed = time_ns([&] {
+                for (const auto &element : container)
+                    sum += element.second;
+            });
+            if (sum == 42)
+                std::cout << "";
+            return elapsed;
+        };
+        std::cout << "threaded links: iterate " << iterate(threaded_tree()) / size << " ns/elt (tree walk "
+                  << iterate(avl::avl_tree<int, int>()) / size << " ns/elt), range scan (16 elements) "
+                  << range_scan(threaded_tree(), random, 16) / size << " ns/op (tree walk "
+                  << range_scan(avl::avl_tree<int, int>(), random, 16) / size << " ns/op), random insert "
+                  << insert_keys(threaded_tree(), random) / size << " ns/op (tree walk "
+                  << insert_keys(avl::avl_tree<int, int>(), random) / size << " ns/op)\n";
+    }
+
+    // Reloading the tree from a sorted dump, element by element and in bulk.
+    std::vector<std::pair<int, int>> sorted_dump;
+    for (int key : ascending)
+        sorted_dump.emplace_back(key, key);
+    avl::avl_tree<int> loop_built, bulk_built;
+    const auto loop_build_ns = time_ns([&] { loop_built.insert(sorted_dump.begin(), sorted_dump.end()); });
+    const auto bulk_build_ns = time_ns([&] { bulk_built.assign(avl::sorted_unique, sorted_dump.begin(), sorted_dump.end()); });
+    std::cout << "sorted build: insert loop " << loop_build_ns / size << " ns/elt, bulk " << bulk_build_ns / size << " ns/elt\n";
+
+    // Saving the tree to the binary format and loading it back, compared with reinserting its elements.
+    {
+        std::stringstream stream;
+        const auto save_ns = time_ns([&] { loop_built.save(stream); });
+        avl::avl_tree<int> loaded;
+        const auto load_ns = time_ns([&] { loaded.load(stream); });
+        avl::avl_tree<int> reinserted;
+        const auto reinsert_ns = time_ns([&] {
+            for (const auto &element : loop_built)
+                reinserted.insert(element);
+        });
+        std::cout << "save " << save_ns / size << " ns/elt, load " << load_ns / size << " ns/elt (reinsert "
+                  << reinsert_ns / size << " ns/elt)\n";
+    }
+
+    // Building the tree in a memory-mapped file, and reopening it from the file (which only maps it again).
+    {
+        using file_tree = avl::avl_tree<int, int, std::less<int>, avl::file_arena_allocator<std::pair<const int, int>>>;
+        const auto path = (std::filesystem::temp_directory_path() / "avl_tree_benchmark.arena").string();
+        double build_ns = 0;
+        {
+            file_tree tree(avl::file_arena_allocator<std::pair<const int, int>>(std::make_shared<avl::file_arena>(path, size + 1)));
+            build_ns = time_ns([&] { tree.insert(sorted_dump.begin(), sorted_dump.end()); });
+        }
+        std::size_t reopened_size = 0;
+        const auto reopen_ns = time_ns([&] {
+            file_tree tree(avl::file_arena_allocator<std::pair<const int, int>>(std::make_shared<avl::file_arena>(path)));
+            reopened_size = tree.size();
+        });
+        std::remove(path.c_str());
+        std::cout << "file-backed tree of " << reopened_size << " elements: build " << build_ns / size
+                  << " ns/elt, reopen " << reopen_ns / 1000 << " us\n";
+    }
+
+    // Commit latency of the logged modifications, with the different group commit windows. The concurrent
+    // writers share the fsyncs, so their throughput grows with the window at the cost of the latency.
+    {
+        const auto path = (std::filesystem::temp_directory_path() / "avl_tree_benchmark").string();
+        const int commits = 200;
+        for (int window : {0, 100, 1000}) {
+            std::cout << "durable commits, window " << window << " us:";
+            for (int writers : {1, 8}) {
+                std::remove((path + ".log").c_str());
+                std::remove((path + ".checkpoint").c_str());
+                avl::durable_avl_tree<int, int> tree(path, {std::chrono::microseconds(window), 0});
+                const auto elapsed = time_ns([&] {
+                    std::vector<std::thread> workers;
+                    for (int t = 0; t < writers; ++t)
+                        workers.emplace_back([&, t] {
+                            for (int i = 0; i < commits; ++i)
+                                tree.insert_or_assign(random[(static_cast<std::size_t>(t) * commits + i) % random.size()], i);
+                        });
+                    for (auto &worker : workers)
+                        worker.join();
+                });
+                std::cout << " " << writers << " writers " << elapsed / commits / 1000 << " us/commit, "
+                          << writers * commits / (elapsed / 1e9) << " commits/s;";
+            }
+            std::cout << "\n";
+        }
+        std::remove((path + ".log").c_str());
+        std::remove((path + ".checkpoint").c_str());
+    }
+
+    // Moving the upper half of the keys to another tree and back, element by element and with split and join.
+    const auto move_loop_ns = time_ns([&] {
+        avl::avl_tree<int> upper;
+        for (auto it = loop_built.lower_bound(size / 2); it != loop_built.end();) {
+            upper.insert(*it);
+            it = loop_built.erase(it);
+        }
+        for (auto it = upper.begin(); it != upper.end();) {
+            loop_built.insert(*it);
+            it = upper.erase(it);
+        }
+    });
+    const auto split_join_ns = time_ns([&] {
+        auto upper = bulk_built.split(size / 2);
+        bulk_built.join(std::move(upper));
+    });
+    std::cout << "move half of the keys and back: element by element " << move_loop_ns / 1e6 << " ms, split + join "
+              << split_join_ns / 1e6 << " ms\n";
+
+    // Moving the odd keys (scattered over the whole tree) to another tree, by copying the elements and by
+    // relinking their nodes, and merging them back.
+    {
+        avl::avl_tree<int, int> source;
+        for (int key : random)
+            source.insert({key, key});
+        auto move_odd_keys = [&](auto move) {
+            avl::avl_tree<int, int> target;
+            const auto elapsed = time_ns([&] {
+                for (int key : random) {
+                    if (key % 2)
+                        move(target, key);
+                }
+            });
+            return std::make_pair(elapsed, std::move(target));
+        };
+        auto [copy_ns, copied] = move_odd_keys([&](auto &target, int key) {
+            auto it = source.find(key);
+            target.insert(*it);
+            source.erase(it);
+        });
+        source.merge(copied);
+        auto [relink_ns, relinked] = move_odd_keys([&](auto &target, int key) { target.insert(source.extract(key)); });
+        const auto merge_ns = time_ns([&] { source.merge(relinked); });
+        std::cout << "move the odd keys to another tree: erase + insert " << copy_ns / (size / 2)
+                  << " ns/elt, extract + insert " << relink_ns / (size / 2) << " ns/elt; merge back "
+                  << merge_ns / (size / 2) << " ns/elt\n";
+    }
+
+    // Intersecting two trees of the random keys, by looking the keys of one tree up in the other and with the
+    // set algebra, which takes over the nodes of both trees.
+    {
+        avl::avl_tree<int> odd_keys, triple_keys;
+        for (int key : random) {
+            odd_keys.insert({2 * key + 1, key});
+            triple_keys.insert({3 * key, key});
+        }
+        avl::avl_tree<int> lookup_result;
+        const auto lookup_ns = time_ns([&] {
+            for (const auto &element : odd_keys) {
+                if (triple_keys.find(element.first) != triple_keys.end())
+                    lookup_result.emplace_hint(lookup_result.end(), element);
+            }
+        });
+        const auto intersection_ns = time_ns([&] {
+            auto result = set_intersection(std::move(odd_keys), std::move(triple_keys));
+            if (result.size() != lookup_result.size())
+                std::cout << "intersection mismatch\n";
+        });
+        std::cout << "intersection: lookup loop " << lookup_ns / 1e6 << " ms, set_intersection " << intersection_ns / 1e6
+                  << " ms (" << std::thread::hardware_concurrency() << " hardware threads)\n";
+    }
+
+    // Mostly lookups from multiple threads, on a tree guarded by a plain mutex and by the reader-writer lock.
+    {
+        const int threads = std::max(4, static_cast<int>(std::thread::hardware_concurrency()));
+        const int ops = size / threads;
+        avl::avl_tree<int> locked_tree(avl::sorted_unique, sorted_dump.begin(), sorted_dump.end());
+        std::mutex tree_mutex;
+        const auto mutex_ns = read_write_mix(
+            threads, ops, 20, random,
+            [&](int key) {
+                std::lock_guard lock(tree_mutex);
+                return locked_tree.find(key) != locked_tree.end() ? 1 : 0;
+            },
+            [&](int key, bool insert) {
+                std::lock_guard lock(tree_mutex);
+                if (insert)
+                    locked_tree.insert({size + key, key});
+                else if (auto it = locked_tree.find(size + key); it != locked_tree.end())
+                    locked_tree.erase(it);
+            });
+
+        avl::concurrent_avl_tree<int> shared_tree(avl::avl_tree<int>(avl::sorted_unique, sorted_dump.begin(), sorted_dump.end()));
+        const auto shared_ns = read_write_mix(
+            threads, ops, 20, random, [&](int key) { return shared_tree.contains(key) ? 1 : 0; },
+            [&](int key, bool insert) {
+                if (insert)
+                    shared_tree.insert({size + key, key});
+                else
+                    shared_tree.erase(size + key);
+            });
+        std::cout << "95% lookups on " << threads << " threads: mutex " << mutex_ns / size << " ns/op, shared_mutex "
+                  << shared_ns / size << " ns/op\n";
+    }
+
+    // Scaling of the reader-writer lock and of the optimistic concurrency control with the number of threads, for
+    // 90% and 50% lookups. The total number of operations stays the same, so the time per operation should drop
+    // with more threads, as long as there are the cores to run them.
+    {
+        const int max_threads = std::max(4, static_cast<int>(std::thread::hardware_concurrency()));
+        const int ops = size / 2;
+        avl::concurrent_avl_tree<int> shared_tree(avl::avl_tree<int>(avl::sorted_unique, sorted_dump.begin(), sorted_dump.end()));
+        avl::optimistic_avl_tree<int, int> optimistic_tree;
+        for (int key : random)
+            optimistic_tree.insert(key, key);
+        for (int write_period : {10, 2}) {
+            std::cout << 100 - 100 / write_period << "% lookups:";
+            for (int threads = 1; threads <= max_threads; threads *= 2) {
+                const auto shared_ns = read_write_mix(
+                    threads, ops / threads, write_period, random, [&](int key) { return shared_tree.contains(key) ? 1 : 0; },
+                    [&](int key, bool insert) {
+                        if (insert)
+                            shared_tree.insert({size + key, key});
+                        else
+                            shared_tree.erase(size + key);
+                    });
+                const auto optimistic_ns = read_write_mix(
+                    threads, ops / threads, write_period, random,
+                    [&](int key) { return optimistic_tree.contains(key) ? 1 : 0; },
+                    [&](int key, bool insert) {
+                        if (insert)
+                            optimistic_tree.insert(size + key, key);
+                        else
+                            optimistic_tree.erase(size + key);
+                    });
+                std::cout << " " << threads << " threads: shared_mutex " << shared_ns / ops << " ns/op, optimistic "
+                          << optimistic_ns / ops << " ns/op;";
+            }
+            std::cout << "\n";
+        }
+    }
+
+    // Memory held by the optimistic tree for the nodes unlinked by the erasures, with 50% lookups. Every other
+    // modification erases the key inserted by the previous one, so its node is unlinked and waits for the
+    // epoch-based reclamation. The largest number of such nodes seen by the threads is reported.
+    {
+        const int threads = std::max(4, static_cast<int>(std::thread::hardware_concurrency()));
+        const int ops = size / 2 / threads;
+        avl::optimistic_avl_tree<int, int> optimistic_tree;
+        for (int key : random)
+            optimistic_tree.insert(key, key);
+        std::atomic<std::size_t> erased{0};
+        std::atomic<std::size_t> peak_unreclaimed{0};
+        const auto elapsed = time_ns([&] {
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    long sum = 0;
+                    std::size_t thread_erased = 0;
+                    int inserted = 0;
+                    for (int i = 0; i < ops; ++i) {
+                        const int key = random[(static_cast<std::size_t>(t) * ops + i) % random.size()];
+                        if (i % 2 == 1)
+                            sum += optimistic_tree.contains(key) ? 1 : 0;
+                        else if (i % 4 == 0)
+                            optimistic_tree.insert(size + (inserted = key), key);
+                        else
+                            thread_erased += optimistic_tree.erase(size + inserted) ? 1 : 0;
+                        if (i % 1024 == 0) {
+                            const auto unreclaimed = optimistic_tree.unreclaimed();
+                            auto peak = peak_unreclaimed.load();
+                            while (unreclaimed > peak && !peak_unreclaimed.compare_exchange_weak(peak, unreclaimed)) {
+                            }
+                        }
+                    }
+                    erased += thread_erased;
+                    if (sum == 42)
+                        std::cout << "";
+                });
+            }
+            for (auto &worker : workers)
+                worker.join();
+        });
+        std::cout << "optimistic tree, 50% lookups with erasures on " << threads << " threads: "
+                  << elapsed / (static_cast<double>(ops) * threads) << " ns/op, " << erased << " nodes erased, at most "
+                  << peak_unreclaimed << " (" << peak_unreclaimed * decltype(optimistic_tree)::node_bytes() / 1024
+                  << " KiB) waiting to be freed\n";
+    }
+
+    // Point-in-time copies of the tree for the readers, by copying the whole tree and with the persistent tree,
+    // which shares its nodes with the snapshots and copies only the paths it modifies.
+    {
+        avl::persistent_avl_tree<int> persistent;
+        const auto persistent_insert_ns = time_ns([&] {
+            for (int key : random)
+                persistent.insert({key, key});
+        });
+        constexpr int snapshots = 1000;
+        std::size_t sum = 0;
+        const auto copy_ns = time_ns([&] {
+            avl::avl_tree<int> copy(bulk_built);
+            sum += copy.size();
+        });
+        const auto snapshot_ns = time_ns([&] {
+            for (int i = 0; i < snapshots; ++i)
+                sum += persistent.snapshot().size();
+        });
+        if (sum == 42)
+            std::cout << "";
+        std::cout << "snapshot: tree copy " << copy_ns / 1e6 << " ms, persistent snapshot " << snapshot_ns / snapshots
+                  << " ns (persistent random insert " << persistent_insert_ns / size << " ns/op)\n";
+    }
+
+    // Inserting and looking up the random keys in batches, on a single tree and on the tree sharded by key ranges,
+    // whose shards run the batches in parallel.
+    {
+        const int shards = std::max(4, static_cast<int>(std::thread::hardware_concurrency()));
+        std::vector<int> boundaries;
+        for (int i = 1; i < shards; ++i)
+            boundaries.push_back(size / shards * i);
+        constexpr int batch_size = 10'000;
+        std::vector<std::pair<int, int>> pairs;
+        for (int key : random)
+            pairs.emplace_back(key, key);
+
+        avl::avl_tree<int> single;
+        const auto single_insert_ns = time_ns([&] {
+            for (const auto &pair : pairs)
+                single.insert(pair);
+        });
+        avl::sharded_avl_tree<int> sharded(boundaries);
+        const auto sharded_insert_ns = time_ns([&] {
+            for (int i = 0; i < size; i += batch_size)
+                sharded.insert(pairs.begin() + i, pairs.begin() + std::min(i + batch_size, size));
+        });
+        long sum = 0;
+        const auto single_find_ns = time_ns([&] {
+            for (int key : random)
+                sum += single.find(key)->second;
+        });
+        const auto sharded_find_ns = time_ns([&] {
+            std::vector<int> batch;
+            for (int i = 0; i < size; i += batch_size) {
+                batch.assign(random.begin() + i, random.begin() + std::min(i + batch_size, size));
+                for (const auto &value : sharded.find(batch))
+                    sum += *value;
+            }
+        });
+        if (sum == 42)
+            std::cout << "";
+        std::cout << "batches of " << batch_size << " on " << shards << " shards: insert " << sharded_insert_ns / size
+                  << " ns/op (single tree " << single_insert_ns / size << "), find " << sharded_find_ns / size
+                  << " ns/op (single tree " << single_find_ns / size << ")\n";
+    }
+
+    // String keys sharing a long prefix, so that each comparison is a noticeable cost.
+    std::vector<std::string> strings;
+    strings.reserve(size);
+    for (int key : random)
+        strings.push_back("shared/prefix/of/the/key/" + std::to_string(key));
+    std::cout << "random string find: less "
+              << find_strings<avl::avl_tree<std::string, int>>(strings) / size << " ns/op, three-way "
+              << find_strings<avl::avl_tree<std::string, int, avl::three_way_compare<std::string>>>(strings) / size
+              << " ns/op\n";
+
+    // Looking the string keys up by string_view, with a temporary std::string key and with a transparent comparator.
+    double temporary_allocations = 0, transparent_allocations = 0;
+    const auto temporary_ns = find_views<avl::avl_tree<counted_string, int>>(
+        strings, [](std::string_view view) { return counted_string(view); }, temporary_allocations);
+    const auto transparent_ns = find_views<avl::avl_tree<counted_string, int, std::less<>>>(
+        strings, [](std::string_view view) { return view; }, transparent_allocations);
+    std::cout << "string_view find: temporary key " << temporary_ns / size << " ns/op, " << temporary_allocations
+              << " allocations/op, transparent " << transparent_ns / size << " ns/op, " << transparent_allocations
+              << " allocations/op\n";
+
+    // Keys in the string trees are short enough to fit into the string object, so only the nodes are counted.
+    auto int_key = [](int i) { return i; };
+    auto string_key = [](int i) { return std::to_string(i); };
+    std::cout << "memory: int keys "
+              << bytes_per_node<avl::avl_tree<int, int, std::less<int>, counting_allocator<std::pair<const int, int>>>>(size, int_key)
+              << " bytes/node (map " << bytes_per_node<std::map<int, int, std::less<int>, counting_allocator<std::pair<const int, int>>>>(size, int_key)
+              << "), string keys "
+              << bytes_per_node<avl::avl_tree<std::string, int, std::less<std::string>,
+                                              counting_allocator<std::pair<const std::string, int>>>>(size, string_key)
+              << " bytes/node (map "
+              << bytes_per_node<std::map<std::string, int, std::less<std::string>,
+                                         counting_allocator<std::pair<const std::string, int>>>>(size, string_key)
+              << ")\n";
+
+    // The arena holds nothing but the nodes (and the sentinel root).
+    arena_tree arena_int_tree(avl::arena_allocator<std::pair<const int, int>>(size + 1));
+    avl::avl_tree<std::string, int, std::less<std::string>, avl::arena_allocator<std::pair<const std::string, int>>>
+        arena_string_tree(avl::arena_allocator<std::pair<const std::string, int>>(size + 1));
+    for (int i = 0; i < size; ++i) {
+        arena_int_tree.insert({i, i});
+        arena_string_tree.insert({std::to_string(i), i});
+    }
+    std::cout << "memory (arena): int keys " << static_cast<double>(arena_int_tree.get_allocator().arena()->size_bytes()) / (size + 1)
+              << " bytes/node, string keys "
+              << static_cast<double>(arena_string_tree.get_allocator().arena()->size_bytes()) / (size + 1) << " bytes/node\n";
+}
+
+int main(int argc, char *argv[])
+{
+    const std::size_t size = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200'000;
+    if (size == 0) {
+        std::cerr << "Usage: " << argv[0] << " [number of keys]\n";
+        return 1;
+    }
+    latency_recorder::calibrate();
+    std::cout << size << " keys, clock overhead " << latency_recorder::clock_overhead
+              << " ns (subtracted from the latencies)\n";
+    std::cout << std::left << std::setw(56) << "workload" << std::right << std::setw(10) << "ns/op" << std::setw(9)
+              << "p50" << std::setw(9) << "p99" << std::setw(10) << "p99.9" << std::setw(11) << "allocs/op\n";
+
+    run_key_type<int>("int", size, [](std::size_t index) { return static_cast<int>(index); });
+    // Long enough not to fit into the string object, so every key copy allocates.
+    run_key_type<std::string>("string", size, [](std::size_t index) {
+        char key[32];
+        std::snprintf(key, sizeof(key), "key:%020zu", index);
+        return std::string(key);
+    });
+
+    std::cout << "\n";
+    run_variant_workloads(static_cast<int>(size));
+
+    if (sink == 42)
+        std::cout << "";
+    return 0;
+}
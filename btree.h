@@ -0,0 +1,929 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "avl_tree.h"
+
+namespace avl {
+
+// Ordered map with the interface of the "avl_tree", stored as a B+ tree with up to "NodeSize" elements in every node.
+// A lookup visits about log_B(n) nodes instead of log_2(n), and the keys it compares in a node sit in a few adjacent
+// cache lines, which is what counts once the tree no longer fits into the cache. The inner nodes hold nothing but
+// the separator keys and the child links; the elements live in the leaves, which are linked in the key order, so
+// the iteration and the range scans walk the leaves like a list of arrays.
+//
+// Unlike the nodes of the "avl_tree", the elements move between the nodes as the tree changes, so every insertion
+// and erasure invalidates all the iterators (except the one it returns). The separators are copies of the keys, so
+// the keys must be copy constructible, and both the keys and the values must be nothrow move constructible.
+template <typename Key, typename T = Key, typename Cmp = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, T>>, std::size_t NodeSize = 32>
+class btree final {
+public:
+    using size_type = std::size_t;
+    using key_type = Key;
+    using val_type = T;
+    using node_val_type = std::pair<const key_type, val_type>;
+    using cmp_type = Cmp;
+    using allocator_type = Alloc;
+
+    // Maximum number of the elements in a leaf, and of the separator keys in an inner node.
+    static constexpr size_type node_size = NodeSize;
+
+private:
+    static_assert(NodeSize >= 4 && NodeSize < std::numeric_limits<std::uint16_t>::max(), "Unsupported node size.");
+    static_assert(std::is_nothrow_move_constructible_v<key_type> && std::is_nothrow_move_constructible_v<val_type>,
+                  "The elements of the B+ tree must be nothrow move constructible.");
+
+    static constexpr bool three_way = detail::is_three_way<cmp_type>::value;
+
+    // A node which falls below these sizes after an erasure borrows an element from a neighbour, or is merged with
+    // it. The nodes split when the insertions start a new first or last leaf keep just the new element (or key)
+    // on the new side, so the nodes on the edges of the tree can be smaller.
+    static constexpr std::uint16_t min_leaf_size = NodeSize / 2;
+    static constexpr std::uint16_t min_inner_size = (NodeSize - 1) / 2;
+
+    // Deepest tree the search paths have room for. Even with the smallest nodes, every inner node but the edge
+    // ones has at least two children, so it is deeper than any tree which fits into memory.
+    static constexpr int max_height = 64;
+
+    // Links of a leaf to its neighbours in the key order. The leaves form a ring through the "_leaves" sentinel of
+    // the tree, which has no elements, and stands for the end() iterator.
+    struct leaf_links {
+        leaf_links *_prev{this};
+        leaf_links *_next{this};
+        std::uint16_t _size{0};
+    };
+
+    // The leaves and the inner nodes have room for one element (key) over the limit, which they hold for a moment
+    // while they are split. The storage is left uninitialized - only the first "_size" slots hold objects.
+    struct leaf_node final : leaf_links {
+        leaf_node() noexcept {}
+
+        node_val_type *values() noexcept { return std::launder(reinterpret_cast<node_val_type *>(_storage)); }
+
+        alignas(node_val_type) unsigned char _storage[(NodeSize + 1) * sizeof(node_val_type)];
+    };
+
+    // Inner node with "_size" separator keys and one more child. The keys in the subtree of the child "i" are not
+    // less than the key "i - 1", and less than the key "i". The children are leaves on the lowest inner level.
+    struct inner_node final {
+        inner_node() noexcept {}
+
+        key_type *keys() noexcept { return std::launder(reinterpret_cast<key_type *>(_key_storage)); }
+
+        std::uint16_t _size{0};
+        alignas(key_type) unsigned char _key_storage[(NodeSize + 1) * sizeof(key_type)];
+        void *_children[NodeSize + 2];
+    };
+
+    // Inner node on the search path, and the index of the child the path goes through.
+    struct path_entry {
+        inner_node *node;
+        std::uint16_t index;
+    };
+    using search_path = std::array<path_entry, max_height>;
+
+    // Which way to split a full node. The insertions past the last element of the tree (or before its first one)
+    // leave the old node full, which packs the ascending (or descending) keys into full nodes.
+    enum class split_bias { none, append, prepend };
+
+    using leaf_allocator_type = typename std::allocator_traits<allocator_type>::template rebind_alloc<leaf_node>;
+    using leaf_alloc_traits = std::allocator_traits<leaf_allocator_type>;
+    using inner_allocator_type = typename std::allocator_traits<allocator_type>::template rebind_alloc<inner_node>;
+    using inner_alloc_traits = std::allocator_traits<inner_allocator_type>;
+
+public:
+    // Bidirectional iterator to the elements of the B+ tree: a leaf and the position of the element in it. The end()
+    // iterator points to the sentinel of the leaf ring.
+    template <typename ItT>
+    class Iterator final {
+        friend class btree;
+        template <typename>
+        friend class Iterator;
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::remove_cv_t<ItT>;
+        using pointer = ItT *;
+        using reference = ItT &;
+
+        Iterator() = default;
+        // A non-const iterator converts to the const one.
+        template <typename OtherT, typename = std::enable_if_t<std::is_same_v<const OtherT, ItT> && !std::is_const_v<OtherT>>>
+        Iterator(const Iterator<OtherT> &other) : _leaf(other._leaf), _index(other._index) {}
+
+        reference operator*() const { return static_cast<leaf_node *>(_leaf)->values()[_index]; }
+        pointer operator->() const { return &**this; }
+
+        Iterator &operator++() {
+            if (++_index == _leaf->_size) {
+                _leaf = _leaf->_next;
+                _index = 0;
+            }
+            return *this;
+        }
+        Iterator operator++(int) {
+            Iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        Iterator &operator--() {
+            if (_index == 0) {
+                _leaf = _leaf->_prev;
+                _index = _leaf->_size;
+            }
+            --_index;
+            return *this;
+        }
+        Iterator operator--(int) {
+            Iterator tmp = *this;
+            --*this;
+            return tmp;
+        }
+
+        friend bool operator==(const Iterator &lhs, const Iterator &rhs) noexcept {
+            return lhs._leaf == rhs._leaf && lhs._index == rhs._index;
+        }
+        friend bool operator!=(const Iterator &lhs, const Iterator &rhs) noexcept { return !(lhs == rhs); }
+
+    private:
+        Iterator(leaf_links *leaf, std::uint16_t index) : _leaf(leaf), _index(index) {}
+
+        leaf_links *_leaf{nullptr};
+        std::uint16_t _index{0};
+    };
+
+    // Export both const and non-cost iterator types to the user.
+    using iterator = Iterator<node_val_type>;
+    using const_iterator = Iterator<const node_val_type>;
+
+private:
+    leaf_allocator_type _leaf_allocator{};
+    inner_allocator_type _inner_allocator{};
+    leaf_links _leaves{};
+    // The root is a leaf if the height of the tree is one, and there is no root in the empty tree.
+    void *_root{nullptr};
+    int _height{0};
+    size_type _size{0};
+    cmp_type _comparator{};
+
+    // Enables the overloads of the lookup functions for the key type "K", if the comparator is transparent.
+    template <class K>
+    using transparent_key = std::enable_if_t<detail::is_transparent<cmp_type>::value, K>;
+
+    // Is the "lhs" key less than the "rhs" key.
+    template <class L, class R>
+    bool key_less(const L &lhs, const R &rhs) const {
+        if constexpr (three_way)
+            return _comparator(lhs, rhs) < 0;
+        else
+            return _comparator(lhs, rhs);
+    }
+
+    leaf_node *create_leaf() {
+        auto *leaf = leaf_alloc_traits::allocate(_leaf_allocator, 1);
+        leaf_alloc_traits::construct(_leaf_allocator, leaf);
+        return leaf;
+    }
+    inner_node *create_inner() {
+        auto *node = inner_alloc_traits::allocate(_inner_allocator, 1);
+        inner_alloc_traits::construct(_inner_allocator, node);
+        return node;
+    }
+
+    // Destroy the elements (keys) the node holds, and give its memory back to the allocator.
+    void destroy_leaf(leaf_node *leaf) noexcept {
+        std::destroy_n(leaf->values(), leaf->_size);
+        leaf_alloc_traits::destroy(_leaf_allocator, leaf);
+        leaf_alloc_traits::deallocate(_leaf_allocator, leaf, 1);
+    }
+    void destroy_inner(inner_node *node) noexcept {
+        std::destroy_n(node->keys(), node->_size);
+        inner_alloc_traits::destroy(_inner_allocator, node);
+        inner_alloc_traits::deallocate(_inner_allocator, node, 1);
+    }
+
+    // Destroy all the nodes in the subtree rooted at "node" on the given level (zero for the root).
+    void destroy_subtree(void *node, int level) noexcept {
+        if (level == _height - 1) {
+            destroy_leaf(static_cast<leaf_node *>(node));
+            return;
+        }
+        auto *inner = static_cast<inner_node *>(node);
+        for (std::uint16_t i = 0; i <= inner->_size; ++i)
+            destroy_subtree(inner->_children[i], level + 1);
+        destroy_inner(inner);
+    }
+
+    // Take over the nodes of the "other" tree, which is left empty.
+    void take_over(btree &other) noexcept {
+        _root = std::exchange(other._root, nullptr);
+        _height = std::exchange(other._height, 0);
+        _size = std::exchange(other._size, 0);
+        if (_root) {
+            _leaves._prev = other._leaves._prev;
+            _leaves._next = other._leaves._next;
+            _leaves._prev->_next = &_leaves;
+            _leaves._next->_prev = &_leaves;
+            other._leaves._prev = other._leaves._next = &other._leaves;
+        }
+    }
+
+    // Append the copies of the elements of the "other" tree to this (empty) tree, in order, which packs them into
+    // full leaves. With "Move", the elements of the other tree are moved from (only the keys, which are const, are
+    // copied). Nothing is left in this tree if the copying throws.
+    template <bool Move = false>
+    void append_copy(std::conditional_t<Move, btree, const btree> &other) {
+        try {
+            for (auto &element : other) {
+                if constexpr (Move)
+                    emplace_hint(cend(), std::move(element));
+                else
+                    emplace_hint(cend(), element);
+            }
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    // Insert the leaf into the ring right after the "prev" leaf (or the sentinel).
+    static void link_leaf(leaf_links *leaf, leaf_links *prev) noexcept {
+        leaf->_prev = prev;
+        leaf->_next = prev->_next;
+        prev->_next->_prev = leaf;
+        prev->_next = leaf;
+    }
+    static void unlink_leaf(leaf_links *leaf) noexcept {
+        leaf->_prev->_next = leaf->_next;
+        leaf->_next->_prev = leaf->_prev;
+    }
+
+    // Move the element (key) to the uninitialized slot "to", and destroy the original. The key of the element is
+    // moved from even though it is const, as the element is about to be destroyed.
+    static void relocate(node_val_type *from, node_val_type *to) noexcept {
+        ::new (static_cast<void *>(to)) node_val_type(std::move(const_cast<key_type &>(from->first)), std::move(from->second));
+        from->~node_val_type();
+    }
+    static void relocate(key_type *from, key_type *to) noexcept {
+        ::new (static_cast<void *>(to)) key_type(std::move(*from));
+        from->~key_type();
+    }
+    // Same, for the "count" consecutive elements (keys). The ranges can overlap.
+    template <class ObjT>
+    static void relocate(ObjT *from, std::size_t count, ObjT *to) noexcept {
+        if (std::less<ObjT *>()(to, from)) {
+            for (std::size_t i = 0; i < count; ++i)
+                relocate(from + i, to + i);
+        } else {
+            for (std::size_t i = count; i-- > 0;)
+                relocate(from + i, to + i);
+        }
+    }
+    static void move_children(void **from, std::size_t count, void **to) noexcept {
+        std::memmove(to, from, count * sizeof(void *));
+    }
+
+    // Index of the first key in the node greater than the given key, i.e. the child whose subtree the key belongs to.
+    template <class K>
+    std::uint16_t child_position(inner_node *node, const K &key) const {
+        const auto *keys = node->keys();
+        std::uint16_t first = 0;
+        for (std::uint16_t count = node->_size; count > 0;) {
+            const std::uint16_t half = count / 2;
+            if (!key_less(key, keys[first + half])) {
+                first += half + 1;
+                count -= half + 1;
+            } else
+                count = half;
+        }
+        return first;
+    }
+
+    // Index of the first element in the leaf with the key not less than (or, with "Upper", greater than) the given key.
+    template <bool Upper, class K>
+    std::uint16_t value_position(leaf_node *leaf, const K &key) const {
+        const auto *values = leaf->values();
+        std::uint16_t first = 0;
+        for (std::uint16_t count = leaf->_size; count > 0;) {
+            const std::uint16_t half = count / 2;
+            if (Upper ? !key_less(key, values[first + half].first) : key_less(values[first + half].first, key)) {
+                first += half + 1;
+                count -= half + 1;
+            } else
+                count = half;
+        }
+        return first;
+    }
+
+    // Walk down from the root to the leaf where the key belongs, and record the inner nodes on the way in the
+    // "path" (if given). The tree must not be empty.
+    template <class K>
+    leaf_node *descend(const K &key, path_entry *path) const {
+        void *node = _root;
+        for (int level = 0; level < _height - 1; ++level) {
+            auto *inner = static_cast<inner_node *>(node);
+            const auto index = child_position(inner, key);
+            if (path)
+                path[level] = {inner, index};
+            node = inner->_children[index];
+        }
+        return static_cast<leaf_node *>(node);
+    }
+
+    // The iterator to the element at the given position of the leaf. The position past the last element of the leaf
+    // is the first element of the next leaf.
+    template <class ItT>
+    ItT make_iterator(leaf_links *leaf, std::uint16_t index) const noexcept {
+        if (index == leaf->_size)
+            return ItT(leaf->_next, 0);
+        return ItT(leaf, index);
+    }
+
+    // Find the element with the smallest key not less than (or, with "Upper", greater than) the given key.
+    template <bool Upper, class ItT, class K>
+    ItT bound_internal(const K &key) const {
+        if (!_root)
+            return ItT(const_cast<leaf_links *>(&_leaves), 0);
+        auto *leaf = descend(key, nullptr);
+        return make_iterator<ItT>(leaf, value_position<Upper>(leaf, key));
+    }
+
+    template <class ItT, class K>
+    ItT find_internal(const K &key) const {
+        if (_root) {
+            auto *leaf = descend(key, nullptr);
+            const auto index = value_position<false>(leaf, key);
+            if (index < leaf->_size && !key_less(key, leaf->values()[index].first))
+                return ItT(leaf, index);
+        }
+        return ItT(const_cast<leaf_links *>(&_leaves), 0);
+    }
+
+    // Insert the element at the given position of the leaf, which has room for it. The element is moved from.
+    static void insert_value(leaf_node *leaf, std::uint16_t index, node_val_type &value) noexcept {
+        auto *values = leaf->values();
+        relocate(values + index, leaf->_size - index, values + index + 1);
+        ::new (static_cast<void *>(values + index))
+            node_val_type(std::move(const_cast<key_type &>(value.first)), std::move(value.second));
+        ++leaf->_size;
+    }
+    static void remove_value(leaf_node *leaf, std::uint16_t index) noexcept {
+        auto *values = leaf->values();
+        values[index].~node_val_type();
+        relocate(values + index + 1, leaf->_size - index - 1, values + index);
+        --leaf->_size;
+    }
+
+    // Insert the separator key at the given position of the inner node, with the "child" right after it.
+    static void insert_separator(inner_node *node, std::uint16_t index, key_type &&key, void *child) noexcept {
+        auto *keys = node->keys();
+        relocate(keys + index, node->_size - index, keys + index + 1);
+        ::new (static_cast<void *>(keys + index)) key_type(std::move(key));
+        move_children(node->_children + index + 1, node->_size - index, node->_children + index + 2);
+        node->_children[index + 1] = child;
+        ++node->_size;
+    }
+    // Remove the separator key at the given position, whose slot is already vacated, and the child right after it.
+    static void remove_separator(inner_node *node, std::uint16_t index) noexcept {
+        auto *keys = node->keys();
+        relocate(keys + index + 1, node->_size - index - 1, keys + index);
+        move_children(node->_children + index + 2, node->_size - index - 1, node->_children + index + 1);
+        --node->_size;
+    }
+    static void replace_separator(key_type *slot, key_type &key) noexcept {
+        slot->~key_type();
+        ::new (static_cast<void *>(slot)) key_type(std::move(key));
+    }
+
+    // Insert the element at the position "index" of the leaf found along the "path" (or start the empty tree, if
+    // there is no leaf). A full leaf is split in two, and its new neighbour is inserted into the parent, which can
+    // split in turn, up to the root. The new nodes are allocated, and the separator key copied, before anything is
+    // moved, so an exception leaves the tree intact. Returns the position of the new element.
+    iterator insert_at(const path_entry *path, leaf_node *leaf, std::uint16_t index, node_val_type &value) {
+        if (!leaf) {
+            leaf = create_leaf();
+            link_leaf(leaf, &_leaves);
+            _root = leaf;
+            _height = 1;
+        }
+        if (leaf->_size < NodeSize) {
+            insert_value(leaf, index, value);
+            ++_size;
+            return iterator(leaf, index);
+        }
+
+        const auto bias = index == NodeSize && leaf->_next == &_leaves ? split_bias::append
+                          : index == 0 && leaf->_prev == &_leaves    ? split_bias::prepend
+                                                                     : split_bias::none;
+        // Number of the elements (out of the NodeSize + 1, with the new one) which stay in the old leaf, and the
+        // first key of the new one.
+        const std::uint16_t stay = bias == split_bias::append    ? NodeSize
+                                   : bias == split_bias::prepend ? 1
+                                                                 : (NodeSize + 1) / 2;
+        auto *values = leaf->values();
+        const key_type &first_moved = stay < index ? values[stay].first : (stay == index ? value.first : values[stay - 1].first);
+
+        // The full inner nodes right above the leaf split too, and so does the root, if they are all full.
+        int full_levels = 0;
+        while (full_levels < _height - 1 && path[_height - 2 - full_levels].node->_size == NodeSize)
+            ++full_levels;
+        const int new_inners = full_levels + (full_levels == _height - 1 ? 1 : 0);
+
+        leaf_node *right = create_leaf();
+        std::array<inner_node *, max_height> inners;
+        int allocated = 0;
+        std::optional<key_type> separator;
+        try {
+            for (; allocated < new_inners; ++allocated)
+                inners[allocated] = create_inner();
+            separator.emplace(first_moved);
+        } catch (...) {
+            while (allocated > 0)
+                destroy_inner(inners[--allocated]);
+            destroy_leaf(right);
+            throw;
+        }
+
+        insert_value(leaf, index, value);
+        relocate(values + stay, NodeSize + 1 - stay, right->values());
+        right->_size = static_cast<std::uint16_t>(NodeSize + 1 - stay);
+        leaf->_size = stay;
+        link_leaf(right, leaf);
+        ++_size;
+        const auto position = index < stay ? iterator(leaf, index) : iterator(right, index - stay);
+
+        // Carry the separator and the new node up, as long as the nodes overflow. The separator moved up from a split
+        // node is left in the slot right after its last key, until it is inserted into the parent.
+        key_type *carry = &*separator;
+        void *child = right;
+        int next_inner = 0;
+        for (int level = _height - 2; level >= 0; --level) {
+            auto *node = path[level].node;
+            insert_separator(node, path[level].index, std::move(*carry), child);
+            if (carry != &*separator)
+                carry->~key_type();
+            if (node->_size <= NodeSize)
+                return position;
+
+            // Split at the key which moves up. The biased splits leave a single key on the new side, so that every
+            // inner node has at least two children.
+            const std::uint16_t up = bias == split_bias::append    ? NodeSize - 1
+                                     : bias == split_bias::prepend ? 1
+                                                                   : NodeSize / 2;
+            auto *sibling = inners[next_inner++];
+            relocate(node->keys() + up + 1, NodeSize - up, sibling->keys());
+            move_children(node->_children + up + 1, NodeSize + 1 - up, sibling->_children);
+            sibling->_size = static_cast<std::uint16_t>(NodeSize - up);
+            node->_size = up;
+            carry = node->keys() + up;
+            child = sibling;
+        }
+
+        auto *root = inners[next_inner];
+        ::new (static_cast<void *>(root->keys())) key_type(std::move(*carry));
+        if (carry != &*separator)
+            carry->~key_type();
+        root->_children[0] = _root;
+        root->_children[1] = child;
+        root->_size = 1;
+        _root = root;
+        ++_height;
+        return position;
+    }
+
+    // Insert the element, unless its key already exists.
+    std::pair<iterator, bool> insert_unique(node_val_type &value) {
+        if (!_root)
+            return std::make_pair(insert_at(nullptr, nullptr, 0, value), true);
+
+        search_path path;
+        auto *leaf = descend(value.first, path.data());
+        const auto index = value_position<false>(leaf, value.first);
+        if (index < leaf->_size && !key_less(value.first, leaf->values()[index].first))
+            return std::make_pair(iterator(leaf, index), false);
+        return std::make_pair(insert_at(path.data(), leaf, index, value), true);
+    }
+
+    // Erase the element at the position "index" of the leaf found along the "path". A leaf left too small borrows
+    // an element from a neighbour, or is merged with it, and the merges can make the inner nodes above too small
+    // (see "rebalance_inner"). The borrowing copies the new separator key before anything is moved, so an exception
+    // leaves the tree intact. Returns the position of the element that followed the erased one.
+    iterator erase_at(path_entry *path, leaf_node *leaf, std::uint16_t index) {
+        if (_height == 1 || leaf->_size > min_leaf_size) {
+            remove_value(leaf, index);
+            --_size;
+            if (leaf->_size == 0) {
+                unlink_leaf(leaf);
+                destroy_leaf(leaf);
+                _root = nullptr;
+                _height = 0;
+                return end();
+            }
+            return make_iterator<iterator>(leaf, index);
+        }
+
+        const auto [parent, i] = path[_height - 2];
+        auto *left = i > 0 ? static_cast<leaf_node *>(parent->_children[i - 1]) : nullptr;
+        auto *right = i < parent->_size ? static_cast<leaf_node *>(parent->_children[i + 1]) : nullptr;
+        auto *values = leaf->values();
+        if (left && left->_size > min_leaf_size) {
+            key_type separator(left->values()[left->_size - 1].first);
+            remove_value(leaf, index);
+            --_size;
+            relocate(values, leaf->_size, values + 1);
+            relocate(left->values() + --left->_size, values);
+            ++leaf->_size;
+            replace_separator(parent->keys() + i - 1, separator);
+            return make_iterator<iterator>(leaf, index + 1);
+        }
+        if (right && right->_size > min_leaf_size) {
+            key_type separator(right->values()[1].first);
+            remove_value(leaf, index);
+            --_size;
+            relocate(right->values(), values + leaf->_size++);
+            relocate(right->values() + 1, --right->_size, right->values());
+            replace_separator(parent->keys() + i, separator);
+            return iterator(leaf, index);
+        }
+
+        remove_value(leaf, index);
+        --_size;
+        leaf_node *position_leaf = leaf;
+        auto position_index = index;
+        if (left) {
+            position_leaf = left;
+            position_index = static_cast<std::uint16_t>(left->_size + index);
+            merge_leaves(left, leaf, parent, i - 1);
+        } else
+            merge_leaves(leaf, right, parent, i);
+        rebalance_inner(path, _height - 2);
+        return make_iterator<iterator>(position_leaf, position_index);
+    }
+
+    // Move the elements of the "right" leaf to the end of its "left" neighbour, and remove the right leaf and the
+    // separator "index" between them from the parent.
+    void merge_leaves(leaf_node *left, leaf_node *right, inner_node *parent, std::uint16_t index) noexcept {
+        relocate(right->values(), right->_size, left->values() + left->_size);
+        left->_size = static_cast<std::uint16_t>(left->_size + right->_size);
+        right->_size = 0;
+        unlink_leaf(right);
+        destroy_leaf(right);
+        parent->keys()[index].~key_type();
+        remove_separator(parent, index);
+    }
+
+    // Same, for the inner nodes. The separator moves down between the keys of the two nodes.
+    void merge_inners(inner_node *left, inner_node *right, inner_node *parent, std::uint16_t index) noexcept {
+        relocate(parent->keys() + index, left->keys() + left->_size);
+        relocate(right->keys(), right->_size, left->keys() + left->_size + 1);
+        move_children(right->_children, right->_size + 1, left->_children + left->_size + 1);
+        left->_size = static_cast<std::uint16_t>(left->_size + right->_size + 1);
+        right->_size = 0;
+        destroy_inner(right);
+        remove_separator(parent, index);
+    }
+
+    // Go up the path from the inner node at "level", which has lost a key, and fix up the nodes which are too small.
+    // A node borrows a key from a neighbour through the separator in the parent, or is merged with the neighbour,
+    // which takes a key from the parent. The root is replaced by its only child once it has no keys left.
+    void rebalance_inner(path_entry *path, int level) noexcept {
+        for (;; --level) {
+            auto *node = path[level].node;
+            if (level == 0) {
+                if (node->_size == 0) {
+                    _root = node->_children[0];
+                    --_height;
+                    destroy_inner(node);
+                }
+                return;
+            }
+            if (node->_size >= min_inner_size)
+                return;
+
+            const auto [parent, i] = path[level - 1];
+            auto *left = i > 0 ? static_cast<inner_node *>(parent->_children[i - 1]) : nullptr;
+            auto *right = i < parent->_size ? static_cast<inner_node *>(parent->_children[i + 1]) : nullptr;
+            if (left && left->_size > min_inner_size) {
+                relocate(node->keys(), node->_size, node->keys() + 1);
+                move_children(node->_children, node->_size + 1, node->_children + 1);
+                relocate(parent->keys() + i - 1, node->keys());
+                node->_children[0] = left->_children[left->_size];
+                relocate(left->keys() + --left->_size, parent->keys() + i - 1);
+                ++node->_size;
+                return;
+            }
+            if (right && right->_size > min_inner_size) {
+                relocate(parent->keys() + i, node->keys() + node->_size);
+                node->_children[++node->_size] = right->_children[0];
+                relocate(right->keys(), parent->keys() + i);
+                relocate(right->keys() + 1, right->_size - 1, right->keys());
+                move_children(right->_children + 1, right->_size, right->_children);
+                --right->_size;
+                return;
+            }
+            if (left)
+                merge_inners(left, node, parent, i - 1);
+            else
+                merge_inners(node, right, parent, i);
+        }
+    }
+
+public:
+    // (Constant) begin and end iterators.
+    iterator begin() noexcept { return iterator(_leaves._next, 0); }
+    const_iterator begin() const noexcept { return cbegin(); }
+    const_iterator cbegin() const noexcept { return const_iterator(_leaves._next, 0); }
+    iterator end() noexcept { return iterator(&_leaves, 0); }
+    const_iterator end() const noexcept { return cend(); }
+    const_iterator cend() const noexcept { return const_iterator(const_cast<leaf_links *>(&_leaves), 0); }
+
+    btree() : btree(allocator_type()) {}
+    explicit btree(const allocator_type &alloc) : _leaf_allocator(alloc), _inner_allocator(alloc) {}
+    explicit btree(const cmp_type &comparator, const allocator_type &alloc = allocator_type())
+        : _leaf_allocator(alloc), _inner_allocator(alloc), _comparator(comparator) {}
+
+    // Copy constructor appends the elements of the other tree in order (see "append_copy").
+    btree(const btree &other)
+        : _leaf_allocator(leaf_alloc_traits::select_on_container_copy_construction(other._leaf_allocator)),
+          _inner_allocator(inner_alloc_traits::select_on_container_copy_construction(other._inner_allocator)),
+          _comparator(other._comparator) {
+        append_copy(other);
+    }
+
+    // Move constructor takes over the nodes of the other tree, which is left empty.
+    btree(btree &&other) noexcept
+        : _leaf_allocator(other._leaf_allocator), _inner_allocator(other._inner_allocator),
+          _comparator(std::move(other._comparator)) {
+        take_over(other);
+    }
+
+    // Copy assignment keeps the allocators of this tree, unless they propagate on the copy assignment. The copy is
+    // made before the old nodes are destroyed, so the tree is unchanged if the copying throws.
+    btree &operator=(const btree &other) {
+        if (this == &other)
+            return *this;
+
+        constexpr bool propagate = leaf_alloc_traits::propagate_on_container_copy_assignment::value;
+        btree copy(other._comparator, propagate ? other.get_allocator() : get_allocator());
+        copy.append_copy(other);
+        clear();
+        if constexpr (propagate) {
+            _leaf_allocator = copy._leaf_allocator;
+            _inner_allocator = copy._inner_allocator;
+        }
+        _comparator = std::move(copy._comparator);
+        take_over(copy);
+        return *this;
+    }
+
+    // Move assignment takes over the nodes of the other tree, which is left empty. If the allocators do not
+    // propagate, and they differ, this tree cannot free the nodes of the other one - then, like in the std::map, the
+    // elements are moved one by one into the new nodes, and the tree is unchanged if that throws.
+    btree &operator=(btree &&other) noexcept(leaf_alloc_traits::propagate_on_container_move_assignment::value ||
+                                             leaf_alloc_traits::is_always_equal::value) {
+        if (this == &other)
+            return *this;
+
+        constexpr bool propagate = leaf_alloc_traits::propagate_on_container_move_assignment::value;
+        if constexpr (!propagate && !leaf_alloc_traits::is_always_equal::value) {
+            if (_leaf_allocator != other._leaf_allocator) {
+                btree moved(other._comparator, get_allocator());
+                moved.append_copy<true>(other);
+                clear();
+                _comparator = std::move(moved._comparator);
+                take_over(moved);
+                other.clear();
+                return *this;
+            }
+        }
+        clear();
+        if constexpr (propagate) {
+            _leaf_allocator = other._leaf_allocator;
+            _inner_allocator = other._inner_allocator;
+        }
+        _comparator = std::move(other._comparator);
+        take_over(other);
+        return *this;
+    }
+
+    ~btree() { clear(); }
+
+    allocator_type get_allocator() const { return allocator_type(_leaf_allocator); }
+
+    // Is the tree empty.
+    bool empty() const noexcept { return _size == 0; }
+    // Return the size of the tree.
+    size_type size() const noexcept { return _size; }
+    // Maximum number of elements in the tree.
+    constexpr size_type max_size() const noexcept { return std::numeric_limits<size_type>::max(); }
+    // Number of the levels of the tree (zero if the tree is empty), i.e. the nodes visited by a lookup.
+    int height() const noexcept { return _height; }
+
+    // Delete all the nodes in the tree, and return the nodes' memory to the allocator.
+    void clear() noexcept {
+        if (_root)
+            destroy_subtree(_root, 0);
+        _root = nullptr;
+        _height = 0;
+        _size = 0;
+        _leaves._prev = _leaves._next = &_leaves;
+    }
+
+    // Construct the element and insert it in the tree, unless its key already exists. Return the iterator to the
+    // element with the key, and whether it was inserted.
+    template <class... Args>
+    [[maybe_unused]] std::pair<iterator, bool> emplace(Args&&... args) {
+        node_val_type value(std::forward<Args>(args)...);
+        return insert_unique(value);
+    }
+
+    // Insert the element with the given key and the value constructed from the rest of the arguments. If the key
+    // exists, the arguments are not moved from, and the iterator to the existing element is returned.
+    template <class... Args>
+    [[maybe_unused]] std::pair<iterator, bool> try_emplace(const key_type &key, Args&&... args) {
+        search_path path;
+        leaf_node *leaf = nullptr;
+        std::uint16_t index = 0;
+        if (_root) {
+            leaf = descend(key, path.data());
+            index = value_position<false>(leaf, key);
+            if (index < leaf->_size && !key_less(key, leaf->values()[index].first))
+                return std::make_pair(iterator(leaf, index), false);
+        }
+
+        node_val_type value(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        return std::make_pair(insert_at(path.data(), leaf, index, value), true);
+    }
+
+    // Construct the element and insert it like "emplace". Only the end() hint is used: if the key is greater than
+    // all the keys in the tree, the element is appended to the last leaf without any search, which makes building
+    // the tree from the ascending keys cheap.
+    template <class... Args>
+    iterator emplace_hint(const_iterator hint, Args&&... args) {
+        node_val_type value(std::forward<Args>(args)...);
+        if (hint != cend() || !_root)
+            return insert_unique(value).first;
+
+        auto *last = static_cast<leaf_node *>(_leaves._prev);
+        if (!key_less(last->values()[last->_size - 1].first, value.first))
+            return insert_unique(value).first;
+
+        search_path path;
+        void *node = _root;
+        for (int level = 0; level < _height - 1; ++level) {
+            auto *inner = static_cast<inner_node *>(node);
+            path[level] = {inner, inner->_size};
+            node = inner->_children[inner->_size];
+        }
+        return insert_at(path.data(), last, last->_size, value);
+    }
+
+    // Various "insert" function overloads.
+    [[maybe_unused]] std::pair<iterator, bool> insert(const node_val_type &value) { return emplace(value); }
+    [[maybe_unused]] std::pair<iterator, bool> insert(node_val_type &&value) { return emplace(std::move(value)); }
+    [[maybe_unused]] std::pair<iterator, bool> insert(const val_type &value) { return emplace(std::make_pair(value, value)); }
+
+    template <class InsT>
+    [[maybe_unused]] std::pair<iterator, bool> insert(InsT &&value) { return emplace(std::forward<InsT>(value)); }
+
+    iterator insert(const_iterator hint, const node_val_type &value) { return emplace_hint(hint, value); }
+    iterator insert(const_iterator hint, node_val_type &&value) { return emplace_hint(hint, std::move(value)); }
+
+    template <class ItT>
+    void insert(ItT first, ItT last) {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+
+    void insert(std::initializer_list<node_val_type> ilist) {
+        for (auto val : ilist)
+            insert(val);
+    }
+
+    // Erase the element at "pos", and return the iterator to the element that follows it. The element is found again
+    // by its key, to record the path from the root, which the rebalancing goes up along.
+    iterator erase(const_iterator pos) {
+        if (pos == cend())
+            throw std::out_of_range("Invalid iterator.\n");
+        search_path path;
+        auto *leaf = descend(pos->first, path.data());
+        assert(leaf == pos._leaf && "The iterator does not belong to the tree.");
+        return erase_at(path.data(), leaf, pos._index);
+    }
+    iterator erase(iterator pos) { return erase(const_iterator(pos)); }
+
+    // Erase the elements in the [first, last) range, and return the iterator to the element that follows them. The
+    // erasures move the elements around, so the range is counted up front.
+    iterator erase(const_iterator first, const_iterator last) {
+        auto count = std::distance(first, last);
+        iterator it(first._leaf, first._index);
+        for (; count > 0; --count)
+            it = erase(it);
+        return it;
+    }
+
+    // Erase the element with the given key. Return the number of the erased elements (zero or one).
+    size_type erase(const key_type &key) {
+        if (!_root)
+            return 0;
+        search_path path;
+        auto *leaf = descend(key, path.data());
+        const auto index = value_position<false>(leaf, key);
+        if (index == leaf->_size || key_less(key, leaf->values()[index].first))
+            return 0;
+        erase_at(path.data(), leaf, index);
+        return 1;
+    }
+
+    // Return the iterator to the element with the given key if it exists, otherwise, return end().
+    iterator find(const key_type &key) { return find_internal<iterator>(key); }
+    const_iterator find(const key_type &key) const { return find_internal<const_iterator>(key); }
+    template <class K, class = transparent_key<K>>
+    iterator find(const K &key) { return find_internal<iterator>(key); }
+    template <class K, class = transparent_key<K>>
+    const_iterator find(const K &key) const { return find_internal<const_iterator>(key); }
+
+    // Return the iterator to the first element with the key not less than the given key, or end() if there is none.
+    iterator lower_bound(const key_type &key) { return bound_internal<false, iterator>(key); }
+    const_iterator lower_bound(const key_type &key) const { return bound_internal<false, const_iterator>(key); }
+    template <class K, class = transparent_key<K>>
+    iterator lower_bound(const K &key) { return bound_internal<false, iterator>(key); }
+    template <class K, class = transparent_key<K>>
+    const_iterator lower_bound(const K &key) const { return bound_internal<false, const_iterator>(key); }
+    // Return the iterator to the first element with the key greater than the given key, or end() if there is none.
+    iterator upper_bound(const key_type &key) { return bound_internal<true, iterator>(key); }
+    const_iterator upper_bound(const key_type &key) const { return bound_internal<true, const_iterator>(key); }
+    template <class K, class = transparent_key<K>>
+    iterator upper_bound(const K &key) { return bound_internal<true, iterator>(key); }
+    template <class K, class = transparent_key<K>>
+    const_iterator upper_bound(const K &key) const { return bound_internal<true, const_iterator>(key); }
+    // Return the range of the elements with the given key - a single element, or an empty range at the lower bound.
+    std::pair<iterator, iterator> equal_range(const key_type &key) { return equal_range_internal<iterator>(key); }
+    std::pair<const_iterator, const_iterator> equal_range(const key_type &key) const {
+        return equal_range_internal<const_iterator>(key);
+    }
+    template <class K, class = transparent_key<K>>
+    std::pair<iterator, iterator> equal_range(const K &key) { return equal_range_internal<iterator>(key); }
+    template <class K, class = transparent_key<K>>
+    std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+        return equal_range_internal<const_iterator>(key);
+    }
+
+    // Comparison operators.
+    bool friend operator==(const btree &lhs, const btree &rhs) noexcept {
+        return lhs.size() == rhs.size() && std::equal(lhs.cbegin(), lhs.cend(), rhs.cbegin());
+    }
+    bool friend operator!=(const btree &lhs, const btree &rhs) noexcept { return !(lhs == rhs); }
+
+    // Find the element with the given key. If such element exists, return a reference to its value. If it doesn't
+    // exist, insert a new element, and return the reference to its value.
+    val_type &operator[](const key_type &key) { return try_emplace(key).first->second; }
+
+    // Like "operator[]", but throws an exception if the element with the given key does not exist.
+    val_type &at(const key_type &key) { return at_internal(key); }
+    const val_type &at(const key_type &key) const { return at_internal(key); }
+    template <class K, class = transparent_key<K>>
+    val_type &at(const K &key) { return at_internal(key); }
+    template <class K, class = transparent_key<K>>
+    const val_type &at(const K &key) const { return at_internal(key); }
+
+private:
+    template <class ItT, class K>
+    std::pair<ItT, ItT> equal_range_internal(const K &key) const {
+        auto lower = bound_internal<false, ItT>(key);
+        if (lower == ItT(const_cast<leaf_links *>(&_leaves), 0) || key_less(key, lower->first))
+            return std::make_pair(lower, lower);
+        return std::make_pair(lower, std::next(lower));
+    }
+
+    template <class K>
+    val_type &at_internal(const K &key) const {
+        auto it = find_internal<iterator>(key);
+        if (it == iterator(const_cast<leaf_links *>(&_leaves), 0))
+            throw std::out_of_range("Nonexistent key.\n");
+        return it->second;
+    }
+};
+
+} // end namespace avl
+
+#endif // BTREE_H
@@ -0,0 +1,124 @@
+#ifndef CONCURRENT_AVL_TREE_H
+#define CONCURRENT_AVL_TREE_H
+
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <utility>
+
+#include "avl_tree.h"
+
+namespace avl {
+
+// Thread-safe wrapper around the "avl_tree". The lookups only read the tree, so they take a shared lock and run
+// concurrently with each other, while the modifications take the exclusive lock. Iterators to the tree would be
+// invalidated by the concurrent erasures, so the lookups return copies of the elements instead. More complex
+// operations (like range scans) can be run on the tree itself under the appropriate lock, through "read" and "write".
+template <typename Key, typename T = Key, typename Cmp = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, T>>, typename Options = default_options>
+class concurrent_avl_tree final {
+public:
+    using tree_type = avl_tree<Key, T, Cmp, Alloc, Options>;
+    using size_type = typename tree_type::size_type;
+    using key_type = typename tree_type::key_type;
+    using val_type = typename tree_type::val_type;
+    using node_val_type = typename tree_type::node_val_type;
+
+    concurrent_avl_tree() = default;
+    explicit concurrent_avl_tree(tree_type tree) : _tree(std::move(tree)) {}
+    concurrent_avl_tree(const concurrent_avl_tree &) = delete;
+    concurrent_avl_tree &operator=(const concurrent_avl_tree &) = delete;
+
+    // Run "fn" with the const reference to the tree, under the shared lock. Return whatever "fn" returns.
+    template <class Fn>
+    decltype(auto) read(Fn &&fn) const {
+        std::shared_lock lock(_mutex);
+        return std::forward<Fn>(fn)(static_cast<const tree_type &>(_tree));
+    }
+
+    // Run "fn" with the reference to the tree, under the exclusive lock. Return whatever "fn" returns.
+    template <class Fn>
+    decltype(auto) write(Fn &&fn) {
+        std::unique_lock lock(_mutex);
+        return std::forward<Fn>(fn)(_tree);
+    }
+
+    bool empty() const {
+        std::shared_lock lock(_mutex);
+        return _tree.empty();
+    }
+    size_type size() const {
+        std::shared_lock lock(_mutex);
+        return _tree.size();
+    }
+
+    // Return the copy of the value tied to the key, or nothing if the key does not exist.
+    std::optional<val_type> find(const key_type &key) const {
+        std::shared_lock lock(_mutex);
+        if (auto it = _tree.find(key); it != _tree.cend())
+            return it->second;
+        return std::nullopt;
+    }
+    bool contains(const key_type &key) const {
+        std::shared_lock lock(_mutex);
+        return _tree.find(key) != _tree.cend();
+    }
+    // Like "find", but throws an exception if the key does not exist.
+    val_type at(const key_type &key) const {
+        std::shared_lock lock(_mutex);
+        return _tree.at(key);
+    }
+    // Return the copy of the first element with the key not less than (or greater than) the given key, or nothing
+    // if there is no such element.
+    std::optional<node_val_type> lower_bound(const key_type &key) const {
+        std::shared_lock lock(_mutex);
+        if (auto it = _tree.lower_bound(key); it != _tree.cend())
+            return *it;
+        return std::nullopt;
+    }
+    std::optional<node_val_type> upper_bound(const key_type &key) const {
+        std::shared_lock lock(_mutex);
+        if (auto it = _tree.upper_bound(key); it != _tree.cend())
+            return *it;
+        return std::nullopt;
+    }
+
+    // Insert the element, unless its key already exists. Return true if the element was inserted.
+    bool insert(const node_val_type &value) {
+        std::unique_lock lock(_mutex);
+        return _tree.insert(value).second;
+    }
+    bool insert(node_val_type &&value) {
+        std::unique_lock lock(_mutex);
+        return _tree.insert(std::move(value)).second;
+    }
+    // Insert the element, or assign the value to the existing element with the same key.
+    void insert_or_assign(const key_type &key, val_type value) {
+        std::unique_lock lock(_mutex);
+        if (auto [it, inserted] = _tree.try_emplace(key, std::move(value)); !inserted)
+            it->second = std::move(value);
+    }
+
+    // Erase the element with the given key. Return the number of the erased elements (zero or one).
+    size_type erase(const key_type &key) {
+        std::unique_lock lock(_mutex);
+        auto it = _tree.find(key);
+        if (it == _tree.end())
+            return 0;
+        _tree.erase(it);
+        return 1;
+    }
+
+    void clear() {
+        std::unique_lock lock(_mutex);
+        _tree.clear();
+    }
+
+private:
+    tree_type _tree{};
+    mutable std::shared_mutex _mutex{};
+};
+
+} // end namespace avl
+
+#endif // CONCURRENT_AVL_TREE_H
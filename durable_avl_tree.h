@@ -0,0 +1,440 @@
+#ifndef DURABLE_AVL_TREE_H
+#define DURABLE_AVL_TREE_H
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "avl_tree.h"
+
+namespace avl {
+
+// Tuning of the "durable_avl_tree".
+struct durability_options {
+    // How long the log writer waits for more records before each write and fsync, so that they share it. With
+    // zero, a batch is written as soon as the previous write is done - it still holds everything logged meanwhile.
+    std::chrono::microseconds group_commit_window{0};
+    // Number of the logged operations after which a checkpoint replaces the log (zero - only on "checkpoint").
+    std::size_t checkpoint_interval{std::size_t{1} << 20};
+    // Called by the log writer once the new checkpoint has replaced the old one, before the log is emptied - for
+    // testing the recovery from a crash at that point. If it throws, the tree fails like on a write error, and the
+    // files are left as the crash would leave them.
+    std::function<void()> checkpoint_replaced{};
+};
+
+// The "avl_tree" which survives a crash (POSIX only). Every modification appends a record with its effect (the
+// new element, or the erased key) to the write-ahead log "<path>.log", and returns once the record is on the disk.
+// A single background thread writes the log: the records logged while it is busy (or within the group commit
+// window) are written with a single fsync, so the concurrent modifications share its cost. Every so often, the
+// tree is saved to the checkpoint "<path>.checkpoint" (in the "avl_tree::save" format), which replaces the log.
+//
+// The constructor recovers the tree: it loads the checkpoint and replays the log after it, up to the last complete
+// record - the ones torn by the crash are dropped. The records pending at a checkpoint are written to the log before
+// it, so the log always holds the whole history since the previous checkpoint. Then the log left behind by a crash in
+// the middle of a checkpoint replays correctly over the new checkpoint too: the last record of each key (or the last
+// clear) leaves the state the checkpoint was saved in.
+//
+// The methods are thread-safe. The lookups may see the modifications whose records are still being written. If the
+// log cannot be written, the waiting modifications throw, and so do all the later ones - the tree has to be
+// reopened then, which recovers the durable state. The keys and values must be trivially copyable.
+template <typename Key, typename T = Key, typename Cmp = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, T>>, typename Options = default_options>
+class durable_avl_tree final {
+public:
+    using tree_type = avl_tree<Key, T, Cmp, Alloc, Options>;
+    using size_type = typename tree_type::size_type;
+    using key_type = typename tree_type::key_type;
+    using val_type = typename tree_type::val_type;
+    using node_val_type = typename tree_type::node_val_type;
+    using cmp_type = typename tree_type::cmp_type;
+
+    static_assert(std::is_trivially_copyable_v<key_type> && std::is_trivially_copyable_v<val_type>,
+                  "Only the trees of the trivially copyable keys and values can be logged.");
+
+    explicit durable_avl_tree(const std::string &path, const durability_options &options = durability_options(),
+                              const cmp_type &comparator = cmp_type())
+        : _tree(comparator), _checkpoint_path(path + ".checkpoint"), _log_path(path + ".log"), _options(options) {
+        recover();
+        _writer = std::thread([this] { run_log_writer(); });
+    }
+    durable_avl_tree(const durable_avl_tree &) = delete;
+    durable_avl_tree &operator=(const durable_avl_tree &) = delete;
+
+    // Writes out the rest of the log.
+    ~durable_avl_tree() {
+        {
+            std::lock_guard lock(_mutex);
+            _stopping = true;
+        }
+        _log_wake.notify_one();
+        _writer.join();
+        ::close(_log_file);
+    }
+
+    // Run "fn" with the const reference to the tree, under the lock. Return whatever "fn" returns.
+    template <class Fn>
+    decltype(auto) read(Fn &&fn) const {
+        std::lock_guard lock(_mutex);
+        return std::forward<Fn>(fn)(static_cast<const tree_type &>(_tree));
+    }
+
+    bool empty() const {
+        std::lock_guard lock(_mutex);
+        return _tree.empty();
+    }
+    size_type size() const {
+        std::lock_guard lock(_mutex);
+        return _tree.size();
+    }
+
+    // Return the copy of the value tied to the key, or nothing if the key does not exist.
+    std::optional<val_type> find(const key_type &key) const {
+        std::lock_guard lock(_mutex);
+        if (auto it = _tree.find(key); it != _tree.cend())
+            return it->second;
+        return std::nullopt;
+    }
+    bool contains(const key_type &key) const {
+        std::lock_guard lock(_mutex);
+        return _tree.find(key) != _tree.cend();
+    }
+    // Like "find", but throws an exception if the key does not exist.
+    val_type at(const key_type &key) const {
+        std::lock_guard lock(_mutex);
+        return _tree.at(key);
+    }
+
+    // The modifications below return once their effect is durable.
+
+    // Insert the element constructed from the arguments, unless its key already exists. Return true if the
+    // element was inserted.
+    template <class... Args>
+    bool emplace(Args&&... args) {
+        return modify([&] {
+            auto [it, inserted] = _tree.emplace(std::forward<Args>(args)...);
+            if (inserted)
+                log_put(*it);
+            return inserted;
+        });
+    }
+    // Insert the element with the key and the value constructed from the arguments, unless the key already exists.
+    // Return true if the element was inserted.
+    template <class... Args>
+    bool try_emplace(const key_type &key, Args&&... args) {
+        return modify([&] {
+            auto [it, inserted] = _tree.try_emplace(key, std::forward<Args>(args)...);
+            if (inserted)
+                log_put(*it);
+            return inserted;
+        });
+    }
+    // Insert the element, or assign the value to the existing element with the same key. Return true if the
+    // element was inserted.
+    bool insert_or_assign(const key_type &key, val_type value) {
+        return modify([&] {
+            auto [it, inserted] = _tree.try_emplace(key, value);
+            if (!inserted)
+                it->second = value;
+            log_put(*it);
+            return inserted;
+        });
+    }
+
+    // Erase the element with the given key. Return the number of the erased elements (zero or one).
+    size_type erase(const key_type &key) {
+        return modify([&] {
+            auto it = _tree.find(key);
+            if (it == _tree.end())
+                return size_type(0);
+            _tree.erase(it);
+            log_record(record_type::erase, &key, sizeof(key_type), nullptr, 0);
+            return size_type(1);
+        });
+    }
+
+    void clear() {
+        modify([&] {
+            _tree.clear();
+            log_record(record_type::clear, nullptr, 0, nullptr, 0);
+            return true;
+        });
+    }
+
+    // Save the tree to a new checkpoint, which replaces the log, and wait until it is durable.
+    void checkpoint() {
+        std::unique_lock lock(_mutex);
+        throw_if_failed();
+        const auto target = _checkpoints + 1;
+        _checkpoint_requested = true;
+        _log_wake.notify_one();
+        _durable.wait(lock, [&] { return _checkpoints >= target || _error; });
+        throw_if_failed();
+    }
+
+private:
+    enum class record_type : unsigned char { put = 1, erase = 2, clear = 3 };
+
+    // A log record is the type byte, the key (the put and erase records), the value (the put records), and the
+    // checksum of all that.
+    using checksum_type = std::uint32_t;
+
+    tree_type _tree;
+    const std::string _checkpoint_path;
+    const std::string _log_path;
+    const durability_options _options;
+    int _log_file{-1};
+
+    mutable std::mutex _mutex{};
+    // Wakes the log writer up when there is something to write (or it is time to stop).
+    std::condition_variable _log_wake{};
+    // Wakes the modifications up when the log writer has written their records.
+    std::condition_variable _durable{};
+    // Records not handed to the log writer yet.
+    std::vector<char> _log_buffer{};
+    // Number of the records logged so far, and how many of them are durable.
+    std::uint64_t _logged{0};
+    std::uint64_t _written{0};
+    // Number of the records logged since the last checkpoint, and the checkpoints taken so far.
+    std::size_t _since_checkpoint{0};
+    std::uint64_t _checkpoints{0};
+    bool _checkpoint_requested{false};
+    bool _stopping{false};
+    // The first error of the log writer, which fails all the later modifications.
+    std::exception_ptr _error{};
+    // Started last, once everything it uses is constructed.
+    std::thread _writer{};
+
+    void throw_if_failed() const {
+        if (_error)
+            std::rethrow_exception(_error);
+    }
+
+    // Run "fn" (which modifies the tree and logs the change) under the lock, and wait until its record (if any)
+    // is written. Return whatever "fn" returns.
+    template <class Fn>
+    auto modify(Fn &&fn) {
+        std::unique_lock lock(_mutex);
+        throw_if_failed();
+        auto result = fn();
+        const auto target = _logged;
+        if (_written < target) {
+            _log_wake.notify_one();
+            _durable.wait(lock, [&] { return _written >= target || _error; });
+            throw_if_failed();
+        }
+        return result;
+    }
+
+    static checksum_type checksum(const char *data, std::size_t size) noexcept {
+        // FNV-1a - only the torn records at the end of the log need to be told apart.
+        checksum_type hash = 2166136261u;
+        for (std::size_t i = 0; i < size; ++i)
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        return hash;
+    }
+
+    void log_record(record_type type, const void *key, std::size_t key_size, const void *val, std::size_t val_size) {
+        const auto start = _log_buffer.size();
+        _log_buffer.push_back(static_cast<char>(type));
+        _log_buffer.insert(_log_buffer.end(), static_cast<const char *>(key), static_cast<const char *>(key) + key_size);
+        _log_buffer.insert(_log_buffer.end(), static_cast<const char *>(val), static_cast<const char *>(val) + val_size);
+        const auto sum = checksum(_log_buffer.data() + start, _log_buffer.size() - start);
+        const auto *sum_bytes = reinterpret_cast<const char *>(&sum);
+        _log_buffer.insert(_log_buffer.end(), sum_bytes, sum_bytes + sizeof(sum));
+        ++_logged;
+        ++_since_checkpoint;
+    }
+    void log_put(const node_val_type &value) {
+        log_record(record_type::put, &value.first, sizeof(key_type), &value.second, sizeof(val_type));
+    }
+
+    // Load the checkpoint, replay the log, and cut the torn records off its end.
+    void recover() {
+        if (std::ifstream checkpoint{_checkpoint_path, std::ios::binary})
+            _tree.load(checkpoint);
+
+        _log_file = ::open(_log_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (_log_file < 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot open the log file");
+        try {
+            // The log may have just been created, and the records written to it are lost with the file unless
+            // its directory entry is durable too.
+            sync_directory(_log_path, "Cannot create the log file");
+            std::ifstream log{_log_path, std::ios::binary};
+            const std::vector<char> data{std::istreambuf_iterator<char>(log), std::istreambuf_iterator<char>()};
+            const auto valid = replay(data);
+            if (valid != data.size() && ::ftruncate(_log_file, static_cast<off_t>(valid)) != 0)
+                throw std::system_error(errno, std::generic_category(), "Cannot truncate the log file");
+        } catch (...) {
+            ::close(_log_file);
+            throw;
+        }
+    }
+
+    // Apply the records in the log data to the tree. Return the size of the complete records.
+    std::size_t replay(const std::vector<char> &data) {
+        std::size_t pos = 0;
+        while (pos < data.size()) {
+            const auto type = static_cast<record_type>(data[pos]);
+            std::size_t size = 1;
+            if (type == record_type::put)
+                size += sizeof(key_type) + sizeof(val_type);
+            else if (type == record_type::erase)
+                size += sizeof(key_type);
+            else if (type != record_type::clear)
+                break;
+            checksum_type sum{};
+            if (data.size() - pos < size + sizeof(sum))
+                break;
+            std::memcpy(&sum, data.data() + pos + size, sizeof(sum));
+            if (sum != checksum(data.data() + pos, size))
+                break;
+
+            key_type key{};
+            std::memcpy(&key, data.data() + pos + 1, type == record_type::clear ? 0 : sizeof(key_type));
+            if (type == record_type::put) {
+                val_type val{};
+                std::memcpy(&val, data.data() + pos + 1 + sizeof(key_type), sizeof(val_type));
+                if (auto [it, inserted] = _tree.try_emplace(key, val); !inserted)
+                    it->second = val;
+            } else if (type == record_type::erase) {
+                if (auto it = _tree.find(key); it != _tree.end())
+                    _tree.erase(it);
+            } else
+                _tree.clear();
+            pos += size + sizeof(sum);
+        }
+        return pos;
+    }
+
+    static void write_all(int file, const char *data, std::size_t size) {
+        while (size > 0) {
+            const auto written = ::write(file, data, size);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "Cannot write the log");
+            }
+            data += written;
+            size -= static_cast<std::size_t>(written);
+        }
+    }
+
+    // Write the tree image to a new checkpoint, which atomically replaces the old one, then empty the log.
+    void write_checkpoint(const std::string &image) {
+        const auto temp_path = _checkpoint_path + ".tmp";
+        const int file = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot create the checkpoint");
+        try {
+            write_all(file, image.data(), image.size());
+            if (::fsync(file) != 0)
+                throw std::system_error(errno, std::generic_category(), "Cannot write the checkpoint");
+        } catch (...) {
+            ::close(file);
+            throw;
+        }
+        ::close(file);
+        if (std::rename(temp_path.c_str(), _checkpoint_path.c_str()) != 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot replace the checkpoint");
+
+        // The rename itself must be durable before the log goes away.
+        sync_directory(_checkpoint_path, "Cannot replace the checkpoint");
+        if (_options.checkpoint_replaced)
+            _options.checkpoint_replaced();
+        if (::ftruncate(_log_file, 0) != 0 || ::fdatasync(_log_file) != 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot replace the checkpoint");
+    }
+
+    // Make the entries of the directory holding the file durable, after the file was created or renamed.
+    static void sync_directory(const std::string &path, const char *message) {
+        const auto directory = std::filesystem::path(path).parent_path();
+        const int directory_file = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (directory_file < 0)
+            throw std::system_error(errno, std::generic_category(), message);
+        const int error = ::fsync(directory_file) == 0 ? 0 : errno;
+        ::close(directory_file);
+        if (error != 0)
+            throw std::system_error(error, std::generic_category(), message);
+    }
+
+    // Body of the log writer thread. Takes the logged records (or the tree image, for a checkpoint) under the
+    // lock, writes them without it, and then lets the waiting modifications go.
+    void run_log_writer() {
+        std::unique_lock lock(_mutex);
+        for (;;) {
+            _log_wake.wait(lock, [&] { return _stopping || _logged != _written || _checkpoint_requested; });
+            if (_logged == _written && !_checkpoint_requested)
+                return;
+            if (_options.group_commit_window.count() > 0 && !_stopping) {
+                lock.unlock();
+                std::this_thread::sleep_for(_options.group_commit_window);
+                lock.lock();
+            }
+
+            // The records not written yet go to the log even if the checkpoint holds their changes, so that the log
+            // stays a complete history until the checkpoint replaces it.
+            const bool checkpoint = _checkpoint_requested ||
+                                    (_options.checkpoint_interval != 0 && _since_checkpoint >= _options.checkpoint_interval);
+            std::string image;
+            if (checkpoint) {
+                std::ostringstream stream;
+                _tree.save(stream);
+                image = std::move(stream).str();
+                _since_checkpoint = 0;
+                _checkpoint_requested = false;
+            }
+            std::vector<char> batch;
+            batch.swap(_log_buffer);
+            const auto target = _logged;
+            lock.unlock();
+
+            std::exception_ptr error;
+            try {
+                if (!batch.empty()) {
+                    write_all(_log_file, batch.data(), batch.size());
+                    if (::fdatasync(_log_file) != 0)
+                        throw std::system_error(errno, std::generic_category(), "Cannot write the log");
+                }
+                if (checkpoint)
+                    write_checkpoint(image);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+            if (error) {
+                _error = error;
+                _durable.notify_all();
+                return;
+            }
+            _written = target;
+            _checkpoints += checkpoint;
+            _durable.notify_all();
+        }
+    }
+};
+
+} // end namespace avl
+
+#endif // DURABLE_AVL_TREE_H
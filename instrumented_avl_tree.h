@@ -0,0 +1,342 @@
+#ifndef INSTRUMENTED_AVL_TREE_H
+#define INSTRUMENTED_AVL_TREE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <utility>
+
+#include "avl_tree.h"
+
+namespace avl {
+
+// Histogram of the latencies (in nanoseconds), with the logarithmic buckets like the HDR histograms: the values
+// below 32 get a bucket each, and every power of two above that is split into 16 buckets. The percentiles report the
+// top of the bucket, which overstates a value by at most 1/16 of it (about 6%), and never understates it. The
+// buckets are atomic, but a histogram should only be recorded into by one thread at a time - then the recording
+// needs no locks or atomic read-modify-write operations, and other threads can still read (and merge) the histogram
+// meanwhile.
+class latency_histogram final {
+public:
+    static constexpr int sub_bucket_bits = 5;
+    static constexpr std::size_t sub_buckets = std::size_t{1} << sub_bucket_bits;
+    // The exact buckets, and half of the sub-buckets for each of the larger powers of two.
+    static constexpr std::size_t bucket_count = sub_buckets + (64 - sub_bucket_bits) * (sub_buckets / 2);
+
+    latency_histogram() = default;
+    latency_histogram(const latency_histogram &other) { merge(other); }
+    latency_histogram &operator=(const latency_histogram &other) {
+        if (this != &other) {
+            reset();
+            merge(other);
+        }
+        return *this;
+    }
+
+    void record(std::uint64_t value) noexcept {
+        add(_buckets[bucket_of(value)], 1);
+        add(_count, 1);
+        if (value > _max.load(std::memory_order_relaxed))
+            _max.store(value, std::memory_order_relaxed);
+    }
+
+    // Same, for a histogram which several threads record into at once. The counts are added with the atomic
+    // read-modify-write operations, so that none of them are lost.
+    void record_shared(std::uint64_t value) noexcept {
+        _buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        auto max = _max.load(std::memory_order_relaxed);
+        while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Add the counts of the other histogram to this one.
+    void merge(const latency_histogram &other) noexcept {
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            if (const auto count = other._buckets[i].load(std::memory_order_relaxed))
+                add(_buckets[i], count);
+        }
+        add(_count, other._count.load(std::memory_order_relaxed));
+        if (other.max() > max())
+            _max.store(other.max(), std::memory_order_relaxed);
+    }
+
+    void reset() noexcept {
+        for (auto &bucket : _buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        _count.store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
+    }
+
+    std::uint64_t count() const noexcept { return _count.load(std::memory_order_relaxed); }
+    std::uint64_t max() const noexcept { return _max.load(std::memory_order_relaxed); }
+
+    // The value not exceeded by the given fraction (in the [0, 1] range) of the recorded values - the highest
+    // value of its bucket, but no more than the maximum. Zero if nothing was recorded.
+    std::uint64_t percentile(double fraction) const noexcept {
+        const auto total = count();
+        if (total == 0)
+            return 0;
+        const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(fraction * static_cast<double>(total))));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            seen += _buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(highest_in_bucket(i), max());
+        }
+        return max();
+    }
+
+    static std::size_t bucket_of(std::uint64_t value) noexcept {
+        if (value < sub_buckets)
+            return static_cast<std::size_t>(value);
+        // Shift the value down to the upper half of the sub-buckets.
+        int shift = 1;
+        while ((value >> shift) >= sub_buckets)
+            ++shift;
+        return sub_buckets + static_cast<std::size_t>(shift - 1) * (sub_buckets / 2) +
+               static_cast<std::size_t>((value >> shift) - sub_buckets / 2);
+    }
+
+    static std::uint64_t highest_in_bucket(std::size_t bucket) noexcept {
+        if (bucket < sub_buckets)
+            return bucket;
+        const auto shift = static_cast<int>((bucket - sub_buckets) / (sub_buckets / 2)) + 1;
+        const auto sub_bucket = (bucket - sub_buckets) % (sub_buckets / 2) + sub_buckets / 2;
+        if (sub_bucket + 1 == sub_buckets && shift + sub_bucket_bits == 64)
+            return std::numeric_limits<std::uint64_t>::max();
+        return ((static_cast<std::uint64_t>(sub_bucket) + 1) << shift) - 1;
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, bucket_count> _buckets{};
+    std::atomic<std::uint64_t> _count{0};
+    std::atomic<std::uint64_t> _max{0};
+
+    // Add to a counter with a single writer.
+    static void add(std::atomic<std::uint64_t> &counter, std::uint64_t value) noexcept {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+};
+
+// The latency histograms of an operation, one per recording thread. The histogram of a thread is allocated on its
+// first recording, and the recordings take no locks. The index of a thread (and so its histogram) is handed over
+// to a later thread once the thread exits. The threads beyond "max_threads" alive at once share one more histogram,
+// and record into it with the atomic read-modify-write operations.
+class thread_latency_histograms final {
+public:
+    static constexpr std::size_t max_threads = 64;
+
+    thread_latency_histograms() = default;
+    thread_latency_histograms(const thread_latency_histograms &) = delete;
+    thread_latency_histograms &operator=(const thread_latency_histograms &) = delete;
+    ~thread_latency_histograms() {
+        for (auto &slot : _slots)
+            delete slot.load(std::memory_order_relaxed);
+    }
+
+    // If the histogram of the thread cannot be allocated, the value is dropped.
+    void record(std::uint64_t value) noexcept {
+        const auto index = thread_index();
+        if (auto *histogram = local(index)) {
+            if (index == shared_index)
+                histogram->record_shared(value);
+            else
+                histogram->record(value);
+        }
+    }
+
+    // All the threads' histograms merged together.
+    latency_histogram merged() const {
+        latency_histogram histogram;
+        for (const auto &slot : _slots) {
+            if (const auto *thread_histogram = slot.load(std::memory_order_acquire))
+                histogram.merge(*thread_histogram);
+        }
+        return histogram;
+    }
+
+    // Only while nothing is recorded.
+    void reset() noexcept {
+        for (auto &slot : _slots) {
+            if (auto *thread_histogram = slot.load(std::memory_order_relaxed))
+                thread_histogram->reset();
+        }
+    }
+
+private:
+    // Index of the histogram shared by the threads beyond "max_threads".
+    static constexpr std::size_t shared_index = max_threads;
+
+    std::array<std::atomic<latency_histogram *>, max_threads + 1> _slots{};
+
+    // The indices not held by any thread, shared by all the histograms. The indices below "next" have been handed
+    // out, and those given back are on the free list.
+    struct thread_indices {
+        std::mutex mutex;
+        std::array<std::size_t, max_threads> free;
+        std::size_t free_count = 0;
+        std::size_t next = 0;
+    };
+    static thread_indices &indices() noexcept {
+        static thread_indices indices;
+        return indices;
+    }
+
+    // Index held by a thread from its first recording until it exits. The lock ordering makes the recordings of
+    // the exited thread visible to the next holder of its index.
+    struct thread_index_holder {
+        std::size_t index = shared_index;
+
+        thread_index_holder() noexcept {
+            auto &indices = thread_latency_histograms::indices();
+            std::lock_guard lock(indices.mutex);
+            if (indices.free_count > 0)
+                index = indices.free[--indices.free_count];
+            else if (indices.next < max_threads)
+                index = indices.next++;
+        }
+        ~thread_index_holder() {
+            if (index == shared_index)
+                return;
+            auto &indices = thread_latency_histograms::indices();
+            std::lock_guard lock(indices.mutex);
+            indices.free[indices.free_count++] = index;
+        }
+    };
+
+    static std::size_t thread_index() noexcept {
+        thread_local const thread_index_holder holder;
+        return holder.index;
+    }
+
+    latency_histogram *local(std::size_t index) noexcept {
+        auto &slot = _slots[index];
+        if (auto *histogram = slot.load(std::memory_order_acquire))
+            return histogram;
+        // Only the threads sharing the last slot can race to fill it.
+        auto *histogram = new (std::nothrow) latency_histogram();
+        latency_histogram *expected = nullptr;
+        if (!histogram || slot.compare_exchange_strong(expected, histogram, std::memory_order_acq_rel))
+            return histogram;
+        delete histogram;
+        return expected;
+    }
+};
+
+// The "avl_tree" which records the latencies of its "emplace", "try_emplace", "erase", "find" and "at" calls into
+// the per-thread histograms, and reports their percentiles. The rest of the tree is reached through "tree". The
+// recording costs two clock reads per call. The wrapper is as thread-safe as the tree: the concurrent lookups on
+// the const tree record without contention, and the modifications need to be synchronized by the caller.
+template <typename Key, typename T = Key, typename Cmp = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, T>>, typename Options = default_options>
+class instrumented_avl_tree final {
+public:
+    using tree_type = avl_tree<Key, T, Cmp, Alloc, Options>;
+    using size_type = typename tree_type::size_type;
+    using key_type = typename tree_type::key_type;
+    using val_type = typename tree_type::val_type;
+    using iterator = typename tree_type::iterator;
+    using const_iterator = typename tree_type::const_iterator;
+
+    // The recorded operations.
+    enum class operation { emplace, try_emplace, erase, find, at };
+    static constexpr std::size_t operation_count = 5;
+
+    instrumented_avl_tree() = default;
+    explicit instrumented_avl_tree(tree_type tree) : _tree(std::move(tree)) {}
+    instrumented_avl_tree(const instrumented_avl_tree &) = delete;
+    instrumented_avl_tree &operator=(const instrumented_avl_tree &) = delete;
+
+    tree_type &tree() noexcept { return _tree; }
+    const tree_type &tree() const noexcept { return _tree; }
+
+    template <class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return timed(operation::emplace, [&] { return _tree.emplace(std::forward<Args>(args)...); });
+    }
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const key_type &key, Args&&... args) {
+        return timed(operation::try_emplace, [&] { return _tree.try_emplace(key, std::forward<Args>(args)...); });
+    }
+
+    iterator erase(iterator pos) {
+        return timed(operation::erase, [&] { return _tree.erase(pos); });
+    }
+    // Erase the element with the given key. Return the number of the erased elements (zero or one).
+    size_type erase(const key_type &key) {
+        return timed(operation::erase, [&] {
+            auto it = _tree.find(key);
+            if (it == _tree.end())
+                return size_type(0);
+            _tree.erase(it);
+            return size_type(1);
+        });
+    }
+
+    iterator find(const key_type &key) {
+        return timed(operation::find, [&] { return _tree.find(key); });
+    }
+    const_iterator find(const key_type &key) const {
+        return timed(operation::find, [&] { return _tree.find(key); });
+    }
+
+    // Like "find", but throws an exception if the key does not exist. The failed calls are recorded too.
+    val_type &at(const key_type &key) {
+        return timed(operation::at, [&]() -> val_type & { return _tree.at(key); });
+    }
+    const val_type &at(const key_type &key) const {
+        return timed(operation::at, [&]() -> const val_type & { return _tree.at(key); });
+    }
+
+    // The latencies of the operation, merged from all the threads.
+    latency_histogram latencies(operation op) const { return _latencies[static_cast<std::size_t>(op)].merged(); }
+
+    // Only while nothing is recorded.
+    void reset_latencies() noexcept {
+        for (auto &histograms : _latencies)
+            histograms.reset();
+    }
+
+    // Print the number of the calls and the p50, p99, p99.9 and maximum latencies of every recorded operation.
+    void print_latencies(std::ostream &out) const {
+        static constexpr const char *names[operation_count] = {"emplace", "try_emplace", "erase", "find", "at"};
+        for (std::size_t op = 0; op < operation_count; ++op) {
+            const auto histogram = _latencies[op].merged();
+            if (histogram.count() == 0)
+                continue;
+            out << names[op] << ": " << histogram.count() << " calls, p50 " << histogram.percentile(0.5)
+                << " ns, p99 " << histogram.percentile(0.99) << " ns, p99.9 " << histogram.percentile(0.999)
+                << " ns, max " << histogram.max() << " ns\n";
+        }
+    }
+
+private:
+    tree_type _tree{};
+    mutable std::array<thread_latency_histograms, operation_count> _latencies{};
+
+    // Run "fn" and record its latency, even if it throws. Return whatever "fn" returns.
+    template <class Fn>
+    decltype(auto) timed(operation op, Fn &&fn) const {
+        struct recorder {
+            thread_latency_histograms &histograms;
+            std::chrono::steady_clock::time_point start;
+            ~recorder() {
+                const auto elapsed = std::chrono::steady_clock::now() - start;
+                histograms.record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+            }
+        } timer{_latencies[static_cast<std::size_t>(op)], std::chrono::steady_clock::now()};
+        return fn();
+    }
+};
+
+} // end namespace avl
+
+#endif // INSTRUMENTED_AVL_TREE_H
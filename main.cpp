@@ -1,35 +1,30 @@
-#include <chrono>
 #include <iostream>
-#include <map>
+#include <string>
 
 #include "avl_tree.h"
 
+// A short tour of the tree. The timings are in the benchmark suite (benchmark.cpp), and the checks in tests/.
 int main()
 {
-    avl::avl_tree<int> tree;
-    std::map<int, int> map;
-
-    constexpr int size = 1'000'000;
-    auto start_tree = std::chrono::steady_clock::now();
-    for (int i = 0; i < size; ++i)
-        tree.insert({i, i});
-
-    for (int i = 0; i < size; ++i)
-        tree.erase(tree.begin());
-    auto end_tree = std::chrono::steady_clock::now();
-
-    auto start_map = std::chrono::steady_clock::now();
-    for (int i = 0; i < size; ++i)
-        map.insert({i, 1});
-
-    for (int i = 0; i < size; ++i)
-        map.erase(map.begin());
-    auto end_map = std::chrono::steady_clock::now();
-
-    auto elapsed_tree_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_tree - start_tree);
-    auto elapsed_map_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_map - start_map);
-    std::cout << "tree: " << elapsed_tree_ms.count() << "\n";
-    std::cout << "map: " << elapsed_map_ms.count() << "\n";
+    avl::avl_tree<std::string, int> tree;
+    for (const char *word : {"pear", "apple", "plum", "fig", "cherry"})
+        tree.insert({word, static_cast<int>(std::string(word).size())});
+    tree["kiwi"] = 4;
+    tree.erase(tree.find("fig"));
+
+    std::cout << "in order:";
+    for (const auto &[key, value] : tree)
+        std::cout << " " << key << "=" << value;
+    std::cout << "\n";
+
+    std::cout << "first key not less than \"c\": " << tree.lower_bound("c")->first << "\n";
+    std::cout << "contains \"plum\": " << (tree.find("plum") != tree.end() ? "yes" : "no")
+              << ", height " << tree.height() << ", size " << tree.size() << "\n";
+
+    // The upper part of the keys moves to another tree, and back.
+    auto upper = tree.split("kiwi");
+    std::cout << "split at \"kiwi\": " << tree.size() << " + " << upper.size() << " elements\n";
+    tree.join(std::move(upper));
 
     return 0;
 }
@@ -0,0 +1,153 @@
+#ifndef NODE_ARENA_H
+#define NODE_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+namespace avl {
+
+// Contiguous, fixed-capacity storage for the nodes of a single tree. All the nodes are elements of one array,
+// which allows the tree to link them with 32-bit distances instead of pointers (see "detail::relative_links").
+// Such links stay valid when the whole array is copied, so the contents of the arena can be snapshotted with
+// a plain memcpy. Like in the "node_pool", the size of the elements is fixed by the first allocation, freed
+// elements are recycled through a free list, and the requests of a different size (or alignment) are forwarded
+// to the global operator new. Allocating more than "capacity" elements throws std::bad_alloc.
+class node_arena final {
+public:
+    using size_type = std::size_t;
+
+    // Largest number of elements which the 32-bit links can address.
+    static constexpr size_type max_capacity = size_type{1} << 29;
+
+    explicit node_arena(size_type capacity) : _capacity(capacity) {
+        if (capacity == 0 || capacity > max_capacity)
+            throw std::length_error("Invalid arena capacity.\n");
+    }
+    node_arena(const node_arena &) = delete;
+    node_arena &operator=(const node_arena &) = delete;
+
+    void *allocate(size_type size, size_type alignment) {
+        if (!fits(size, alignment))
+            return ::operator new(size, std::align_val_t{alignment});
+
+        // Recycle a freed element if there is one.
+        if (_free_list != no_element) {
+            auto *element = element_at(_free_list);
+            std::memcpy(&_free_list, element, sizeof(_free_list));
+            return element;
+        }
+
+        if (_used == _capacity)
+            throw std::bad_alloc();
+        if (!_storage)
+            _storage.reset(new std::byte[_element_size * _capacity]);
+
+        return element_at(static_cast<index_type>(_used++));
+    }
+
+    void deallocate(void *ptr, size_type size, size_type alignment) noexcept {
+        if (!fits(size, alignment)) {
+            ::operator delete(ptr, std::align_val_t{alignment});
+            return;
+        }
+
+        // The freed element stores the index of the next free element.
+        std::memcpy(ptr, &_free_list, sizeof(_free_list));
+        _free_list = static_cast<index_type>((static_cast<std::byte *>(ptr) - _storage.get()) / _element_size);
+    }
+
+    // Maximum number of elements in the arena.
+    size_type capacity() const noexcept { return _capacity; }
+    // The used part of the arena, which includes the freed elements not allocated again yet.
+    const std::byte *data() const noexcept { return _storage.get(); }
+    size_type size_bytes() const noexcept { return _element_size * _used; }
+
+private:
+    // Freed elements are kept in a list linked through their indices in the array.
+    using index_type = std::uint32_t;
+    static constexpr index_type no_element = std::numeric_limits<index_type>::max();
+
+    // The array of elements, allocated on the first use.
+    std::unique_ptr<std::byte[]> _storage{};
+    // Index of the first element in the list of the elements which were freed and can be reused.
+    index_type _free_list{no_element};
+    // Size of a single element. Zero until the first allocation.
+    size_type _element_size{0};
+    // Number of the elements handed out from the array so far.
+    size_type _used{0};
+    size_type _capacity;
+
+    // Can the request be served from the arena. The first request determines the element size.
+    bool fits(size_type size, size_type alignment) noexcept {
+        if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ || size < sizeof(index_type))
+            return false;
+        if (_element_size == 0)
+            _element_size = size;
+        return size == _element_size;
+    }
+
+    std::byte *element_at(index_type index) const noexcept { return _storage.get() + _element_size * index; }
+};
+
+// Standard allocator interface on top of the "node_arena". Copies of the allocator (including the rebound ones)
+// share the same arena. The "contiguous_storage" member type tells the tree it can use 32-bit node links. The
+// arena is not thread-safe - a single arena should not be used by multiple threads at once.
+template <typename T>
+class arena_allocator final {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using contiguous_storage = std::true_type;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    template <typename U>
+    struct rebind {
+        using other = arena_allocator<U>;
+    };
+
+    // Allocator with an arena of its own, which can hold "capacity" elements.
+    explicit arena_allocator(size_type capacity) : _arena(std::make_shared<node_arena>(capacity)) {}
+    explicit arena_allocator(std::shared_ptr<node_arena> arena) : _arena(std::move(arena)) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U> &other) noexcept : _arena(other.arena()) {}
+
+    T *allocate(size_type n) {
+        if (n != 1)
+            return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t{alignof(T)}));
+        return static_cast<T *>(_arena->allocate(sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, size_type n) noexcept {
+        if (n != 1)
+            ::operator delete(ptr, std::align_val_t{alignof(T)});
+        else
+            _arena->deallocate(ptr, sizeof(T), alignof(T));
+    }
+
+    // Copy constructing a container gives the copy a fresh arena of the same capacity.
+    arena_allocator select_on_container_copy_construction() const { return arena_allocator(_arena->capacity()); }
+
+    const std::shared_ptr<node_arena> &arena() const noexcept { return _arena; }
+
+    template <typename U>
+    friend bool operator==(const arena_allocator &lhs, const arena_allocator<U> &rhs) noexcept { return lhs._arena == rhs.arena(); }
+    template <typename U>
+    friend bool operator!=(const arena_allocator &lhs, const arena_allocator<U> &rhs) noexcept { return lhs._arena != rhs.arena(); }
+
+private:
+    std::shared_ptr<node_arena> _arena;
+};
+
+} // end namespace avl
+
+#endif // NODE_ARENA_H
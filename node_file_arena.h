@@ -0,0 +1,299 @@
+#ifndef NODE_FILE_ARENA_H
+#define NODE_FILE_ARENA_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace avl {
+
+// Like the "node_arena", but the array of the elements lives in a memory-mapped file (POSIX only). The tree
+// links the nodes in the arena with the relative offsets, which stay valid wherever the file gets mapped, so the
+// tree can be reopened from the file, without reading it, after the process restarts. The operating system pages
+// the nodes in and out on demand, so the tree can be larger than the memory.
+//
+// The file starts with a header, which holds the state of the arena (the element size, the capacity, the number
+// of the used elements and the free list), along with the root of the tree and its size, which the tree stores
+// when it is destroyed. The file is sized for the whole capacity up front, but stays sparse until the elements
+// are used. The file is only consistent after the tree is destroyed and the arena is flushed or closed - the
+// changes of a process which crashes in the middle of them are lost or torn.
+class file_arena final {
+public:
+    using size_type = std::size_t;
+
+    // Largest number of elements which the 32-bit links can address.
+    static constexpr size_type max_capacity = size_type{1} << 29;
+
+    // Create the arena file (replacing an existing one) with the room for "capacity" elements.
+    file_arena(const std::string &path, size_type capacity) {
+        if (capacity == 0 || capacity > max_capacity)
+            throw std::length_error("Invalid arena capacity.\n");
+        _file = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (_file < 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot create the arena file");
+        try {
+            map(header_size);
+            std::memcpy(_header->magic, file_magic, sizeof(file_magic));
+            _header->capacity = capacity;
+            _header->free_list = no_element;
+            _header->root = no_element;
+        } catch (...) {
+            close();
+            throw;
+        }
+    }
+
+    // Open the arena file created before. Throws std::runtime_error if its header is not consistent.
+    explicit file_arena(const std::string &path) {
+        _file = ::open(path.c_str(), O_RDWR);
+        if (_file < 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot open the arena file");
+        try {
+            struct stat file_stat {};
+            if (::fstat(_file, &file_stat) != 0)
+                throw std::system_error(errno, std::generic_category(), "Cannot open the arena file");
+            if (static_cast<size_type>(file_stat.st_size) < header_size)
+                throw std::runtime_error("Invalid arena file.\n");
+            map(header_size);
+            if (!valid_header(static_cast<size_type>(file_stat.st_size)))
+                throw std::runtime_error("Invalid arena file.\n");
+            if (_header->element_size != 0)
+                map(file_size());
+        } catch (...) {
+            close();
+            throw;
+        }
+    }
+
+    file_arena(const file_arena &) = delete;
+    file_arena &operator=(const file_arena &) = delete;
+
+    ~file_arena() { close(); }
+
+    // Allocate an element of the given size. All the elements of the arena must have the same size, which the
+    // first allocation determines.
+    void *allocate(size_type size) {
+        check_element_size(size);
+
+        // Recycle a freed element if there is one. The link to the next one comes from the file, so it is checked
+        // before it is followed.
+        if (_header->free_list != no_element) {
+            auto *element = element_at(_header->free_list);
+            index_type next;
+            std::memcpy(&next, element, sizeof(index_type));
+            if (!in_use(next))
+                throw std::runtime_error("Invalid arena file.\n");
+            _header->free_list = next;
+            return element;
+        }
+
+        if (_header->used == _header->capacity)
+            throw std::bad_alloc();
+        return element_at(static_cast<index_type>(_header->used++));
+    }
+
+    void deallocate(void *ptr) noexcept {
+        // The freed element stores the index of the next free element.
+        std::memcpy(ptr, &_header->free_list, sizeof(index_type));
+        _header->free_list = index_of(ptr);
+    }
+
+    // The root stored in the arena (by "store_root"), or nullptr if there is none. Throws if the arena holds the
+    // elements of a different size.
+    void *stored_root(size_type size) {
+        if (_header->root == no_element)
+            return nullptr;
+        check_element_size(size);
+        return element_at(_header->root);
+    }
+    size_type stored_size() const noexcept { return static_cast<size_type>(_header->size); }
+    void store_root(void *root, size_type size) noexcept {
+        _header->root = root ? index_of(root) : no_element;
+        _header->size = size;
+    }
+
+    // Write the changes back to the file, and wait until they are written.
+    void flush() {
+        if (::msync(_mapping, _mapping_size, MS_SYNC) != 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot flush the arena file");
+    }
+
+    // Maximum number of elements in the arena.
+    size_type capacity() const noexcept { return static_cast<size_type>(_header->capacity); }
+    // Number of the elements handed out so far, including the freed ones not allocated again yet.
+    size_type used() const noexcept { return static_cast<size_type>(_header->used); }
+
+private:
+    using index_type = std::uint32_t;
+    static constexpr index_type no_element = std::numeric_limits<index_type>::max();
+    static constexpr char file_magic[8] = {'A', 'V', 'L', 'A', 'R', 'E', 'N', '1'};
+
+    // State of the arena, at the start of the file.
+    struct file_header {
+        char magic[8];
+        std::uint64_t element_size;
+        std::uint64_t capacity;
+        std::uint64_t used;
+        index_type free_list;
+        index_type root;
+        std::uint64_t size;
+    };
+    // The elements start after the header, aligned for any node.
+    static constexpr size_type header_size = 64;
+    static_assert(sizeof(file_header) <= header_size);
+
+    int _file{-1};
+    void *_mapping{nullptr};
+    size_type _mapping_size{0};
+    file_header *_header{nullptr};
+
+    size_type file_size() const noexcept {
+        return header_size + static_cast<size_type>(_header->element_size * _header->capacity);
+    }
+
+    // Is the index that of an element handed out (or the end of a list).
+    bool in_use(index_type index) const noexcept { return index == no_element || index < _header->used; }
+
+    // Does the header read from the file of "actual_size" bytes describe a consistent arena, so that all the
+    // indices in it point into the mapping.
+    bool valid_header(size_type actual_size) const noexcept {
+        const auto &header = *_header;
+        if (std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0 || header.capacity == 0 ||
+            header.capacity > max_capacity || header.used > header.capacity || header.size > header.used ||
+            !in_use(header.free_list) || !in_use(header.root))
+            return false;
+        // Before the first allocation, the arena holds nothing.
+        if (header.element_size == 0)
+            return header.used == 0 && actual_size == header_size;
+        // The element size comes from the file as well, so the file size must be computed without overflowing.
+        if (header.element_size < sizeof(index_type) ||
+            header.element_size > (std::numeric_limits<size_type>::max() - header_size) / header.capacity)
+            return false;
+        return actual_size == file_size();
+    }
+
+    // Resize the file to "size" bytes, and map all of it. Only called before there are any elements, or right
+    // after opening the file, so the elements do not move.
+    void map(size_type size) {
+        struct stat file_stat {};
+        if (::fstat(_file, &file_stat) != 0 ||
+            (static_cast<size_type>(file_stat.st_size) < size && ::ftruncate(_file, static_cast<off_t>(size)) != 0))
+            throw std::system_error(errno, std::generic_category(), "Cannot resize the arena file");
+        auto *mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _file, 0);
+        if (mapping == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "Cannot map the arena file");
+        if (_mapping)
+            ::munmap(_mapping, _mapping_size);
+        _mapping = mapping;
+        _mapping_size = size;
+        _header = static_cast<file_header *>(_mapping);
+    }
+
+    void close() noexcept {
+        if (_mapping)
+            ::munmap(_mapping, _mapping_size);
+        if (_file >= 0)
+            ::close(_file);
+        _mapping = nullptr;
+        _file = -1;
+    }
+
+    // The first allocation determines the element size, and the whole capacity gets mapped then.
+    void check_element_size(size_type size) {
+        if (_header->element_size == 0) {
+            if (size < sizeof(index_type))
+                throw std::invalid_argument("The arena elements are too small.\n");
+            _header->element_size = size;
+            try {
+                map(file_size());
+            } catch (...) {
+                _header->element_size = 0;
+                throw;
+            }
+        } else if (size != _header->element_size) {
+            throw std::invalid_argument("The arena file holds the nodes of a different type.\n");
+        }
+    }
+
+    std::byte *element_at(index_type index) const noexcept {
+        return static_cast<std::byte *>(_mapping) + header_size + _header->element_size * index;
+    }
+    index_type index_of(const void *ptr) const noexcept {
+        return static_cast<index_type>((static_cast<const std::byte *>(ptr) - element_at(0)) / _header->element_size);
+    }
+};
+
+// Standard allocator interface on top of the "file_arena". Copies of the allocator (including the rebound ones)
+// share the same arena. Besides the "contiguous_storage" member type, which gives the tree the 32-bit node links,
+// it defines "persistent_storage": the tree then takes over the nodes stored in the arena when it is constructed,
+// and leaves its nodes in the arena when it is destroyed, instead of freeing them. Only one tree at a time can use
+// the arena (the trees split off it are not stored), and such a tree cannot be copied. The arena is not
+// thread-safe.
+template <typename T>
+class file_arena_allocator final {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using contiguous_storage = std::true_type;
+    using persistent_storage = std::true_type;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+    static_assert(alignof(T) <= 16, "The arena elements are aligned to 16 bytes.");
+
+    template <typename U>
+    struct rebind {
+        using other = file_arena_allocator<U>;
+    };
+
+    explicit file_arena_allocator(std::shared_ptr<file_arena> arena) : _arena(std::move(arena)) {}
+    template <typename U>
+    file_arena_allocator(const file_arena_allocator<U> &other) noexcept : _arena(other.arena()) {}
+
+    // Only single elements can be allocated - the tree allocates nothing else.
+    T *allocate(size_type n) {
+        if (n != 1)
+            throw std::invalid_argument("The arena allocates single elements only.\n");
+        return static_cast<T *>(_arena->allocate(sizeof(T)));
+    }
+
+    void deallocate(T *ptr, size_type) noexcept { _arena->deallocate(ptr); }
+
+    // The root node and the size of the tree stored in the arena.
+    T *stored_root() const { return static_cast<T *>(_arena->stored_root(sizeof(T))); }
+    size_type stored_size() const noexcept { return _arena->stored_size(); }
+    void store_root(T *root, size_type size) noexcept { _arena->store_root(root, size); }
+
+    const std::shared_ptr<file_arena> &arena() const noexcept { return _arena; }
+
+    template <typename U>
+    friend bool operator==(const file_arena_allocator &lhs, const file_arena_allocator<U> &rhs) noexcept {
+        return lhs._arena == rhs.arena();
+    }
+    template <typename U>
+    friend bool operator!=(const file_arena_allocator &lhs, const file_arena_allocator<U> &rhs) noexcept {
+        return lhs._arena != rhs.arena();
+    }
+
+private:
+    std::shared_ptr<file_arena> _arena;
+};
+
+} // end namespace avl
+
+#endif // NODE_FILE_ARENA_H
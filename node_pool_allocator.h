@@ -0,0 +1,158 @@
+#ifndef NODE_POOL_ALLOCATOR_H
+#define NODE_POOL_ALLOCATOR_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace avl {
+
+// Slab allocator for fixed-size blocks. Blocks are carved out of contiguous chunks, and freed blocks are kept
+// in an intrusive free list so they can be handed out again without going through the global heap. The block
+// size is fixed by the first allocation - a container only ever allocates nodes of a single type, so this is
+// all we need. Requests of a different size (or alignment) are forwarded to the global operator new.
+class node_pool final {
+public:
+    using size_type = std::size_t;
+
+    // Number of blocks in the first chunk. Every subsequent chunk is twice as large, up to "max_chunk_blocks".
+    static constexpr size_type min_chunk_blocks = 64;
+    static constexpr size_type max_chunk_blocks = 64 * 1024;
+
+    node_pool() = default;
+    node_pool(const node_pool &) = delete;
+    node_pool &operator=(const node_pool &) = delete;
+
+    void *allocate(size_type size, size_type alignment) {
+        if (!fits(size, alignment))
+            return ::operator new(size, std::align_val_t{alignment});
+
+        // Recycle a freed block if there is one.
+        if (_free_list) {
+            auto *block = _free_list;
+            _free_list = block->_next;
+            return block;
+        }
+
+        if (_chunk_cursor == _chunk_end)
+            allocate_chunk();
+
+        void *block = _chunk_cursor;
+        _chunk_cursor += _block_size;
+        return block;
+    }
+
+    void deallocate(void *ptr, size_type size, size_type alignment) noexcept {
+        if (!fits(size, alignment)) {
+            ::operator delete(ptr, std::align_val_t{alignment});
+            return;
+        }
+
+        // Freed blocks are never returned to the heap before the pool itself is destroyed.
+        auto *block = static_cast<free_block *>(ptr);
+        block->_next = _free_list;
+        _free_list = block;
+    }
+
+private:
+    // A freed block is reused to store the link to the next free block.
+    struct free_block final {
+        free_block *_next;
+    };
+
+    // Chunks owned by the pool. They are released all at once when the pool is destroyed.
+    std::vector<std::unique_ptr<std::byte[]>> _chunks{};
+    // Head of the list of the blocks which were freed and can be reused.
+    free_block *_free_list{nullptr};
+    // Range of the never used blocks in the most recently allocated chunk.
+    std::byte *_chunk_cursor{nullptr};
+    std::byte *_chunk_end{nullptr};
+    // Size of a single block. Zero until the first allocation.
+    size_type _block_size{0};
+    // Number of blocks in the next chunk.
+    size_type _chunk_blocks{min_chunk_blocks};
+
+    // Can the request be served from the pool. The first request determines the block size.
+    bool fits(size_type size, size_type alignment) noexcept {
+        if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            return false;
+        if (_block_size == 0)
+            _block_size = block_size_for(size);
+        return block_size_for(size) == _block_size;
+    }
+
+    // Every block must be able to hold the free list link and keep the subsequent blocks aligned.
+    static constexpr size_type block_size_for(size_type size) noexcept {
+        constexpr size_type align = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+        size = size < sizeof(free_block) ? sizeof(free_block) : size;
+        return (size + align - 1) / align * align;
+    }
+
+    void allocate_chunk() {
+        _chunks.emplace_back(new std::byte[_block_size * _chunk_blocks]);
+        _chunk_cursor = _chunks.back().get();
+        _chunk_end = _chunk_cursor + _block_size * _chunk_blocks;
+        if (_chunk_blocks < max_chunk_blocks)
+            _chunk_blocks *= 2;
+    }
+};
+
+// Standard allocator interface on top of the "node_pool". Copies of the allocator (including the rebound ones)
+// share the same pool, so the nodes can be freed through any of them. Default constructed allocators get a pool
+// of their own. The pool is not thread-safe - a single pool should not be used by multiple threads at once.
+template <typename T>
+class node_pool_allocator final {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    template <typename U>
+    struct rebind {
+        using other = node_pool_allocator<U>;
+    };
+
+    node_pool_allocator() : _pool(std::make_shared<node_pool>()) {}
+    explicit node_pool_allocator(std::shared_ptr<node_pool> pool) : _pool(std::move(pool)) {}
+    template <typename U>
+    node_pool_allocator(const node_pool_allocator<U> &other) noexcept : _pool(other._pool) {}
+
+    T *allocate(size_type n) {
+        if (n != 1)
+            return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t{alignof(T)}));
+        return static_cast<T *>(_pool->allocate(sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, size_type n) noexcept {
+        if (n != 1)
+            ::operator delete(ptr, std::align_val_t{alignof(T)});
+        else
+            _pool->deallocate(ptr, sizeof(T), alignof(T));
+    }
+
+    // Copy constructing a container gives the copy a fresh pool, rather than sharing the source's pool.
+    node_pool_allocator select_on_container_copy_construction() const { return node_pool_allocator(); }
+
+    const std::shared_ptr<node_pool> &pool() const noexcept { return _pool; }
+
+    template <typename U>
+    friend bool operator==(const node_pool_allocator &lhs, const node_pool_allocator<U> &rhs) noexcept { return lhs._pool == rhs.pool(); }
+    template <typename U>
+    friend bool operator!=(const node_pool_allocator &lhs, const node_pool_allocator<U> &rhs) noexcept { return lhs._pool != rhs.pool(); }
+
+private:
+    template <typename U>
+    friend class node_pool_allocator;
+
+    std::shared_ptr<node_pool> _pool;
+};
+
+} // end namespace avl
+
+#endif // NODE_POOL_ALLOCATOR_H
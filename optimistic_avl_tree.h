@@ -0,0 +1,873 @@
+#ifndef OPTIMISTIC_AVL_TREE_H
+#define OPTIMISTIC_AVL_TREE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+
+#include "avl_tree.h"
+
+namespace avl {
+
+// Concurrent AVL tree with optimistic concurrency control, after N. G. Bronson et al., "A Practical Concurrent
+// Binary Search Tree" (PPoPP 2010). Readers never block and write nothing to the nodes, only the announcement of
+// their epoch (see below). Instead of locking, every node carries a version number, which changes whenever a
+// rotation moves the node down the tree, and the readers descend hand-over-hand, validating that the version of
+// the parent has not changed after reading the link to the child. Writers lock only the nodes they link, unlink or
+// rotate, always in the top-down order.
+//
+// Unlike the "avl_tree", the balance is relaxed - the heights of the nodes are fixed up after the modification,
+// and a node may be briefly out of balance while a concurrent writer is on its way up to fix it. The erased nodes
+// with two children stay in the tree as routing nodes without a value, and are unlinked once they have at most
+// one child. Readers may still be passing through the unlinked nodes, so these are freed with the epoch-based
+// reclamation: every lookup and modification announces the current epoch for its duration, and the epoch advances
+// once all the operations in progress have announced it. A node unlinked in an epoch is freed when the epoch has
+// advanced twice since, as no operation which could have reached it is left by then. The modifications advance
+// the epoch once enough of the unlinked nodes pile up, so their number stays bounded, unless an operation stalls.
+//
+// The values are copied without locking, so they must be trivially copyable, and the lookups return the copies. Like
+// in the "avl_tree", the comparator may be a three-way one (see "three_way_compare").
+template <typename Key, typename T, typename Cmp = std::less<Key>>
+class optimistic_avl_tree final {
+    static_assert(std::is_trivially_copyable_v<T> && std::is_default_constructible_v<T>,
+                  "The values are copied without locking, so they must be trivially copyable (and default constructible).");
+
+public:
+    using size_type = std::size_t;
+    using key_type = Key;
+    using val_type = T;
+    using cmp_type = Cmp;
+
+    optimistic_avl_tree() = default;
+    explicit optimistic_avl_tree(const cmp_type &comparator) : _comparator(comparator) {}
+    optimistic_avl_tree(const optimistic_avl_tree &) = delete;
+    optimistic_avl_tree &operator=(const optimistic_avl_tree &) = delete;
+
+    ~optimistic_avl_tree() {
+        destroy_subtree(_holder._right.load());
+        reclaim();
+    }
+
+    // Number of the elements. Exact only when there are no concurrent modifications.
+    size_type size() const noexcept { return _size.load(); }
+    bool empty() const noexcept { return size() == 0; }
+
+    // Return the copy of the value tied to the key, or nothing if the key does not exist.
+    std::optional<val_type> find(const key_type &key) const {
+        epoch_guard guard(*this);
+        for (;;) {
+            auto *root = _holder._right.load();
+            if (!root)
+                return std::nullopt;
+            const int dir = compare(key, root);
+            if (dir == 0)
+                return value_of(root);
+            const auto version = root->_version.load();
+            if (shrinking_or_unlinked(version))
+                wait_until_not_changing(root);
+            else if (root == _holder._right.load()) {
+                std::optional<val_type> result;
+                if (attempt_find(key, root, dir, version, result))
+                    return result;
+            }
+        }
+    }
+    bool contains(const key_type &key) const { return find(key).has_value(); }
+
+    // Insert the element, unless its key already exists. Return true if the element was inserted.
+    bool insert(const key_type &key, const val_type &value) { return !update(key, update_mode::insert, value); }
+    // Insert the element, or assign the value to the existing element. Return the previous value, if there was one.
+    std::optional<val_type> insert_or_assign(const key_type &key, const val_type &value) {
+        return update(key, update_mode::assign, value);
+    }
+    // Erase the element with the given key. Return its value, if there was one.
+    std::optional<val_type> erase(const key_type &key) { return update(key, update_mode::erase, val_type{}); }
+
+    // Call "fn" with the key and the value of every element, in the key order. Must not run concurrently with
+    // the modifications.
+    template <class Fn>
+    void for_each(Fn &&fn) const {
+        for_each_in_subtree(_holder._right.load(), fn);
+    }
+
+    // Free all the nodes unlinked from the tree so far, without waiting for the epochs to advance. Must not run
+    // concurrently with any other use of the tree.
+    void reclaim() noexcept {
+        for (auto &retired : _retired)
+            free_retired(retired.exchange(nullptr));
+    }
+
+    // Number of the nodes unlinked from the tree, which are not freed yet, and the memory taken by a node.
+    size_type unreclaimed() const noexcept { return _unreclaimed.load(std::memory_order_relaxed); }
+    static constexpr std::size_t node_bytes() noexcept { return sizeof(Node); }
+
+private:
+    // Version of a node. The "shrinking" bit is set while the node is being rotated down the tree, and the count
+    // in the higher bits is incremented once the rotation is over. The version of an unlinked node stays
+    // "unlinked_version".
+    using version_type = std::uint64_t;
+    static constexpr version_type unlinked_version = 1;
+    static constexpr version_type shrinking_bit = 2;
+    static constexpr version_type shrink_count_increment = 4;
+
+    // Links, height and version of a node. The root holder (whose right child is the root) has nothing else.
+    struct node_base {
+        std::atomic<version_type> _version{0};
+        std::atomic<int> _height{1};
+        std::atomic<node_base *> _parent{nullptr};
+        std::atomic<node_base *> _left{nullptr};
+        std::atomic<node_base *> _right{nullptr};
+        // Next node in the list of the unlinked nodes, waiting for their epoch to be freed.
+        node_base *_retired_next{nullptr};
+        std::mutex _mutex;
+
+        // The direction is negative for the left child, and positive for the right one.
+        node_base *child(int dir) const noexcept { return dir < 0 ? _left.load() : _right.load(); }
+        void set_child(int dir, node_base *child) noexcept { (dir < 0 ? _left : _right).store(child); }
+    };
+
+    // Value of a node, which the readers copy while it may be assigned. It is stored in the atomic words, and the
+    // copy is validated against the sequence number, which is odd while the value is being written. The sequence
+    // number also tells whether the value is present at all - the value of the routing node is not.
+    class value_cell {
+    public:
+        explicit value_cell(const val_type &value) noexcept { store(value); }
+
+        bool present() const noexcept { return _sequence.load() & present_bit; }
+
+        std::optional<val_type> load() const noexcept {
+            for (;;) {
+                const auto sequence = _sequence.load(std::memory_order_acquire);
+                if (sequence & writing_bit) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                if (!(sequence & present_bit))
+                    return std::nullopt;
+                std::uintptr_t words[word_count];
+                // The acquire loads keep the sequence number from being read before the words.
+                for (std::size_t i = 0; i < word_count; ++i)
+                    words[i] = _words[i].load(std::memory_order_acquire);
+                if (_sequence.load(std::memory_order_relaxed) == sequence) {
+                    val_type value;
+                    std::memcpy(&value, words, sizeof(val_type));
+                    return value;
+                }
+            }
+        }
+
+        // The writers hold the lock of the node.
+        void store(const val_type &value) noexcept {
+            const auto sequence = _sequence.load(std::memory_order_relaxed);
+            _sequence.store(sequence | writing_bit, std::memory_order_relaxed);
+            std::uintptr_t words[word_count]{};
+            std::memcpy(words, &value, sizeof(val_type));
+            // The release stores keep the words from being written before the odd sequence number.
+            for (std::size_t i = 0; i < word_count; ++i)
+                _words[i].store(words[i], std::memory_order_release);
+            _sequence.store((sequence | present_bit) + sequence_increment, std::memory_order_release);
+        }
+        void reset() noexcept { _sequence.store((_sequence.load() & ~present_bit) + sequence_increment); }
+
+    private:
+        static constexpr std::uint64_t writing_bit = 1;
+        static constexpr std::uint64_t present_bit = 2;
+        static constexpr std::uint64_t sequence_increment = 4;
+        static constexpr std::size_t word_count = (sizeof(val_type) + sizeof(std::uintptr_t) - 1) / sizeof(std::uintptr_t);
+
+        std::atomic<std::uint64_t> _sequence{0};
+        std::atomic<std::uintptr_t> _words[word_count]{};
+    };
+
+    struct Node final : node_base {
+        const key_type _key;
+        value_cell _value;
+
+        Node(const key_type &key, const val_type &value, node_base *parent) : _key(key), _value(value) {
+            this->_parent.store(parent);
+        }
+    };
+
+    // Conditions of a node found by "node_condition", other than the height it should have.
+    static constexpr int unlink_required = -1;
+    static constexpr int rebalance_required = -2;
+    static constexpr int nothing_required = -3;
+
+    enum class update_mode { insert, assign, erase };
+
+    // Number of the operations which can run at once. Beyond that, the operations wait for a free slot.
+    static constexpr std::size_t epoch_slot_count = 64;
+    // Number of the unlinked nodes above which the modifications try to advance the epoch.
+    static constexpr size_type reclaim_threshold = 1024;
+
+    // Epoch announced by an operation in progress, or zero if the slot is free. Each slot is on a cache line of its
+    // own, so that the operations in different slots do not contend.
+    struct alignas(64) epoch_slot {
+        std::atomic<std::uint64_t> _epoch{0};
+    };
+
+    // Announcement of the epoch, for the duration of an operation.
+    class epoch_guard {
+    public:
+        explicit epoch_guard(const optimistic_avl_tree &tree) noexcept : _slot(tree.enter_epoch()) {}
+        epoch_guard(const epoch_guard &) = delete;
+        epoch_guard &operator=(const epoch_guard &) = delete;
+        ~epoch_guard() { _slot->_epoch.store(0, std::memory_order_release); }
+
+    private:
+        epoch_slot *_slot;
+    };
+
+    node_base _holder{};
+    std::atomic<size_type> _size{0};
+    cmp_type _comparator{};
+    static constexpr bool three_way = detail::is_three_way<cmp_type>::value;
+
+    // The current epoch, the slots announcing it, and the lists of the nodes unlinked in the last three epochs
+    // (indexed by the epoch modulo three).
+    std::atomic<std::uint64_t> _epoch{1};
+    mutable epoch_slot _epoch_slots[epoch_slot_count];
+    std::atomic<node_base *> _retired[3]{};
+    std::atomic<size_type> _unreclaimed{0};
+    // Held by the thread advancing the epoch, which then frees the oldest list.
+    std::mutex _reclaim_mutex;
+
+    static Node *as_node(node_base *node) noexcept { return static_cast<Node *>(node); }
+    static const Node *as_node(const node_base *node) noexcept { return static_cast<const Node *>(node); }
+    static int height(const node_base *node) noexcept { return node ? node->_height.load() : 0; }
+    static bool present(const node_base *node) noexcept { return as_node(node)->_value.present(); }
+    static bool unlinked(const node_base *node) noexcept { return node->_version.load() == unlinked_version; }
+    static bool shrinking_or_unlinked(version_type version) noexcept {
+        return (version & (shrinking_bit | unlinked_version)) != 0;
+    }
+    static std::optional<val_type> value_of(const node_base *node) noexcept { return as_node(node)->_value.load(); }
+
+    // Direction from the node to the given key, or zero if the node holds the key. The three-way comparator
+    // gives it in a single call.
+    int compare(const key_type &key, const node_base *node) const {
+        const auto &node_key = as_node(node)->_key;
+        if constexpr (three_way) {
+            const int order = _comparator(key, node_key);
+            return order < 0 ? -1 : (order > 0 ? 1 : 0);
+        } else
+            return _comparator(key, node_key) ? -1 : (_comparator(node_key, key) ? 1 : 0);
+    }
+
+    // Wait until the rotation of the node (if any) is over.
+    static void wait_until_not_changing(const node_base *node) noexcept {
+        const auto version = node->_version.load();
+        if (version & shrinking_bit) {
+            while (node->_version.load() == version)
+                std::this_thread::yield();
+        }
+    }
+
+    // Continue the search from the "node" of the given version towards "dir". Returns false if the node has
+    // changed in the meantime, and the search has to be retried from its parent.
+    bool attempt_find(const key_type &key, const node_base *node, int dir, version_type version,
+                      std::optional<val_type> &result) const {
+        for (;;) {
+            const auto *child = node->child(dir);
+            if (!child) {
+                if (node->_version.load() != version)
+                    return false;
+                result = std::nullopt;
+                return true;
+            }
+
+            const int child_dir = compare(key, child);
+            if (child_dir == 0) {
+                result = value_of(child);
+                return true;
+            }
+
+            // The link to the child must have been valid when we read it - the node must not have been
+            // rotated down or unlinked since we validated the link to it.
+            const auto child_version = child->_version.load();
+            if (shrinking_or_unlinked(child_version)) {
+                wait_until_not_changing(child);
+                if (node->_version.load() != version)
+                    return false;
+            } else if (child != node->child(dir)) {
+                if (node->_version.load() != version)
+                    return false;
+            } else {
+                if (node->_version.load() != version)
+                    return false;
+                if (attempt_find(key, child, child_dir, child_version, result))
+                    return true;
+            }
+        }
+    }
+
+    // Take a free slot and announce the current epoch in it. Once the slot is taken, the epoch is read again, so
+    // that the announcement is not stale when the operation starts reading the nodes.
+    epoch_slot *enter_epoch() const noexcept {
+        // The threads start looking at different slots.
+        static std::atomic<std::size_t> next_thread{0};
+        thread_local const std::size_t first_slot = next_thread.fetch_add(1, std::memory_order_relaxed);
+
+        auto epoch = _epoch.load();
+        for (std::size_t i = first_slot;; ++i) {
+            auto &slot = _epoch_slots[i % epoch_slot_count];
+            std::uint64_t expected = 0;
+            if (slot._epoch.load(std::memory_order_relaxed) == 0 && slot._epoch.compare_exchange_strong(expected, epoch)) {
+                for (auto current = _epoch.load(); current != epoch; current = _epoch.load()) {
+                    epoch = current;
+                    slot._epoch.store(epoch);
+                }
+                return &slot;
+            }
+            if ((i + 1 - first_slot) % epoch_slot_count == 0)
+                std::this_thread::yield();
+        }
+    }
+
+    // Advance the epoch, if all the operations in progress have announced the current one, and free the nodes
+    // unlinked two epochs ago - no operation which could have reached them is left. Only one thread at a time
+    // advances the epoch, and the others skip it. The nodes are only unlinked in the announced epoch or the next
+    // one, so nothing is added to the freed list meanwhile.
+    void try_reclaim() noexcept {
+        std::unique_lock lock(_reclaim_mutex, std::try_to_lock);
+        if (!lock)
+            return;
+        const auto epoch = _epoch.load();
+        for (const auto &slot : _epoch_slots) {
+            const auto announced = slot._epoch.load();
+            if (announced != 0 && announced != epoch)
+                return;
+        }
+        _epoch.store(epoch + 1);
+        free_retired(_retired[(epoch + 2) % 3].exchange(nullptr));
+    }
+
+    void free_retired(node_base *node) noexcept {
+        size_type freed = 0;
+        while (node) {
+            auto *next = node->_retired_next;
+            delete as_node(node);
+            node = next;
+            ++freed;
+        }
+        _unreclaimed.fetch_sub(freed, std::memory_order_relaxed);
+    }
+
+    // Insert, assign or erase the element, and return the previous value. The unlinked nodes are reclaimed once
+    // the operation has left its epoch.
+    std::optional<val_type> update(const key_type &key, update_mode mode, const val_type &value) {
+        std::optional<val_type> previous;
+        {
+            epoch_guard guard(*this);
+            previous = update_in_epoch(key, mode, value);
+        }
+        if (_unreclaimed.load(std::memory_order_relaxed) >= reclaim_threshold)
+            try_reclaim();
+        return previous;
+    }
+
+    std::optional<val_type> update_in_epoch(const key_type &key, update_mode mode, const val_type &value) {
+        for (;;) {
+            auto *root = _holder._right.load();
+            if (!root) {
+                if (mode == update_mode::erase)
+                    return std::nullopt;
+                std::lock_guard lock(_holder._mutex);
+                if (!_holder._right.load()) {
+                    _holder._right.store(new Node(key, value, &_holder));
+                    ++_size;
+                    return std::nullopt;
+                }
+            } else {
+                const auto version = root->_version.load();
+                if (shrinking_or_unlinked(version))
+                    wait_until_not_changing(root);
+                else if (root == _holder._right.load()) {
+                    std::optional<val_type> previous;
+                    if (attempt_update(key, mode, value, &_holder, root, version, previous))
+                        return previous;
+                }
+            }
+        }
+    }
+
+    // Continue the update from the "node" of the given version. Returns false if the update has to be retried
+    // from the parent.
+    bool attempt_update(const key_type &key, update_mode mode, const val_type &value, node_base *parent, node_base *node,
+                        version_type version, std::optional<val_type> &previous) {
+        const int dir = compare(key, node);
+        if (dir == 0)
+            return attempt_node_update(mode, value, parent, node, previous);
+
+        for (;;) {
+            auto *child = node->child(dir);
+            if (node->_version.load() != version)
+                return false;
+
+            if (!child) {
+                if (mode == update_mode::erase) {
+                    previous = std::nullopt;
+                    return true;
+                }
+
+                node_base *damaged;
+                {
+                    std::lock_guard lock(node->_mutex);
+                    if (node->_version.load() != version)
+                        return false;
+                    // Somebody else has inserted the child in the meantime.
+                    if (node->child(dir))
+                        continue;
+                    node->set_child(dir, new Node(key, value, node));
+                    damaged = fix_height_nl(node);
+                }
+                ++_size;
+                fix_height_and_rebalance(damaged);
+                previous = std::nullopt;
+                return true;
+            }
+
+            const auto child_version = child->_version.load();
+            if (shrinking_or_unlinked(child_version))
+                wait_until_not_changing(child);
+            else if (child == node->child(dir)) {
+                if (node->_version.load() != version)
+                    return false;
+                if (attempt_update(key, mode, value, node, child, child_version, previous))
+                    return true;
+            }
+        }
+    }
+
+    // Update the node which holds the key. Returns false if the update has to be retried from the parent.
+    bool attempt_node_update(update_mode mode, const val_type &value, node_base *parent, node_base *node,
+                             std::optional<val_type> &previous) {
+        auto &cell = as_node(node)->_value;
+        if (mode != update_mode::erase) {
+            std::lock_guard lock(node->_mutex);
+            if (unlinked(node))
+                return false;
+            previous = value_of(node);
+            if (!previous)
+                ++_size;
+            if (!previous || mode == update_mode::assign)
+                cell.store(value);
+            return true;
+        }
+
+        if (!present(node)) {
+            previous = std::nullopt;
+            return true;
+        }
+
+        // The node with two children just loses its value, and stays in the tree as a routing node.
+        if (node->_left.load() && node->_right.load()) {
+            std::lock_guard lock(node->_mutex);
+            if (unlinked(node) || !node->_left.load() || !node->_right.load())
+                return false;
+            previous = value_of(node);
+            if (previous) {
+                cell.reset();
+                --_size;
+            }
+            return true;
+        }
+
+        {
+            std::lock_guard parent_lock(parent->_mutex);
+            if (unlinked(parent) || node->_parent.load() != parent || unlinked(node))
+                return false;
+            std::lock_guard lock(node->_mutex);
+            previous = value_of(node);
+            if (!previous)
+                return true;
+            cell.reset();
+            --_size;
+            // If the node has gained the second child in the meantime, it stays as a routing node.
+            attempt_unlink_nl(parent, node);
+        }
+        fix_height_and_rebalance(parent);
+        return true;
+    }
+
+    // Unlink the node with at most one child from its (locked) parent. Returns false if the node is no longer
+    // the parent's child, or if it has two children.
+    bool attempt_unlink_nl(node_base *parent, node_base *node) noexcept {
+        auto *parent_left = parent->_left.load();
+        if (parent_left != node && parent->_right.load() != node)
+            return false;
+        auto *left = node->_left.load();
+        auto *right = node->_right.load();
+        if (left && right)
+            return false;
+
+        auto *splice = left ? left : right;
+        if (parent_left == node)
+            parent->_left.store(splice);
+        else
+            parent->_right.store(splice);
+        if (splice)
+            splice->_parent.store(parent);
+
+        node->_version.store(unlinked_version);
+        as_node(node)->_value.reset();
+        retire(node);
+        return true;
+    }
+
+    // Add the unlinked node to the list of the nodes to be freed, for the current epoch.
+    void retire(node_base *node) noexcept {
+        // Counted first, so that the count does not drop below zero if the node is freed right away.
+        _unreclaimed.fetch_add(1, std::memory_order_relaxed);
+        auto &retired = _retired[_epoch.load() % 3];
+        node->_retired_next = retired.load();
+        while (!retired.compare_exchange_weak(node->_retired_next, node)) {
+        }
+    }
+
+    // What has to be done with the node - unlink it, rebalance it, set its height, or nothing.
+    static int node_condition(node_base *node) noexcept {
+        // The root holder has nothing to fix.
+        if (!node->_parent.load())
+            return nothing_required;
+
+        auto *left = node->_left.load();
+        auto *right = node->_right.load();
+        if ((!left || !right) && !present(node))
+            return unlink_required;
+
+        const int left_height = height(left);
+        const int right_height = height(right);
+        const int balance = left_height - right_height;
+        if (balance < -1 || balance > 1)
+            return rebalance_required;
+        const int new_height = 1 + std::max(left_height, right_height);
+        return node->_height.load() != new_height ? new_height : nothing_required;
+    }
+
+    // Go up the tree from the damaged node, fixing the heights, rotating the unbalanced nodes and unlinking the
+    // unnecessary routing nodes, until there is nothing left to fix. A rotation fixes the deepest damage first, and
+    // may leave the nodes above it to be fixed later, so once anything has been rotated or unlinked, the rest of
+    // the way up to the root is checked as well.
+    void fix_height_and_rebalance(node_base *node) noexcept {
+        bool to_root = false;
+        while (node && node->_parent.load()) {
+            node_base *next;
+            const int condition = unlinked(node) ? nothing_required : node_condition(node);
+            if (condition == nothing_required) {
+                next = nullptr;
+            } else if (condition != unlink_required && condition != rebalance_required) {
+                std::lock_guard lock(node->_mutex);
+                next = fix_height_nl(node);
+            } else {
+                to_root = true;
+                next = node;
+                auto *parent = node->_parent.load();
+                std::lock_guard parent_lock(parent->_mutex);
+                if (!unlinked(parent) && node->_parent.load() == parent) {
+                    std::lock_guard lock(node->_mutex);
+                    next = rebalance_nl(parent, node);
+                }
+            }
+            // The unlinked node still points to its last parent.
+            node = next || !to_root ? next : node->_parent.load();
+        }
+    }
+
+    // Fix the height of the (locked) node. Returns the next node to fix, if any.
+    static node_base *fix_height_nl(node_base *node) noexcept {
+        const int condition = node_condition(node);
+        switch (condition) {
+        case rebalance_required:
+        case unlink_required:
+            return node;
+        case nothing_required:
+            return nullptr;
+        default:
+            node->_height.store(condition);
+            return node->_parent.load();
+        }
+    }
+
+    // Rebalance or unlink the node. Both the node and its parent are locked. Returns the next node to fix, if any.
+    node_base *rebalance_nl(node_base *parent, node_base *node) noexcept {
+        auto *left = node->_left.load();
+        auto *right = node->_right.load();
+        if ((!left || !right) && !present(node))
+            return attempt_unlink_nl(parent, node) ? fix_height_nl(parent) : node;
+
+        const int left_height = height(left);
+        const int right_height = height(right);
+        const int balance = left_height - right_height;
+        if (balance > 1)
+            return rebalance_to_right_nl(parent, node, left, right_height);
+        if (balance < -1)
+            return rebalance_to_left_nl(parent, node, right, left_height);
+
+        const int new_height = 1 + std::max(left_height, right_height);
+        if (node->_height.load() != new_height) {
+            node->_height.store(new_height);
+            return fix_height_nl(parent);
+        }
+        return nullptr;
+    }
+
+    // The left subtree of the node is too tall. Rotate the node right, or its left child left first, if the
+    // left child's right subtree is the taller one.
+    node_base *rebalance_to_right_nl(node_base *parent, node_base *node, node_base *left, int right_height) noexcept {
+        std::lock_guard left_lock(left->_mutex);
+        if (left->_height.load() - right_height <= 1)
+            return node;
+
+        auto *left_right = left->_right.load();
+        const int left_left_height = height(left->_left.load());
+        const int left_right_height = height(left_right);
+        if (left_left_height >= left_right_height)
+            return rotate_right_nl(parent, node, left, right_height, left_left_height, left_right, left_right_height);
+
+        {
+            std::lock_guard left_right_lock(left_right->_mutex);
+            const int locked_left_right_height = left_right->_height.load();
+            if (left_left_height >= locked_left_right_height) {
+                return rotate_right_nl(parent, node, left, right_height, left_left_height, left_right,
+                                       locked_left_right_height);
+            }
+
+            // The double rotation must not leave the left child unbalanced.
+            const int left_right_left_height = height(left_right->_left.load());
+            const int balance = left_left_height - left_right_left_height;
+            if (balance >= -1 && balance <= 1) {
+                return rotate_right_over_left_nl(parent, node, left, right_height, left_left_height, left_right,
+                                                 left_right_left_height);
+            }
+        }
+        return rebalance_to_left_nl(node, left, left_right, left_left_height);
+    }
+
+    // Mirror image of "rebalance_to_right_nl".
+    node_base *rebalance_to_left_nl(node_base *parent, node_base *node, node_base *right, int left_height) noexcept {
+        std::lock_guard right_lock(right->_mutex);
+        if (right->_height.load() - left_height <= 1)
+            return node;
+
+        auto *right_left = right->_left.load();
+        const int right_left_height = height(right_left);
+        const int right_right_height = height(right->_right.load());
+        if (right_right_height >= right_left_height)
+            return rotate_left_nl(parent, node, left_height, right, right_left, right_left_height, right_right_height);
+
+        {
+            std::lock_guard right_left_lock(right_left->_mutex);
+            const int locked_right_left_height = right_left->_height.load();
+            if (right_right_height >= locked_right_left_height) {
+                return rotate_left_nl(parent, node, left_height, right, right_left, locked_right_left_height,
+                                      right_right_height);
+            }
+
+            const int right_left_right_height = height(right_left->_right.load());
+            const int balance = right_right_height - right_left_right_height;
+            if (balance >= -1 && balance <= 1) {
+                return rotate_left_over_right_nl(parent, node, left_height, right, right_left, right_right_height,
+                                                 right_left_right_height);
+            }
+        }
+        return rebalance_to_right_nl(node, right, right_left, right_right_height);
+    }
+
+    // Make "new_child" the child of the parent in place of "old_child".
+    static void replace_child(node_base *parent, node_base *old_child, node_base *new_child) noexcept {
+        if (parent->_left.load() == old_child)
+            parent->_left.store(new_child);
+        else
+            parent->_right.store(new_child);
+        new_child->_parent.store(parent);
+    }
+
+    // The rotations take the locked parent, node and its child (and grandchild, for the double rotations), along
+    // with the heights of the subtrees which are not locked. The nodes which move down are marked as shrinking
+    // for the duration of the rotation, so that the readers passing through them wait and retry. Returns the next
+    // node to fix, if any.
+    node_base *rotate_right_nl(node_base *parent, node_base *node, node_base *left, int right_height, int left_left_height,
+                               node_base *left_right, int left_right_height) noexcept {
+        const auto version = node->_version.load();
+        node->_version.store(version | shrinking_bit);
+
+        node->_left.store(left_right);
+        if (left_right)
+            left_right->_parent.store(node);
+        left->_right.store(node);
+        node->_parent.store(left);
+        replace_child(parent, node, left);
+
+        const int node_height = 1 + std::max(left_right_height, right_height);
+        node->_height.store(node_height);
+        left->_height.store(1 + std::max(left_left_height, node_height));
+
+        node->_version.store(version + shrink_count_increment);
+
+        const int node_balance = left_right_height - right_height;
+        if (node_balance < -1 || node_balance > 1)
+            return node;
+        if ((!left_right || right_height == 0) && !present(node))
+            return node;
+        const int left_balance = left_left_height - node_height;
+        if (left_balance < -1 || left_balance > 1)
+            return left;
+        if (left_left_height == 0 && !present(left))
+            return left;
+        return fix_height_nl(parent);
+    }
+
+    node_base *rotate_left_nl(node_base *parent, node_base *node, int left_height, node_base *right, node_base *right_left,
+                              int right_left_height, int right_right_height) noexcept {
+        const auto version = node->_version.load();
+        node->_version.store(version | shrinking_bit);
+
+        node->_right.store(right_left);
+        if (right_left)
+            right_left->_parent.store(node);
+        right->_left.store(node);
+        node->_parent.store(right);
+        replace_child(parent, node, right);
+
+        const int node_height = 1 + std::max(left_height, right_left_height);
+        node->_height.store(node_height);
+        right->_height.store(1 + std::max(node_height, right_right_height));
+
+        node->_version.store(version + shrink_count_increment);
+
+        const int node_balance = right_left_height - left_height;
+        if (node_balance < -1 || node_balance > 1)
+            return node;
+        if ((!right_left || left_height == 0) && !present(node))
+            return node;
+        const int right_balance = right_right_height - node_height;
+        if (right_balance < -1 || right_balance > 1)
+            return right;
+        if (right_right_height == 0 && !present(right))
+            return right;
+        return fix_height_nl(parent);
+    }
+
+    node_base *rotate_right_over_left_nl(node_base *parent, node_base *node, node_base *left, int right_height,
+                                         int left_left_height, node_base *left_right, int left_right_left_height) noexcept {
+        const auto node_version = node->_version.load();
+        const auto left_version = left->_version.load();
+        auto *left_right_left = left_right->_left.load();
+        auto *left_right_right = left_right->_right.load();
+        const int left_right_right_height = height(left_right_right);
+        node->_version.store(node_version | shrinking_bit);
+        left->_version.store(left_version | shrinking_bit);
+
+        node->_left.store(left_right_right);
+        if (left_right_right)
+            left_right_right->_parent.store(node);
+        left->_right.store(left_right_left);
+        if (left_right_left)
+            left_right_left->_parent.store(left);
+        left_right->_left.store(left);
+        left->_parent.store(left_right);
+        left_right->_right.store(node);
+        node->_parent.store(left_right);
+        replace_child(parent, node, left_right);
+
+        const int node_height = 1 + std::max(left_right_right_height, right_height);
+        node->_height.store(node_height);
+        int left_height = 1 + std::max(left_left_height, left_right_left_height);
+        left->_height.store(left_height);
+        left_right->_height.store(1 + std::max(left_height, node_height));
+
+        node->_version.store(node_version + shrink_count_increment);
+        left->_version.store(left_version + shrink_count_increment);
+
+        // The left child may have become an unnecessary routing node. Unlink it while it is still locked.
+        if ((!left_right_left || left_left_height == 0) && !present(left) && attempt_unlink_nl(left_right, left)) {
+            left_height = std::max(left_left_height, left_right_left_height);
+            left_right->_height.store(1 + std::max(left_height, node_height));
+        }
+
+        const int node_balance = left_right_right_height - right_height;
+        if (node_balance < -1 || node_balance > 1)
+            return node;
+        if ((!left_right_right || right_height == 0) && !present(node))
+            return node;
+        const int left_right_balance = left_height - node_height;
+        if (left_right_balance < -1 || left_right_balance > 1)
+            return left_right;
+        return fix_height_nl(parent);
+    }
+
+    node_base *rotate_left_over_right_nl(node_base *parent, node_base *node, int left_height, node_base *right,
+                                         node_base *right_left, int right_right_height, int right_left_right_height) noexcept {
+        const auto node_version = node->_version.load();
+        const auto right_version = right->_version.load();
+        auto *right_left_left = right_left->_left.load();
+        auto *right_left_right = right_left->_right.load();
+        const int right_left_left_height = height(right_left_left);
+        node->_version.store(node_version | shrinking_bit);
+        right->_version.store(right_version | shrinking_bit);
+
+        node->_right.store(right_left_left);
+        if (right_left_left)
+            right_left_left->_parent.store(node);
+        right->_left.store(right_left_right);
+        if (right_left_right)
+            right_left_right->_parent.store(right);
+        right_left->_right.store(right);
+        right->_parent.store(right_left);
+        right_left->_left.store(node);
+        node->_parent.store(right_left);
+        replace_child(parent, node, right_left);
+
+        const int node_height = 1 + std::max(left_height, right_left_left_height);
+        node->_height.store(node_height);
+        int right_height = 1 + std::max(right_left_right_height, right_right_height);
+        right->_height.store(right_height);
+        right_left->_height.store(1 + std::max(node_height, right_height));
+
+        node->_version.store(node_version + shrink_count_increment);
+        right->_version.store(right_version + shrink_count_increment);
+
+        if ((!right_left_right || right_right_height == 0) && !present(right) && attempt_unlink_nl(right_left, right)) {
+            right_height = std::max(right_left_right_height, right_right_height);
+            right_left->_height.store(1 + std::max(node_height, right_height));
+        }
+
+        const int node_balance = right_left_left_height - left_height;
+        if (node_balance < -1 || node_balance > 1)
+            return node;
+        if ((!right_left_left || left_height == 0) && !present(node))
+            return node;
+        const int right_left_balance = right_height - node_height;
+        if (right_left_balance < -1 || right_left_balance > 1)
+            return right_left;
+        return fix_height_nl(parent);
+    }
+
+    template <class Fn>
+    static void for_each_in_subtree(const node_base *node, Fn &fn) {
+        if (!node)
+            return;
+        for_each_in_subtree(node->_left.load(), fn);
+        if (const auto value = value_of(node))
+            fn(as_node(node)->_key, *value);
+        for_each_in_subtree(node->_right.load(), fn);
+    }
+
+    static void destroy_subtree(node_base *node) noexcept {
+        if (!node)
+            return;
+        destroy_subtree(node->_left.load());
+        destroy_subtree(node->_right.load());
+        delete as_node(node);
+    }
+};
+
+} // end namespace avl
+
+#endif // OPTIMISTIC_AVL_TREE_H
@@ -0,0 +1,312 @@
+#ifndef PERSISTENT_AVL_TREE_H
+#define PERSISTENT_AVL_TREE_H
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "avl_tree.h"
+
+namespace avl {
+
+// Persistent AVL tree - the nodes never change once they are built, and are shared through reference counting.
+// An insertion or erasure copies only the nodes on the path from the root to the changed node (and the few nodes
+// the rotations along that path touch), and shares the rest with the previous version of the tree. Copying the
+// tree just shares its root, so "snapshot" takes constant time, and the snapshot keeps reading the same elements
+// however the original is modified later.
+//
+// A single tree object must not be modified concurrently with any other use of it, but the copies are independent.
+// The reference counts are atomic, so a snapshot can be read on one thread while the original is modified on
+// another.
+template <typename Key, typename T = Key, typename Cmp = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, T>>>
+class persistent_avl_tree final {
+public:
+    using size_type = std::size_t;
+    using key_type = Key;
+    using val_type = T;
+    using node_val_type = std::pair<const key_type, val_type>;
+    using cmp_type = Cmp;
+    using allocator_type = Alloc;
+
+private:
+    static constexpr bool three_way = detail::is_three_way<cmp_type>::value;
+
+    struct Node;
+    using node_ptr = std::shared_ptr<const Node>;
+
+    struct Node final {
+        node_val_type _value;
+        node_ptr _left;
+        node_ptr _right;
+        int _height;
+
+        template <class ValT>
+        Node(ValT &&value, node_ptr left, node_ptr right)
+            : _value(std::forward<ValT>(value)), _left(std::move(left)), _right(std::move(right)),
+              _height(1 + std::max(height(_left), height(_right))) {}
+    };
+
+    using node_allocator_type = typename std::allocator_traits<allocator_type>::template rebind_alloc<Node>;
+
+public:
+    // Forward iterator to the (constant) elements of one version of the tree. The iterator keeps the path from
+    // the root to its element, as the shared nodes cannot point to their parents. It stays valid until the tree
+    // it came from is modified or destroyed - iterate over a snapshot to keep the version around.
+    class const_iterator final {
+        friend class persistent_avl_tree;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = node_val_type;
+        using pointer = const node_val_type *;
+        using reference = const node_val_type &;
+
+        const_iterator() = default;
+
+        reference operator*() const { return _path.back()->_value; }
+        pointer operator->() const { return &_path.back()->_value; }
+
+        const_iterator &operator++() {
+            const auto *node = _path.back();
+            _path.pop_back();
+            push_leftmost(node->_right.get());
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        friend bool operator==(const const_iterator &lhs, const const_iterator &rhs) noexcept {
+            return lhs._path.empty() ? rhs._path.empty() : !rhs._path.empty() && lhs._path.back() == rhs._path.back();
+        }
+        friend bool operator!=(const const_iterator &lhs, const const_iterator &rhs) noexcept { return !(lhs == rhs); }
+
+    private:
+        // The current node is at the back, preceded by the ancestors which hold it in their left subtrees, and
+        // so come next in the key order. The end iterator has an empty path.
+        std::vector<const Node *> _path;
+
+        void push_leftmost(const Node *node) {
+            for (; node; node = node->_left.get())
+                _path.push_back(node);
+        }
+    };
+
+    // The elements cannot be modified in place.
+    using iterator = const_iterator;
+
+    persistent_avl_tree() : persistent_avl_tree(cmp_type()) {}
+    explicit persistent_avl_tree(const cmp_type &comparator, const allocator_type &alloc = allocator_type())
+        : _comparator(comparator), _node_allocator(alloc) {}
+
+    // Copies share all the nodes, and take constant time.
+    persistent_avl_tree(const persistent_avl_tree &) = default;
+    persistent_avl_tree &operator=(const persistent_avl_tree &) = default;
+
+    // Moving leaves the source tree empty.
+    persistent_avl_tree(persistent_avl_tree &&other) noexcept
+        : _root(std::move(other._root)), _size(std::exchange(other._size, 0)), _comparator(std::move(other._comparator)),
+          _node_allocator(std::move(other._node_allocator)) {}
+    persistent_avl_tree &operator=(persistent_avl_tree &&other) noexcept {
+        _root = std::move(other._root);
+        _size = std::exchange(other._size, 0);
+        _comparator = std::move(other._comparator);
+        _node_allocator = std::move(other._node_allocator);
+        return *this;
+    }
+
+    // The current version of the tree, which later modifications of this tree do not change.
+    persistent_avl_tree snapshot() const { return *this; }
+
+    const_iterator begin() const {
+        const_iterator it;
+        it.push_leftmost(_root.get());
+        return it;
+    }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator end() const noexcept { return const_iterator(); }
+    const_iterator cend() const noexcept { return end(); }
+
+    size_type size() const noexcept { return _size; }
+    bool empty() const noexcept { return _size == 0; }
+    int height() const noexcept { return height(_root); }
+
+    // Iterator to the first element with the key not less than the given key, or end() if there is none.
+    const_iterator lower_bound(const key_type &key) const {
+        const_iterator it;
+        for (const auto *node = _root.get(); node;) {
+            if (key_less(node->_value.first, key))
+                node = node->_right.get();
+            else {
+                it._path.push_back(node);
+                node = node->_left.get();
+            }
+        }
+        return it;
+    }
+    const_iterator find(const key_type &key) const {
+        auto it = lower_bound(key);
+        return it == end() || key_less(key, it->first) ? end() : it;
+    }
+    bool contains(const key_type &key) const { return find_node(key) != nullptr; }
+
+    // Return the reference to the value tied to the key. If the key doesn't exist, throw an exception.
+    const val_type &at(const key_type &key) const {
+        if (const auto *node = find_node(key))
+            return node->_value.second;
+        throw std::out_of_range("Nonexistent key.\n");
+    }
+
+    // Insert the element, unless its key already exists. Return true if the element was inserted.
+    bool insert(const node_val_type &value) { return insert_or_replace(value, false); }
+    bool insert(node_val_type &&value) { return insert_or_replace(std::move(value), false); }
+    // Insert the element, or replace the existing element with the same key. Return true if the element was
+    // inserted, and false if it was replaced.
+    bool insert_or_assign(const key_type &key, val_type value) {
+        return insert_or_replace(node_val_type(key, std::move(value)), true);
+    }
+
+    // Erase the element with the given key. Return the number of the erased elements (zero or one).
+    size_type erase(const key_type &key) {
+        bool erased = false;
+        auto root = erase_subtree(_root, key, erased);
+        if (!erased)
+            return 0;
+        _root = std::move(root);
+        --_size;
+        return 1;
+    }
+
+    // Drop this tree's references to the nodes. The nodes shared with the snapshots stay alive.
+    void clear() noexcept {
+        _root.reset();
+        _size = 0;
+    }
+
+private:
+    node_ptr _root{};
+    size_type _size{0};
+    cmp_type _comparator{};
+    node_allocator_type _node_allocator{};
+
+    static int height(const node_ptr &node) noexcept { return node ? node->_height : 0; }
+
+    // Is the "lhs" key less than the "rhs" key.
+    bool key_less(const key_type &lhs, const key_type &rhs) const {
+        if constexpr (three_way)
+            return _comparator(lhs, rhs) < 0;
+        else
+            return _comparator(lhs, rhs);
+    }
+
+    const Node *find_node(const key_type &key) const {
+        for (const auto *node = _root.get(); node;) {
+            if (key_less(key, node->_value.first))
+                node = node->_left.get();
+            else if (key_less(node->_value.first, key))
+                node = node->_right.get();
+            else
+                return node;
+        }
+        return nullptr;
+    }
+
+    template <class ValT>
+    node_ptr make_node(ValT &&value, node_ptr left, node_ptr right) const {
+        return std::allocate_shared<Node>(_node_allocator, std::forward<ValT>(value), std::move(left), std::move(right));
+    }
+
+    // Build the node with the given value and subtrees, whose heights differ by at most two. If they differ
+    // by two, the taller subtree is rotated up (which copies its root, and its child too for the double
+    // rotation), just like the rotations of the "avl_tree".
+    node_ptr balance(const node_val_type &value, node_ptr left, node_ptr right) const {
+        const int left_height = height(left);
+        const int right_height = height(right);
+        if (left_height > right_height + 1) {
+            if (height(left->_left) >= height(left->_right))
+                return make_node(left->_value, left->_left, make_node(value, left->_right, std::move(right)));
+            const auto &left_right = left->_right;
+            return make_node(left_right->_value, make_node(left->_value, left->_left, left_right->_left),
+                             make_node(value, left_right->_right, std::move(right)));
+        }
+        if (right_height > left_height + 1) {
+            if (height(right->_right) >= height(right->_left))
+                return make_node(right->_value, make_node(value, std::move(left), right->_left), right->_right);
+            const auto &right_left = right->_left;
+            return make_node(right_left->_value, make_node(value, std::move(left), right_left->_left),
+                             make_node(right->_value, right_left->_right, right->_right));
+        }
+        return make_node(value, std::move(left), std::move(right));
+    }
+
+    template <class ValT>
+    bool insert_or_replace(ValT &&value, bool replace) {
+        bool inserted = false;
+        if (auto root = insert_subtree(_root, std::forward<ValT>(value), replace, inserted))
+            _root = std::move(root);
+        _size += inserted;
+        return inserted;
+    }
+
+    // Return the copy of the subtree with the element inserted (or replaced), or nullptr if the subtree does not
+    // change - then nothing is copied.
+    template <class ValT>
+    node_ptr insert_subtree(const node_ptr &node, ValT &&value, bool replace, bool &inserted) const {
+        if (!node) {
+            inserted = true;
+            return make_node(std::forward<ValT>(value), nullptr, nullptr);
+        }
+        if (key_less(value.first, node->_value.first)) {
+            auto left = insert_subtree(node->_left, std::forward<ValT>(value), replace, inserted);
+            return left ? balance(node->_value, std::move(left), node->_right) : nullptr;
+        }
+        if (key_less(node->_value.first, value.first)) {
+            auto right = insert_subtree(node->_right, std::forward<ValT>(value), replace, inserted);
+            return right ? balance(node->_value, node->_left, std::move(right)) : nullptr;
+        }
+        return replace ? make_node(std::forward<ValT>(value), node->_left, node->_right) : nullptr;
+    }
+
+    // Return the copy of the subtree with the element erased. Sets "erased" if the key was found - otherwise the
+    // result means nothing, and nothing is copied.
+    node_ptr erase_subtree(const node_ptr &node, const key_type &key, bool &erased) const {
+        if (!node)
+            return nullptr;
+        if (key_less(key, node->_value.first)) {
+            auto left = erase_subtree(node->_left, key, erased);
+            return erased ? balance(node->_value, std::move(left), node->_right) : nullptr;
+        }
+        if (key_less(node->_value.first, key)) {
+            auto right = erase_subtree(node->_right, key, erased);
+            return erased ? balance(node->_value, node->_left, std::move(right)) : nullptr;
+        }
+
+        erased = true;
+        if (!node->_left)
+            return node->_right;
+        if (!node->_right)
+            return node->_left;
+        // The node with two children is replaced by the smallest element of its right subtree.
+        const auto *smallest = node->_right.get();
+        while (smallest->_left)
+            smallest = smallest->_left.get();
+        return balance(smallest->_value, node->_left, erase_smallest(node->_right));
+    }
+
+    node_ptr erase_smallest(const node_ptr &node) const {
+        if (!node->_left)
+            return node->_right;
+        return balance(node->_value, erase_smallest(node->_left), node->_right);
+    }
+};
+
+} // end namespace avl
+
+#endif // PERSISTENT_AVL_TREE_H
@@ -0,0 +1,339 @@
+#ifndef SHARDED_AVL_TREE_H
+#define SHARDED_AVL_TREE_H
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "avl_tree.h"
+
+namespace avl {
+
+// Range-partitioned set of the "avl_tree"s. The boundary keys split the key space into the shards - the shard i
+// holds the keys not less than the boundary i-1 and less than the boundary i. Each shard has its own worker
+// thread, and the batch operations route the elements to the shards by their keys, and then run on all the
+// affected shards in parallel. The iterators walk the shards one after another, which gives all the elements in
+// the key order.
+//
+// The container itself is not thread-safe - the parallelism is inside the batches. Between the batches, the
+// workers are idle, so the single-element operations and the iteration simply run on the calling thread.
+template <typename Key, typename T = Key, typename Cmp = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, T>>, typename Options = default_options>
+class sharded_avl_tree final {
+public:
+    using tree_type = avl_tree<Key, T, Cmp, Alloc, Options>;
+    using size_type = typename tree_type::size_type;
+    using key_type = typename tree_type::key_type;
+    using val_type = typename tree_type::val_type;
+    using node_val_type = typename tree_type::node_val_type;
+    using cmp_type = typename tree_type::cmp_type;
+
+private:
+    static constexpr bool three_way = detail::is_three_way<cmp_type>::value;
+
+    // Tree of a shard, and the worker thread which runs the batches on it.
+    class shard final {
+    public:
+        explicit shard(const cmp_type &comparator) : _tree(comparator), _worker([this] { run(); }) {}
+        shard(const shard &) = delete;
+        shard &operator=(const shard &) = delete;
+
+        ~shard() {
+            {
+                std::lock_guard lock(_mutex);
+                _stopping = true;
+            }
+            _wake.notify_one();
+            _worker.join();
+        }
+
+        tree_type _tree;
+
+        void post(std::function<void()> task) {
+            {
+                std::lock_guard lock(_mutex);
+                _tasks.push_back(std::move(task));
+            }
+            _wake.notify_one();
+        }
+
+    private:
+        std::mutex _mutex{};
+        std::condition_variable _wake{};
+        std::deque<std::function<void()>> _tasks{};
+        bool _stopping{false};
+        // Started last, once everything it uses is constructed.
+        std::thread _worker;
+
+        void run() {
+            for (;;) {
+                std::function<void()> task;
+                {
+                    std::unique_lock lock(_mutex);
+                    _wake.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+                    if (_tasks.empty())
+                        return;
+                    task = std::move(_tasks.front());
+                    _tasks.pop_front();
+                }
+                task();
+            }
+        }
+    };
+
+public:
+    // Bidirectional iterator over the (constant) elements of all the shards, in the key order.
+    class const_iterator final {
+        friend class sharded_avl_tree;
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = node_val_type;
+        using pointer = const node_val_type *;
+        using reference = const node_val_type &;
+
+        reference operator*() const { return *_it; }
+        pointer operator->() const { return &*_it; }
+
+        const_iterator &operator++() {
+            ++_it;
+            skip_empty_shards();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        const_iterator &operator--() {
+            while (_it == tree().cbegin())
+                _it = _owner->_shards[--_shard]->_tree.cend();
+            --_it;
+            return *this;
+        }
+        const_iterator operator--(int) {
+            const_iterator tmp = *this;
+            --*this;
+            return tmp;
+        }
+
+        friend bool operator==(const const_iterator &lhs, const const_iterator &rhs) noexcept { return lhs._it == rhs._it; }
+        friend bool operator!=(const const_iterator &lhs, const const_iterator &rhs) noexcept { return lhs._it != rhs._it; }
+
+    private:
+        const sharded_avl_tree *_owner;
+        size_type _shard;
+        typename tree_type::const_iterator _it;
+
+        const_iterator(const sharded_avl_tree *owner, size_type shard, typename tree_type::const_iterator it)
+            : _owner(owner), _shard(shard), _it(it) {
+            skip_empty_shards();
+        }
+
+        const tree_type &tree() const noexcept { return _owner->_shards[_shard]->_tree; }
+
+        // At the end of a shard (other than the last one), move on to the beginning of the next one.
+        void skip_empty_shards() {
+            while (_it == tree().cend() && _shard + 1 < _owner->_shards.size())
+                _it = _owner->_shards[++_shard]->_tree.cbegin();
+        }
+    };
+
+    // The elements cannot be modified through the iterators.
+    using iterator = const_iterator;
+
+    // The "boundaries" must be sorted and unique. There is one more shard than there are boundaries.
+    explicit sharded_avl_tree(std::vector<key_type> boundaries, const cmp_type &comparator = cmp_type())
+        : _boundaries(std::move(boundaries)), _comparator(comparator) {
+        for (size_type i = 1; i < _boundaries.size(); ++i)
+            assert(key_less(_boundaries[i - 1], _boundaries[i]) && "The shard boundaries are not sorted.");
+        _shards.reserve(_boundaries.size() + 1);
+        for (size_type i = 0; i <= _boundaries.size(); ++i)
+            _shards.push_back(std::make_unique<shard>(comparator));
+    }
+    sharded_avl_tree(const sharded_avl_tree &) = delete;
+    sharded_avl_tree &operator=(const sharded_avl_tree &) = delete;
+
+    const_iterator begin() const { return const_iterator(this, 0, _shards.front()->_tree.cbegin()); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator end() const { return const_iterator(this, _shards.size() - 1, _shards.back()->_tree.cend()); }
+    const_iterator cend() const { return end(); }
+
+    size_type shard_count() const noexcept { return _shards.size(); }
+    const tree_type &shard_tree(size_type index) const noexcept { return _shards[index]->_tree; }
+
+    size_type size() const noexcept {
+        size_type size = 0;
+        for (const auto &shard : _shards)
+            size += shard->_tree.size();
+        return size;
+    }
+    bool empty() const noexcept { return size() == 0; }
+
+    // Single-element operations, on the shard which holds the key.
+    bool insert(const node_val_type &value) { return shard_of(value.first)._tree.insert(value).second; }
+    bool insert(node_val_type &&value) {
+        auto &tree = shard_of(value.first)._tree;
+        return tree.insert(std::move(value)).second;
+    }
+    std::optional<val_type> find(const key_type &key) const {
+        const auto &tree = shard_of(key)._tree;
+        if (auto it = tree.find(key); it != tree.cend())
+            return (*it).second;
+        return std::nullopt;
+    }
+    bool contains(const key_type &key) const {
+        const auto &tree = shard_of(key)._tree;
+        return tree.find(key) != tree.cend();
+    }
+    size_type erase(const key_type &key) {
+        auto &tree = shard_of(key)._tree;
+        auto it = tree.find(key);
+        if (it == tree.end())
+            return 0;
+        tree.erase(it);
+        return 1;
+    }
+
+    // Insert the batch of elements, each shard's part on its own worker. Return the number of the inserted elements.
+    template <class ItT>
+    size_type insert(ItT first, ItT last) {
+        std::vector<std::vector<node_val_type>> batches(_shards.size());
+        for (; first != last; ++first)
+            batches[shard_index((*first).first)].emplace_back(*first);
+
+        std::vector<size_type> inserted(_shards.size());
+        run_batches(batches, [&](size_type index, tree_type &tree) {
+            for (auto &value : batches[index])
+                inserted[index] += tree.insert(std::move(value)).second;
+        });
+        return std::accumulate(inserted.begin(), inserted.end(), size_type(0));
+    }
+
+    // Erase the batch of keys, each shard's part on its own worker. Return the number of the erased elements.
+    template <class ItT>
+    size_type erase(ItT first, ItT last) {
+        std::vector<std::vector<key_type>> batches(_shards.size());
+        for (; first != last; ++first)
+            batches[shard_index(*first)].emplace_back(*first);
+
+        std::vector<size_type> erased(_shards.size());
+        run_batches(batches, [&](size_type index, tree_type &tree) {
+            for (const auto &key : batches[index]) {
+                if (auto it = tree.find(key); it != tree.end()) {
+                    tree.erase(it);
+                    ++erased[index];
+                }
+            }
+        });
+        return std::accumulate(erased.begin(), erased.end(), size_type(0));
+    }
+
+    // Look the batch of keys up, each shard's part on its own worker. Return the copies of the values, or nothing
+    // for the missing keys, in the order of the keys.
+    std::vector<std::optional<val_type>> find(const std::vector<key_type> &keys) const {
+        std::vector<std::vector<size_type>> batches(_shards.size());
+        for (size_type i = 0; i < keys.size(); ++i)
+            batches[shard_index(keys[i])].push_back(i);
+
+        std::vector<std::optional<val_type>> values(keys.size());
+        run_batches(batches, [&](size_type index, const tree_type &tree) {
+            for (size_type i : batches[index]) {
+                if (auto it = tree.find(keys[i]); it != tree.cend())
+                    values[i] = (*it).second;
+            }
+        });
+        return values;
+    }
+
+    void clear() noexcept {
+        for (auto &shard : _shards)
+            shard->_tree.clear();
+    }
+
+private:
+    std::vector<key_type> _boundaries;
+    std::vector<std::unique_ptr<shard>> _shards{};
+    cmp_type _comparator;
+
+    // Is the "lhs" key less than the "rhs" key.
+    bool key_less(const key_type &lhs, const key_type &rhs) const {
+        if constexpr (three_way)
+            return _comparator(lhs, rhs) < 0;
+        else
+            return _comparator(lhs, rhs);
+    }
+
+    size_type shard_index(const key_type &key) const {
+        auto it = std::upper_bound(_boundaries.begin(), _boundaries.end(), key,
+                                   [this](const key_type &lhs, const key_type &rhs) { return key_less(lhs, rhs); });
+        return static_cast<size_type>(it - _boundaries.begin());
+    }
+    shard &shard_of(const key_type &key) const { return *_shards[shard_index(key)]; }
+
+    // Run "fn(index, tree)" for every shard with a non-empty batch on the shard's worker, and wait until all of
+    // them are done. Rethrows the first exception thrown by "fn".
+    template <class Batches, class Fn>
+    void run_batches(const Batches &batches, Fn &&fn) const {
+        std::mutex done_mutex;
+        std::condition_variable done;
+        size_type pending = 0;
+        std::vector<std::exception_ptr> errors(_shards.size());
+        auto wait = [&] {
+            std::unique_lock lock(done_mutex);
+            done.wait(lock, [&] { return pending == 0; });
+        };
+
+        for (size_type index = 0; index < _shards.size(); ++index) {
+            if (batches[index].empty())
+                continue;
+            {
+                std::lock_guard lock(done_mutex);
+                ++pending;
+            }
+            try {
+                _shards[index]->post([&, index] {
+                    try {
+                        fn(index, _shards[index]->_tree);
+                    } catch (...) {
+                        errors[index] = std::current_exception();
+                    }
+                    // Notify under the lock, so that the waiting thread cannot return (destroying "done") first.
+                    std::lock_guard lock(done_mutex);
+                    if (--pending == 0)
+                        done.notify_one();
+                });
+            } catch (...) {
+                {
+                    std::lock_guard lock(done_mutex);
+                    --pending;
+                }
+                wait();
+                throw;
+            }
+        }
+
+        wait();
+        for (auto &error : errors) {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    }
+};
+
+} // end namespace avl
+
+#endif // SHARDED_AVL_TREE_H
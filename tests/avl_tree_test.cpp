@@ -0,0 +1,472 @@
+// Differential tests of the single-threaded containers against std::map. Every container runs the same random
+// sequence of the modifications and lookups as the map, and after each step the results (and periodically the
+// whole contents and the balance of the tree) must agree with it.
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "avl_tree.h"
+#include "btree.h"
+#include "node_arena.h"
+#include "node_pool_allocator.h"
+#include "persistent_avl_tree.h"
+#include "sharded_avl_tree.h"
+#include "check.h"
+
+using reference_map = std::map<int, int>;
+using node_value = std::pair<const int, int>;
+
+constexpr int key_range = 2000;
+constexpr int steps = 20'000;
+
+template <typename Container>
+bool same_contents(Container &&container, const reference_map &map)
+{
+    return container.size() == map.size() &&
+           std::equal(container.begin(), container.end(), map.begin(), map.end(),
+                      [](const auto &lhs, const auto &rhs) { return lhs.first == rhs.first && lhs.second == rhs.second; });
+}
+
+// The AVL trees are at most about 1.44 times as high as the perfectly balanced ones.
+bool balanced_height(int height, std::size_t size)
+{
+    return height <= 1.4405 * std::log2(static_cast<double>(size) + 2) - 0.3277 + 1;
+}
+
+template <typename It, typename MapIt>
+bool same_position(It it, It end, MapIt map_it, MapIt map_end)
+{
+    if (map_it == map_end)
+        return it == end;
+    return it != end && it->first == map_it->first && it->second == map_it->second;
+}
+
+// Run the random modifications and lookups on the container returned by "make" and on the map. "extra" checks the
+// container against the map after each step, for the features the other containers do not have.
+template <typename Make, typename Extra>
+void run_differential(Make &&make, Extra &&extra, unsigned seed)
+{
+    auto container = make();
+    reference_map map;
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> key_of(0, key_range - 1), operation_of(0, 99);
+
+    for (int step = 0; step < steps; ++step) {
+        const int key = key_of(rng);
+        const int operation = operation_of(rng);
+        if (operation < 30) {
+            const bool inserted = container.insert(node_value(key, step)).second;
+            CHECK(inserted == map.insert(node_value(key, step)).second);
+        } else if (operation < 35) {
+            auto it = container.emplace_hint(container.end(), key, step);
+            const auto map_it = map.emplace_hint(map.end(), key, step);
+            CHECK(it->first == map_it->first && it->second == map_it->second);
+        } else if (operation < 45) {
+            container[key] = step;
+            map[key] = step;
+        } else if (operation < 70) {
+            auto it = container.find(key);
+            const auto map_it = map.find(key);
+            CHECK(same_position(it, container.end(), map_it, map.end()));
+            if (it != container.end()) {
+                auto next = container.erase(it);
+                CHECK(same_position(next, container.end(), map.erase(map_it), map.end()));
+            }
+        } else if (operation < 71) {
+            // Erase a range of up to a hundred keys.
+            const int upper = key + key_of(rng) % 100;
+            auto next = container.erase(container.lower_bound(key), container.lower_bound(upper));
+            const auto map_next = map.erase(map.lower_bound(key), map.lower_bound(upper));
+            CHECK(same_position(next, container.end(), map_next, map.end()));
+        } else {
+            const auto &const_container = container;
+            CHECK(same_position(const_container.find(key), const_container.cend(), map.find(key), map.end()));
+            CHECK(same_position(container.lower_bound(key), container.end(), map.lower_bound(key), map.end()));
+            CHECK(same_position(container.upper_bound(key), container.end(), map.upper_bound(key), map.end()));
+            auto range = container.equal_range(key);
+            CHECK(same_position(range.first, container.end(), map.lower_bound(key), map.end()));
+            CHECK(same_position(range.second, container.end(), map.upper_bound(key), map.end()));
+        }
+        CHECK(container.size() == map.size());
+        extra(container, map, key);
+
+        if (step % 2000 == 0) {
+            CHECK(same_contents(container, map));
+            CHECK(balanced_height(container.height(), container.size()));
+            // The copies and the moved trees hold the same elements, and the moved-from tree is still usable.
+            auto copy = container;
+            CHECK(same_contents(copy, map));
+            auto moved = std::move(copy);
+            CHECK(same_contents(moved, map));
+            CHECK(copy.empty());
+            copy.insert(node_value(key, key));
+            CHECK(copy.size() == 1);
+            copy = std::move(moved);
+            CHECK(same_contents(copy, map));
+            container = copy;
+            CHECK(same_contents(container, map));
+        }
+    }
+    CHECK(same_contents(container, map));
+    // Iterating backwards gives the elements in the reverse order.
+    CHECK(std::equal(std::make_reverse_iterator(container.end()), std::make_reverse_iterator(container.begin()),
+                     map.rbegin(), map.rend(),
+                     [](const auto &lhs, const auto &rhs) { return lhs.first == rhs.first; }));
+    container.clear();
+    CHECK(container.empty() && container.begin() == container.end());
+}
+
+template <typename Make>
+void run_differential(Make &&make, unsigned seed)
+{
+    run_differential(std::forward<Make>(make), [](const auto &, const reference_map &, int) {}, seed);
+}
+
+template <typename Options>
+using options_tree = avl::avl_tree<int, int, std::less<int>, std::allocator<node_value>, Options>;
+
+void test_avl_trees()
+{
+    run_differential([] { return avl::avl_tree<int, int>(); }, 1);
+    run_differential([] { return avl::avl_tree<int, int, avl::three_way_compare<int>>(); }, 2);
+    run_differential([] { return options_tree<avl::threaded_options>(); }, 3);
+    run_differential([] { return options_tree<avl::statistics_options>(); }, 4);
+    run_differential(
+        [] { return avl::avl_tree<int, int, std::less<int>, avl::node_pool_allocator<node_value>>(); }, 5);
+    // The arena holds the tree and its copies (which share the allocator).
+    run_differential(
+        [] {
+            using arena_tree = avl::avl_tree<int, int, std::less<int>, avl::arena_allocator<node_value>>;
+            return arena_tree(avl::arena_allocator<node_value>(4 * key_range));
+        },
+        6);
+
+    // The order statistics agree with the positions in the map.
+    run_differential(
+        [] { return options_tree<avl::order_statistics_options>(); },
+        [](const auto &tree, const reference_map &map, int key) {
+            const auto rank = static_cast<std::size_t>(std::distance(map.begin(), map.lower_bound(key)));
+            CHECK(tree.rank(key) == rank);
+            CHECK(same_position(tree.nth(rank), tree.cend(), map.lower_bound(key), map.end()));
+            const int upper = key + 50;
+            CHECK(tree.count_range(key, upper) ==
+                  static_cast<std::size_t>(std::distance(map.lower_bound(key), map.lower_bound(upper))));
+        },
+        7);
+}
+
+void test_btrees()
+{
+    run_differential([] { return avl::btree<int, int>(); }, 11);
+    // The small nodes split and merge all the time.
+    run_differential([] { return avl::btree<int, int, std::less<int>, std::allocator<node_value>, 4>(); }, 12);
+}
+
+// Number of the live allocations made by the "tagged_allocator"s of each id (and its rebound copies). The memory
+// must be freed through an allocator of the same id, which brings the count back to zero.
+int tagged_allocations[3] = {0, 0, 0};
+
+// Allocator which does not propagate on the move assignment, and whose instances are equal only if they have the
+// same id.
+template <typename T>
+struct tagged_allocator {
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::false_type;
+    using is_always_equal = std::false_type;
+
+    int id = 0;
+
+    explicit tagged_allocator(int id) noexcept : id(id) {}
+    template <typename U>
+    tagged_allocator(const tagged_allocator<U> &other) noexcept : id(other.id) {}
+
+    T *allocate(std::size_t n) {
+        ++tagged_allocations[id];
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        --tagged_allocations[id];
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template <typename U>
+    friend bool operator==(const tagged_allocator &lhs, const tagged_allocator<U> &rhs) noexcept {
+        return lhs.id == rhs.id;
+    }
+    template <typename U>
+    friend bool operator!=(const tagged_allocator &lhs, const tagged_allocator<U> &rhs) noexcept {
+        return lhs.id != rhs.id;
+    }
+};
+
+// The move assignment between the trees with the unequal allocators, which cannot take over each other's nodes.
+template <typename Tree>
+void test_unequal_allocators()
+{
+    using allocator = typename Tree::allocator_type;
+    {
+        Tree target(std::less<int>(), allocator(1)), source(std::less<int>(), allocator(2));
+        reference_map map;
+        for (int key = 0; key < 1000; ++key) {
+            target.insert(node_value(key, -key));
+            source.insert(node_value(2 * key, key));
+            map.insert(node_value(2 * key, key));
+        }
+        target = std::move(source);
+        CHECK(same_contents(target, map));
+        CHECK(source.empty() && target.get_allocator().id == 1);
+        // Both trees are still usable.
+        source.insert(node_value(1, 1));
+        target.insert(node_value(1, 1));
+        map.insert(node_value(1, 1));
+        CHECK(same_contents(target, map) && source.size() == 1);
+        // The equal allocators let the nodes move over.
+        Tree other(std::less<int>(), allocator(1));
+        other = std::move(target);
+        CHECK(same_contents(other, map) && target.empty());
+    }
+    CHECK(tagged_allocations[1] == 0 && tagged_allocations[2] == 0);
+}
+
+// Comparator which throws once its budget of the comparisons is used up. The copies share the budget.
+struct throwing_less {
+    std::shared_ptr<int> budget = std::make_shared<int>(std::numeric_limits<int>::max());
+
+    bool operator()(int lhs, int rhs) const {
+        if ((*budget)-- == 0)
+            throw std::runtime_error("comparison failed");
+        return lhs < rhs;
+    }
+};
+
+// Run "fn" with the comparisons failing after "budget" of them. Returns whether the exception came through.
+template <typename Fn>
+bool throws_after(const throwing_less &comparator, int budget, Fn &&fn)
+{
+    *comparator.budget = budget;
+    bool thrown = false;
+    try {
+        fn();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    *comparator.budget = std::numeric_limits<int>::max();
+    return thrown;
+}
+
+// The exceptions of the comparator pass through the lookups, and leave the tree as it was.
+void test_throwing_lookups()
+{
+    const throwing_less comparator;
+    avl::avl_tree<int, int, throwing_less> tree(comparator);
+    for (int key = 0; key < 100; ++key)
+        tree.insert(node_value(key, key));
+    CHECK(throws_after(comparator, 3, [&] { tree.lower_bound(50); }));
+    CHECK(throws_after(comparator, 3, [&] { tree.upper_bound(50); }));
+    CHECK(throws_after(comparator, 3, [&] { tree.equal_range(50); }));
+    CHECK(tree.size() == 100 && tree.lower_bound(50)->first == 50);
+
+    avl::avl_tree<int, int, throwing_less, std::allocator<node_value>, avl::order_statistics_options> ranked(comparator);
+    for (int key = 0; key < 100; ++key)
+        ranked.insert(node_value(key, key));
+    CHECK(throws_after(comparator, 3, [&] { ranked.rank(50); }));
+    CHECK(throws_after(comparator, 3, [&] { ranked.count_range(10, 50); }));
+    CHECK(ranked.rank(50) == 50 && ranked.count_range(10, 50) == 40);
+}
+
+// Split and join at random keys, with and without the order statistics.
+template <typename Tree>
+void test_split_join(unsigned seed)
+{
+    std::mt19937 rng(seed);
+    Tree tree;
+    reference_map map;
+    for (int i = 0; i < 5000; ++i) {
+        const int key = static_cast<int>(rng() % 10'000);
+        tree.insert(node_value(key, i));
+        map.insert(node_value(key, i));
+    }
+    for (int round = 0; round < 200; ++round) {
+        const int key = static_cast<int>(rng() % 10'000);
+        auto upper = tree.split(key);
+        CHECK(tree.size() == static_cast<std::size_t>(std::distance(map.begin(), map.lower_bound(key))));
+        CHECK(upper.empty() || upper.begin()->first >= key);
+        CHECK(tree.empty() || std::prev(tree.end())->first < key);
+        CHECK(balanced_height(tree.height(), tree.size()) && balanced_height(upper.height(), upper.size()));
+        tree.join(std::move(upper));
+        CHECK(upper.empty());
+        CHECK(same_contents(tree, map));
+    }
+}
+
+// The set operations give the same elements as the standard algorithms on the maps.
+void test_set_operations()
+{
+    std::mt19937 rng(21);
+    for (int round = 0; round < 20; ++round) {
+        avl::avl_tree<int, int> lhs, rhs;
+        reference_map lhs_map, rhs_map;
+        const int lhs_size = static_cast<int>(rng() % 3000), rhs_size = static_cast<int>(rng() % 3000);
+        for (int i = 0; i < lhs_size; ++i) {
+            const int key = static_cast<int>(rng() % 5000);
+            lhs.insert(node_value(key, 1));
+            lhs_map.insert(node_value(key, 1));
+        }
+        for (int i = 0; i < rhs_size; ++i) {
+            const int key = static_cast<int>(rng() % 5000);
+            rhs.insert(node_value(key, 2));
+            rhs_map.insert(node_value(key, 2));
+        }
+        const auto key_less = [](const auto &a, const auto &b) { return a.first < b.first; };
+        reference_map expected_union, expected_intersection, expected_difference;
+        std::set_union(lhs_map.begin(), lhs_map.end(), rhs_map.begin(), rhs_map.end(),
+                       std::inserter(expected_union, expected_union.end()), key_less);
+        std::set_intersection(lhs_map.begin(), lhs_map.end(), rhs_map.begin(), rhs_map.end(),
+                              std::inserter(expected_intersection, expected_intersection.end()), key_less);
+        std::set_difference(lhs_map.begin(), lhs_map.end(), rhs_map.begin(), rhs_map.end(),
+                            std::inserter(expected_difference, expected_difference.end()), key_less);
+
+        CHECK(same_contents(set_union(lhs, rhs), expected_union));
+        CHECK(same_contents(set_intersection(lhs, rhs), expected_intersection));
+        // The moved trees give their nodes to the result.
+        CHECK(same_contents(set_difference(std::move(lhs), std::move(rhs)), expected_difference));
+    }
+}
+
+// Moving the nodes between the trees through the handles and with "merge".
+void test_node_handles()
+{
+    avl::avl_tree<int, int> source, target;
+    reference_map map;
+    for (int key = 0; key < 1000; ++key) {
+        source.insert(node_value(key, key));
+        map.insert(node_value(key, key));
+    }
+    for (int key = 1; key < 1000; key += 2) {
+        auto handle = source.extract(key);
+        CHECK(!handle.empty() && handle.key() == key);
+        CHECK(target.insert(std::move(handle)).inserted);
+    }
+    CHECK(source.extract(1).empty());
+    CHECK(source.size() == 500 && target.size() == 500);
+    target.insert(node_value(0, -1));
+    source.merge(target);
+    // The key already in the source stays in the target.
+    CHECK(target.size() == 1 && target.begin()->second == -1);
+    CHECK(same_contents(source, map));
+}
+
+// Saving and loading the tree, and building it from the sorted elements.
+void test_save_load()
+{
+    avl::avl_tree<int, int> tree;
+    reference_map map;
+    for (int key = 0; key < 3000; key += 3) {
+        tree.insert(node_value(key, -key));
+        map.insert(node_value(key, -key));
+    }
+    std::stringstream stream;
+    tree.save(stream);
+    avl::avl_tree<int, int> loaded;
+    loaded.load(stream);
+    CHECK(same_contents(loaded, map));
+    CHECK(balanced_height(loaded.height(), loaded.size()));
+
+    avl::avl_tree<int, int> assigned;
+    assigned.assign(avl::sorted_unique, map.begin(), map.end());
+    CHECK(same_contents(assigned, map));
+    CHECK(balanced_height(assigned.height(), assigned.size()));
+}
+
+// The persistent tree against the map, with the snapshots checked against the copies of the map taken with them.
+void test_persistent_tree()
+{
+    avl::persistent_avl_tree<int, int> tree;
+    reference_map map;
+    std::vector<std::pair<avl::persistent_avl_tree<int, int>, reference_map>> snapshots;
+    std::mt19937 rng(31);
+    for (int step = 0; step < steps; ++step) {
+        const int key = static_cast<int>(rng() % key_range);
+        switch (rng() % 3) {
+        case 0:
+            CHECK(tree.insert(node_value(key, step)) == map.insert(node_value(key, step)).second);
+            break;
+        case 1:
+            tree.insert_or_assign(key, step);
+            map.insert_or_assign(key, step);
+            break;
+        default:
+            CHECK(tree.erase(key) == map.erase(key));
+        }
+        CHECK(tree.contains(key) == (map.count(key) == 1));
+        CHECK(same_position(tree.lower_bound(key), tree.end(), map.lower_bound(key), map.end()));
+        if (step % 1000 == 0)
+            snapshots.emplace_back(tree.snapshot(), map);
+    }
+    CHECK(same_contents(tree, map));
+    CHECK(balanced_height(tree.height(), tree.size()));
+    for (const auto &[snapshot, snapshot_map] : snapshots)
+        CHECK(same_contents(snapshot, snapshot_map));
+}
+
+// The sharded tree against the map, with the single-element and the batch operations.
+void test_sharded_tree()
+{
+    avl::sharded_avl_tree<int, int> tree({500, 1000, 1500});
+    reference_map map;
+    std::mt19937 rng(41);
+    for (int round = 0; round < 50; ++round) {
+        std::vector<node_value> batch;
+        for (int i = 0; i < 200; ++i)
+            batch.emplace_back(static_cast<int>(rng() % key_range), round);
+        std::size_t inserted = 0;
+        for (const auto &value : batch)
+            inserted += map.insert(value).second ? 1 : 0;
+        CHECK(tree.insert(batch.begin(), batch.end()) == inserted);
+
+        std::vector<int> keys;
+        for (int i = 0; i < 100; ++i)
+            keys.push_back(static_cast<int>(rng() % key_range));
+        const auto found = tree.find(keys);
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            const auto map_it = map.find(keys[i]);
+            CHECK(map_it == map.end() ? !found[i] : found[i] && *found[i] == map_it->second);
+        }
+        std::size_t erased = 0;
+        for (std::size_t i = 0; i < keys.size() / 2; ++i)
+            erased += map.erase(keys[i]);
+        CHECK(tree.erase(keys.begin(), keys.begin() + keys.size() / 2) == erased);
+
+        const int key = static_cast<int>(rng() % key_range);
+        CHECK(tree.erase(key) == map.erase(key));
+        CHECK(tree.contains(key) == (map.count(key) == 1));
+        CHECK(same_contents(tree, map));
+    }
+}
+
+int main()
+{
+    test_avl_trees();
+    test_btrees();
+    test_unequal_allocators<avl::avl_tree<int, int, std::less<int>, tagged_allocator<node_value>>>();
+    test_unequal_allocators<avl::btree<int, int, std::less<int>, tagged_allocator<node_value>>>();
+    test_throwing_lookups();
+    test_split_join<avl::avl_tree<int, int>>(51);
+    test_split_join<options_tree<avl::order_statistics_options>>(52);
+    test_set_operations();
+    test_node_handles();
+    test_save_load();
+    test_persistent_tree();
+    test_sharded_tree();
+    return check_status();
+}
@@ -0,0 +1,31 @@
+#ifndef AVL_TREE_TESTS_CHECK_H
+#define AVL_TREE_TESTS_CHECK_H
+
+#include <atomic>
+#include <iostream>
+
+// Minimal checking for the tests, which (unlike the assert) stays on in the release builds. A failed check is
+// reported and counted, and the test goes on, so one run shows all the failures. The checks may run on any thread.
+// The test returns "check_status()" from main.
+inline std::atomic<int> &check_failures() noexcept
+{
+    static std::atomic<int> failures{0};
+    return failures;
+}
+
+inline void check_failed(const char *condition, const char *file, int line)
+{
+    std::cerr << file << ":" << line << ": check failed: " << condition << "\n";
+    ++check_failures();
+}
+
+inline int check_status()
+{
+    if (check_failures() != 0)
+        std::cerr << check_failures() << " checks failed\n";
+    return check_failures() == 0 ? 0 : 1;
+}
+
+#define CHECK(condition) ((condition) ? void() : check_failed(#condition, __FILE__, __LINE__))
+
+#endif // AVL_TREE_TESTS_CHECK_H
@@ -0,0 +1,177 @@
+// Stress tests of the thread-safe containers, meant to be run under the thread sanitizer as well (see the
+// AVL_TREE_SANITIZE_THREAD option). Each thread modifies its own share of the keys and checks the results against its
+// own std::map, while the lookups go over all the keys. In the end, the container holds exactly the union of the
+// threads' maps.
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "concurrent_avl_tree.h"
+#include "instrumented_avl_tree.h"
+#include "optimistic_avl_tree.h"
+#include "sharded_avl_tree.h"
+#include "check.h"
+
+// GCC warns about the payload of the empty std::optional returned by the lookups of the optimistic tree, once they
+// are inlined here, though the payload is never read.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+constexpr int threads = 4;
+constexpr int key_range = 4000;
+constexpr int steps = 50'000;
+
+// The values are the keys plus a multiple of the key range, so a lookup of any key can tell a torn or misplaced
+// value from the right one.
+int value_of(int key, int step) { return key + key_range * step; }
+
+// Run the threads on the container, through the "insert" (returns whether the key was inserted), "assign", "erase"
+// (returns whether the key was erased) and "find" (returns the optional value) adaptors. Returns the expected contents.
+template <typename Insert, typename Assign, typename Erase, typename Find>
+std::map<int, int> stress(Insert &&insert, Assign &&assign, Erase &&erase, Find &&find)
+{
+    std::vector<std::map<int, int>> maps(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            auto &map = maps[t];
+            std::mt19937 rng(static_cast<unsigned>(t) + 1);
+            for (int step = 0; step < steps; ++step) {
+                // The keys of the thread are those congruent to its index.
+                const int key = static_cast<int>(rng() % (key_range / threads)) * threads + t;
+                const int value = value_of(key, step);
+                switch (rng() % 8) {
+                case 0:
+                case 1:
+                    CHECK(insert(key, value) == map.emplace(key, value).second);
+                    break;
+                case 2:
+                    assign(key, value);
+                    map[key] = value;
+                    break;
+                case 3:
+                case 4:
+                    CHECK(erase(key) == (map.erase(key) == 1));
+                    break;
+                default: {
+                    const auto own = find(key);
+                    const auto it = map.find(key);
+                    CHECK(it == map.end() ? !own : own && *own == it->second);
+                    // Any key of the other threads is either absent or holds one of its own values.
+                    const int other = static_cast<int>(rng() % key_range);
+                    const auto found = find(other);
+                    CHECK(!found || *found % key_range == other);
+                }
+                }
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+
+    std::map<int, int> expected;
+    for (const auto &map : maps)
+        expected.insert(map.begin(), map.end());
+    return expected;
+}
+
+template <typename Cmp>
+void test_optimistic_tree()
+{
+    avl::optimistic_avl_tree<int, int, Cmp> tree;
+    const auto expected = stress([&](int key, int value) { return tree.insert(key, value); },
+                                 [&](int key, int value) { tree.insert_or_assign(key, value); },
+                                 [&](int key) { return tree.erase(key).has_value(); },
+                                 [&](int key) { return tree.find(key); });
+    std::map<int, int> contents;
+    tree.for_each([&](int key, int value) { contents.emplace(key, value); });
+    CHECK(contents == expected);
+    CHECK(tree.size() == expected.size());
+}
+
+void test_concurrent_tree()
+{
+    avl::concurrent_avl_tree<int, int> tree;
+    const auto expected = stress([&](int key, int value) { return tree.insert({key, value}); },
+                                 [&](int key, int value) { tree.insert_or_assign(key, value); },
+                                 [&](int key) { return tree.erase(key) == 1; },
+                                 [&](int key) { return tree.find(key); });
+    tree.read([&](const auto &contents) {
+        CHECK(contents.size() == expected.size() && std::equal(contents.cbegin(), contents.cend(), expected.begin()));
+    });
+}
+
+// The sharded tree runs the batches on the worker threads of its shards.
+void test_sharded_tree()
+{
+    avl::sharded_avl_tree<int, int> tree({1000, 2000, 3000});
+    std::map<int, int> expected;
+    std::mt19937 rng(7);
+    for (int round = 0; round < 100; ++round) {
+        std::vector<std::pair<const int, int>> batch;
+        std::vector<int> keys;
+        for (int i = 0; i < 400; ++i) {
+            const int key = static_cast<int>(rng() % key_range);
+            batch.emplace_back(key, value_of(key, round));
+            keys.push_back(static_cast<int>(rng() % key_range));
+        }
+        tree.insert(batch.begin(), batch.end());
+        expected.insert(batch.begin(), batch.end());
+        const auto found = tree.find(keys);
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            const auto it = expected.find(keys[i]);
+            CHECK(it == expected.end() ? !found[i] : found[i] && *found[i] == it->second);
+        }
+        tree.erase(keys.begin(), keys.begin() + 100);
+        for (auto it = keys.begin(); it != keys.begin() + 100; ++it)
+            expected.erase(*it);
+    }
+    CHECK(tree.size() == expected.size() && std::equal(tree.begin(), tree.end(), expected.begin()));
+}
+
+// The threads record into the per-thread histograms (more threads than there are histograms over the test, so the
+// slots of the exited threads are reused) while another thread merges them.
+void test_latency_histograms()
+{
+    avl::thread_latency_histograms histograms;
+    constexpr int rounds = 20;
+    constexpr int values = 10'000;
+    std::atomic<bool> done{false};
+    std::thread reader([&] {
+        while (!done)
+            CHECK(histograms.merged().count() <= std::uint64_t{rounds} * threads * values);
+    });
+    for (int round = 0; round < rounds; ++round) {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t)
+            workers.emplace_back([&] {
+                for (int i = 1; i <= values; ++i)
+                    histograms.record(static_cast<std::uint64_t>(i));
+            });
+        for (auto &worker : workers)
+            worker.join();
+    }
+    done = true;
+    reader.join();
+    const auto merged = histograms.merged();
+    CHECK(merged.count() == std::uint64_t{rounds} * threads * values);
+    CHECK(merged.max() == values);
+}
+
+int main()
+{
+    test_optimistic_tree<std::less<int>>();
+    test_optimistic_tree<avl::three_way_compare<int>>();
+    test_concurrent_tree();
+    test_sharded_tree();
+    test_latency_histograms();
+    return check_status();
+}
@@ -0,0 +1,155 @@
+// Recovery tests of the "durable_avl_tree": the tree reopened from its files holds exactly the modifications that
+// returned, after the clean shutdowns, the torn log records and the crashes in the middle of a checkpoint.
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "durable_avl_tree.h"
+#include "check.h"
+
+using durable_tree = avl::durable_avl_tree<int, int>;
+
+// Base path of the tree files, unique to the test process.
+std::string tree_path(const char *name)
+{
+    return (std::filesystem::temp_directory_path() / ("avl_durable_test_" + std::to_string(::getpid()) + "_" + name))
+        .string();
+}
+
+void remove_files(const std::string &path)
+{
+    std::remove((path + ".log").c_str());
+    std::remove((path + ".checkpoint").c_str());
+}
+
+bool same_contents(const durable_tree &tree, const std::map<int, int> &map)
+{
+    return tree.read([&](const auto &contents) {
+        return contents.size() == map.size() && std::equal(contents.cbegin(), contents.cend(), map.begin());
+    });
+}
+
+// The modifications of several threads, some of them logged after a checkpoint, survive the reopening.
+void test_reopen()
+{
+    const auto path = tree_path("reopen");
+    remove_files(path);
+    std::map<int, int> expected;
+    {
+        durable_tree tree(path, {std::chrono::microseconds(100), 500});
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; ++t)
+            writers.emplace_back([&, t] {
+                for (int i = 0; i < 300; ++i) {
+                    const int key = i * 4 + t;
+                    tree.insert_or_assign(key, i);
+                    if (i % 3 == 0)
+                        tree.erase(key);
+                }
+            });
+        for (auto &writer : writers)
+            writer.join();
+        for (int key = 0; key < 1200; ++key)
+            if (key / 4 % 3 != 0)
+                expected[key] = key / 4;
+        CHECK(same_contents(tree, expected));
+        tree.checkpoint();
+        tree.clear();
+        expected.clear();
+        CHECK(tree.emplace(std::make_pair(7, 70)));
+        CHECK(!tree.try_emplace(7, 71));
+        CHECK(tree.erase(8) == 0);
+        expected[7] = 70;
+    }
+    {
+        durable_tree tree(path);
+        CHECK(same_contents(tree, expected));
+        CHECK(tree.at(7) == 70 && !tree.find(8));
+    }
+    remove_files(path);
+}
+
+// The torn record at the end of the log is dropped, and the log goes on after the last complete record.
+void test_torn_record()
+{
+    const auto path = tree_path("torn");
+    remove_files(path);
+    {
+        durable_tree tree(path, {std::chrono::microseconds(0), 0});
+        tree.insert_or_assign(1, 10);
+        tree.insert_or_assign(2, 20);
+    }
+    {
+        std::ofstream log(path + ".log", std::ios::binary | std::ios::app);
+        const char torn[] = {1, 3, 0};
+        log.write(torn, sizeof(torn));
+    }
+    {
+        durable_tree tree(path, {std::chrono::microseconds(0), 0});
+        CHECK(same_contents(tree, {{1, 10}, {2, 20}}));
+        tree.erase(1);
+    }
+    {
+        durable_tree tree(path);
+        CHECK(same_contents(tree, {{2, 20}}));
+    }
+    remove_files(path);
+}
+
+// The crash after the new checkpoint replaced the old one, but before the log was emptied. The last modification
+// triggers the checkpoint, so its record is still pending when the tree is saved - the log must not bring back the
+// erased key or the old value over the checkpoint.
+void test_crash_in_checkpoint()
+{
+    const auto path = tree_path("crash");
+    for (int erase_last : {0, 1}) {
+        remove_files(path);
+        avl::durability_options options{std::chrono::microseconds(0), 3};
+        options.checkpoint_replaced = [] { throw std::runtime_error("crash"); };
+        {
+            durable_tree tree(path, options);
+            tree.insert_or_assign(1, 10);
+            tree.insert_or_assign(2, 20);
+            bool crashed = false;
+            try {
+                if (erase_last)
+                    tree.erase(2);
+                else
+                    tree.insert_or_assign(1, 11);
+            } catch (const std::runtime_error &) {
+                crashed = true;
+            }
+            CHECK(crashed);
+        }
+        const std::map<int, int> expected =
+            erase_last ? std::map<int, int>{{1, 10}} : std::map<int, int>{{1, 11}, {2, 20}};
+        {
+            durable_tree tree(path, {std::chrono::microseconds(0), 0});
+            CHECK(same_contents(tree, expected));
+            tree.insert_or_assign(3, 30);
+        }
+        {
+            durable_tree tree(path);
+            auto with_next = expected;
+            with_next[3] = 30;
+            CHECK(same_contents(tree, with_next));
+        }
+    }
+    remove_files(path);
+}
+
+int main()
+{
+    test_reopen();
+    test_torn_record();
+    test_crash_in_checkpoint();
+    return check_status();
+}
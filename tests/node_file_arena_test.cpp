@@ -0,0 +1,135 @@
+// Tests of the "file_arena": the tree reopened from the arena file holds the elements it was destroyed with, and
+// the files with the corrupted headers are rejected instead of being mapped and followed.
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+#include "avl_tree.h"
+#include "node_file_arena.h"
+#include "check.h"
+
+using file_allocator = avl::file_arena_allocator<std::pair<const int, int>>;
+using file_tree = avl::avl_tree<int, int, std::less<int>, file_allocator>;
+
+// Offsets of the header fields in the arena file.
+constexpr std::streamoff element_size_offset = 8;
+constexpr std::streamoff used_offset = 24;
+constexpr std::streamoff free_list_offset = 32;
+constexpr std::streamoff root_offset = 36;
+constexpr std::streamoff size_offset = 40;
+
+const std::string path =
+    (std::filesystem::temp_directory_path() / ("avl_file_arena_test_" + std::to_string(::getpid()))).string();
+
+// Create the arena file with a tree of "count" even keys, with the nodes of the odd keys freed. The arena has room
+// for the sentinel too.
+void create_file(int count)
+{
+    file_tree tree(file_allocator(std::make_shared<avl::file_arena>(path, 2 * count + 1)));
+    for (int key = 0; key < 2 * count; ++key)
+        tree.insert({key, -key});
+    for (int key = 1; key < 2 * count; key += 2)
+        tree.erase(tree.find(key));
+}
+
+template <typename FieldT>
+void overwrite(std::streamoff offset, FieldT value)
+{
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(offset);
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+bool rejected()
+{
+    try {
+        avl::file_arena arena(path);
+    } catch (const std::runtime_error &) {
+        return true;
+    }
+    return false;
+}
+
+void test_reopen()
+{
+    create_file(1000);
+    file_tree tree(file_allocator(std::make_shared<avl::file_arena>(path)));
+    CHECK(tree.size() == 1000);
+    int expected = 0;
+    bool in_order = true;
+    for (auto it = tree.begin(); it != tree.end(); ++it, expected += 2)
+        in_order = in_order && it->first == expected && it->second == -expected;
+    CHECK(in_order);
+    // The freed nodes are reused.
+    const auto used = tree.get_allocator().arena()->used();
+    for (int key = 1; key < 200; key += 2)
+        tree.insert({key, -key});
+    CHECK(tree.get_allocator().arena()->used() == used);
+}
+
+void test_corrupted_headers()
+{
+    create_file(100);
+    CHECK(!rejected());
+    std::uint64_t used = 0;
+    {
+        std::ifstream file(path, std::ios::binary);
+        file.seekg(used_offset);
+        file.read(reinterpret_cast<char *>(&used), sizeof(used));
+    }
+
+    overwrite(root_offset, static_cast<std::uint32_t>(used));
+    CHECK(rejected());
+    create_file(100);
+    overwrite(free_list_offset, static_cast<std::uint32_t>(used + 7));
+    CHECK(rejected());
+    create_file(100);
+    overwrite(size_offset, used + 1);
+    CHECK(rejected());
+    create_file(100);
+    // The file size computed from the huge element size wraps around.
+    overwrite(element_size_offset, std::numeric_limits<std::uint64_t>::max() / 2);
+    CHECK(rejected());
+    create_file(100);
+    overwrite(element_size_offset, std::uint64_t{0});
+    CHECK(rejected());
+
+    // The links of the free list inside the elements are checked when they are followed.
+    create_file(100);
+    {
+        avl::file_arena arena(path);
+        std::uint64_t element_size = 0;
+        std::ifstream file(path, std::ios::binary);
+        file.seekg(element_size_offset);
+        file.read(reinterpret_cast<char *>(&element_size), sizeof(element_size));
+        auto *element = arena.allocate(static_cast<std::size_t>(element_size));
+        arena.deallocate(element);
+        const auto bad_link = static_cast<std::uint32_t>(used + 3);
+        std::memcpy(element, &bad_link, sizeof(bad_link));
+        bool thrown = false;
+        try {
+            arena.allocate(static_cast<std::size_t>(element_size));
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        CHECK(thrown);
+    }
+    std::remove(path.c_str());
+}
+
+int main()
+{
+    test_reopen();
+    test_corrupted_headers();
+    std::remove(path.c_str());
+    return check_status();
+}